@@ -0,0 +1,340 @@
+//
+// pmalloc_bench - Single threaded allocation benchmark over a set of synthetic workloads
+//
+// Each workload is generated up front as a trace of malloc/realloc/free operations on numbered slots,
+// from a fixed seed, and the same trace is replayed against each pmalloc engine and the C library's
+// malloc. Every operation is timed individually for the latency percentiles.
+//
+// Reported per workload and allocator:
+//   ops/sec      operations per second, counting only time spent in the allocator
+//   p50/p99/p999 per operation latency percentiles in nanoseconds
+//   peak KB      the most memory in use at once, headers and padding included
+//   overhead     peak KB over the peak number of bytes the trace had live at once
+//   frag         the share of the heap in use that is free holes, rather than the free space at its end, once the
+//                workload has run (before the trace frees what's left). The largest free block stands in for
+//                the end of the heap in pmalloc, and the top chunk in the C library.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+	#include <malloc.h>
+#endif
+
+#include "pmalloc.h"
+
+#define HEAP_SIZE (512 * 1024 * 1024)
+#define SLOTS 4096
+#define DEFAULT_OPS 1000000
+#define SAMPLE_EVERY 256    // How often the C library's usage is sampled, it's too slow to ask after every operation
+
+typedef enum bench_op_type {
+	BENCH_MALLOC,
+	BENCH_REALLOC,
+	BENCH_FREE,
+} bench_op_type_t;
+
+typedef struct bench_op {
+	uint32_t type;
+	uint32_t slot;
+	uint32_t size;
+} bench_op_t;
+
+typedef struct bench_trace {
+	const char *name;
+	bench_op_t *ops;
+	uint32_t count;
+	uint32_t workload;  // The number of ops before the trace frees what's left
+	uint64_t peakLive;  // The most bytes the trace has allocated at once
+} bench_trace_t;
+
+typedef struct bench_result {
+	double opsPerSec;
+	uint32_t p50, p99, p999;
+	uint64_t peakUsed;
+	double frag;        // Negative if not known
+} bench_result_t;
+
+// The allocator under test: a pmalloc engine, or the C library when heap is NULL
+static pmalloc_t *heap;
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+// A uniform random number in [0, 1)
+static double bench_uniform(uint32_t *seed)
+{
+	return (bench_rand(seed) & 0xFFFFFF) / (double)0x1000000;
+}
+
+// Trace generation
+
+typedef struct bench_builder {
+	bench_trace_t *trace;
+	uint32_t capacity;
+	uint32_t sizes[SLOTS];  // The live size of each slot, 0 if empty
+	uint64_t live;
+} bench_builder_t;
+
+static void bench_emit(bench_builder_t *b, bench_op_type_t type, uint32_t slot, uint32_t size)
+{
+	bench_trace_t *trace = b->trace;
+	if(trace->count == b->capacity) return;
+
+	trace->ops[trace->count].type = type;
+	trace->ops[trace->count].slot = slot;
+	trace->ops[trace->count].size = size;
+	trace->count++;
+
+	b->live -= b->sizes[slot];
+	b->sizes[slot] = type == BENCH_FREE ? 0 : size;
+	b->live += b->sizes[slot];
+	if(b->live > trace->peakLive) trace->peakLive = b->live;
+}
+
+// Replace a slot: free it if it's in use, otherwise allocate it
+static void bench_toggle(bench_builder_t *b, uint32_t slot, uint32_t size)
+{
+	if(b->sizes[slot] != 0) bench_emit(b, BENCH_FREE, slot, 0);
+	else bench_emit(b, BENCH_MALLOC, slot, size);
+}
+
+// Small objects of uniformly distributed size
+static void bench_gen_uniform(bench_builder_t *b, uint32_t *seed)
+{
+	while(b->trace->count < b->capacity) {
+		uint32_t slot = bench_rand(seed) % SLOTS;
+		bench_toggle(b, slot, 16 + bench_rand(seed) % 113);
+	}
+}
+
+// Sizes from a Pareto distribution: mostly small, with a long tail of large blocks
+static void bench_gen_powerlaw(bench_builder_t *b, uint32_t *seed)
+{
+	while(b->trace->count < b->capacity) {
+		uint32_t slot = bench_rand(seed) % SLOTS;
+		double size = 16.0 / pow(1.0 - bench_uniform(seed), 1.0 / 1.1);
+		bench_toggle(b, slot, size > 65536 ? 65536 : (uint32_t)size);
+	}
+}
+
+// A FIFO queue whose depth wanders up and down: blocks are freed in the order they were allocated
+static void bench_gen_prodcons(bench_builder_t *b, uint32_t *seed)
+{
+	uint32_t head = 0, tail = 0;
+	while(b->trace->count < b->capacity) {
+		uint32_t depth = tail - head;
+		// Bias towards producing when the queue is short, consuming when it's long
+		int produce = depth == 0 || (depth < SLOTS && bench_rand(seed) % SLOTS >= depth);
+		if(produce) bench_emit(b, BENCH_MALLOC, tail++ % SLOTS, 32 + bench_rand(seed) % 481);
+		else bench_emit(b, BENCH_FREE, head++ % SLOTS, 0);
+	}
+}
+
+// Vector-like growth: buffers doubling in size with realloc until they reach a random cap, then freed
+static void bench_gen_realloc(bench_builder_t *b, uint32_t *seed)
+{
+	uint32_t caps[64];
+	for(uint32_t i = 0; i < 64; i++) caps[i] = 1024U << (bench_rand(seed) % 8);
+
+	while(b->trace->count < b->capacity) {
+		uint32_t slot = bench_rand(seed) % 64;
+		if(b->sizes[slot] == 0) bench_emit(b, BENCH_MALLOC, slot, 16);
+		else if(b->sizes[slot] < caps[slot]) bench_emit(b, BENCH_REALLOC, slot, b->sizes[slot] * 2);
+		else {
+			bench_emit(b, BENCH_FREE, slot, 0);
+			caps[slot] = 1024U << (bench_rand(seed) % 8);
+		}
+	}
+}
+
+// A long running mix: a few long lived blocks that rarely change among many short lived ones of very different sizes
+static void bench_gen_fragment(bench_builder_t *b, uint32_t *seed)
+{
+	while(b->trace->count < b->capacity) {
+		uint32_t slot;
+		if(bench_rand(seed) % 64 == 0) slot = bench_rand(seed) % 256;
+		else slot = 256 + bench_rand(seed) % (SLOTS - 256);
+
+		uint32_t size = bench_rand(seed) % 4 == 0 ? 1024 + bench_rand(seed) % 15361 : 16 + bench_rand(seed) % 241;
+		bench_toggle(b, slot, size);
+	}
+}
+
+static void bench_generate(bench_trace_t *trace, const char *name, void (*generate)(bench_builder_t*, uint32_t*), uint32_t count)
+{
+	static bench_builder_t b;
+	uint32_t seed = 1;
+
+	memset(&b, 0, sizeof(b));
+	b.trace = trace;
+	b.capacity = count;
+
+	trace->name = name;
+	trace->ops = malloc(sizeof(bench_op_t) * (count + SLOTS));
+	trace->count = 0;
+	trace->peakLive = 0;
+
+	generate(&b, &seed);
+	trace->workload = trace->count;
+
+	// Free whatever is left, outside the op count so every allocator ends empty
+	b.capacity += SLOTS;
+	for(uint32_t slot = 0; slot < SLOTS; slot++) if(b.sizes[slot] != 0) bench_emit(&b, BENCH_FREE, slot, 0);
+}
+
+// Replay
+
+static inline void *bench_malloc(uint32_t size) { return heap ? pmalloc_malloc(heap, size) : malloc(size); }
+static inline void *bench_realloc(void *ptr, uint32_t size) { return heap ? pmalloc_realloc(heap, ptr, size) : realloc(ptr, size); }
+static inline void bench_free(void *ptr) { if(heap) pmalloc_free(heap, ptr); else free(ptr); }
+
+static uint64_t bench_used(void)
+{
+	if(heap) return pmalloc_usedmem(heap);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+// The share of the used heap that is holes, or negative if not known
+static double bench_frag(void)
+{
+	if(heap) {
+		uint64_t holes = pmalloc_freemem(heap) - pmalloc_largestfree(heap);
+		return (double)holes / (pmalloc_usedmem(heap) + holes);
+	}
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+	uint64_t holes = info.fordblks - info.keepcost;
+	return info.uordblks + holes == 0 ? 0 : (double)holes / (info.uordblks + holes);
+#else
+	return -1;
+#endif
+}
+
+static inline uint64_t bench_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_replay(bench_trace_t *trace, uint32_t *latency, bench_result_t *result)
+{
+	static void *slots[SLOTS];
+	memset(slots, 0, sizeof(slots));
+
+	uint64_t base = bench_used(), total = 0;
+	result->peakUsed = 0;
+	result->frag = -1;
+
+	for(uint32_t i = 0; i < trace->count; i++) {
+		bench_op_t *op = &trace->ops[i];
+
+		uint64_t start = bench_ns();
+		switch(op->type) {
+			case BENCH_MALLOC: slots[op->slot] = bench_malloc(op->size); break;
+			case BENCH_REALLOC: {
+				void *ptr = bench_realloc(slots[op->slot], op->size);
+				if(ptr != NULL) slots[op->slot] = ptr;
+				break;
+			}
+			case BENCH_FREE: bench_free(slots[op->slot]); slots[op->slot] = NULL; break;
+		}
+		uint64_t elapsed = bench_ns() - start;
+
+		latency[i] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+		total += elapsed;
+
+		if(heap != NULL || i % SAMPLE_EVERY == 0) {
+			uint64_t used = bench_used() - base;
+			if(used > result->peakUsed) result->peakUsed = used;
+		}
+
+		if(i + 1 == trace->workload) result->frag = bench_frag();
+	}
+
+	qsort(latency, trace->count, sizeof(uint32_t), bench_compare);
+	result->p50 = latency[trace->count / 2];
+	result->p99 = latency[(uint64_t)trace->count * 99 / 100];
+	result->p999 = latency[(uint64_t)trace->count * 999 / 1000];
+	result->opsPerSec = trace->count / (total / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : DEFAULT_OPS;
+	if(count < 1000) count = 1000;
+
+	char *memory = malloc(HEAP_SIZE);
+	uint32_t *latency = malloc(sizeof(uint32_t) * (count + SLOTS));
+	if(memory == NULL || latency == NULL) return 1;
+
+	static const struct { const char *name; void (*generate)(bench_builder_t*, uint32_t*); } workloads[] = {
+		{ "uniform", bench_gen_uniform },
+		{ "powerlaw", bench_gen_powerlaw },
+		{ "prodcons", bench_gen_prodcons },
+		{ "realloc", bench_gen_realloc },
+		{ "fragment", bench_gen_fragment },
+	};
+
+	// quick is the largest block size to defer coalescing for, see pmalloc_set_quick
+	static const struct { const char *name; int engine; uint32_t quick; } allocators[] = {
+		{ "segregated", PMALLOC_ENGINE_SEGREGATED, 0 },
+		{ "seg+quick", PMALLOC_ENGINE_SEGREGATED, 256 },
+		{ "tlsf", PMALLOC_ENGINE_TLSF, 0 },
+		{ "bestfit", PMALLOC_ENGINE_BESTFIT, 0 },
+		{ "libc", -1, 0 },
+	};
+
+	printf("pmalloc: Workload Benchmark (%d ops per workload)\n\n", count);
+	printf("%-10s %-11s %12s %7s %7s %7s %10s %9s %6s\n", "workload", "allocator", "ops/sec", "p50", "p99", "p999", "peak KB", "overhead", "frag");
+
+	for(uint32_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		bench_trace_t trace;
+		bench_generate(&trace, workloads[w].name, workloads[w].generate, count);
+
+		for(uint32_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+			pmalloc_t pm;
+			heap = NULL;
+			if(allocators[a].engine >= 0) {
+				pmalloc_init(&pm);
+				pmalloc_set_engine(&pm, (pmalloc_engine_t)allocators[a].engine);
+				pmalloc_set_quick(&pm, allocators[a].quick, 0);
+				pmalloc_addblock(&pm, memory, HEAP_SIZE);
+				heap = &pm;
+			}
+
+			bench_result_t result;
+			bench_replay(&trace, latency, &result);
+
+			printf("%-10s %-11s %12.0f %7u %7u %7u %10llu %8.2fx ", trace.name, allocators[a].name, result.opsPerSec,
+				result.p50, result.p99, result.p999, (unsigned long long)(result.peakUsed / 1024), (double)result.peakUsed / trace.peakLive);
+			if(result.frag >= 0) printf("%6.2f\n", result.frag); else printf("%6s\n", "-");
+		}
+
+		printf("\n");
+		free(trace.ops);
+	}
+
+	free(latency);
+	free(memory);
+	return 0;
+}
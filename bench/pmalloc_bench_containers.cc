@@ -0,0 +1,76 @@
+//
+// pmalloc_bench_containers - Standard containers on pmalloc::allocator against std::allocator
+//
+// Each round fills a vector by push_back, a map with keys in a scattered order before erasing a third
+// of them, and a list used as a queue, so the allocator sees growing buffers and lots of small nodes.
+// The same rounds run on std::allocator and on pmalloc::allocator over a heap with quick lists, and the
+// sums they produce are compared to be sure both did the same work.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "pmalloc.hpp"
+
+#define HEAP_SIZE (8 * 1024 * 1024)
+#define DEFAULT_ROUNDS 50
+
+template <template <class> class A>
+static uint64_t bench_containers(uint32_t rounds, double *seconds, A<int> ints, A<std::pair<const int, int>> pairs)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t sum = 0;
+
+	for(uint32_t r = 0; r < rounds; r++) {
+		std::vector<int, A<int>> vec(ints);
+		for(int i = 0; i < 10000; i++) vec.push_back(i);
+		sum += vec[r % 10000];
+
+		std::map<int, int, std::less<int>, A<std::pair<const int, int>>> map(pairs);
+		for(int i = 0; i < 2000; i++) map[(i * 7919) % 2000] = i;
+		for(int i = 0; i < 2000; i += 3) map.erase(i);
+		sum += map.size();
+
+		std::list<int, A<int>> list(ints);
+		for(int i = 0; i < 2000; i++) list.push_back(i);
+		while(list.size() > 100) {
+			sum += list.front();
+			list.pop_front();
+		}
+	}
+
+	*seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t rounds = argc > 1 ? (uint32_t)atoi(argv[1]) : DEFAULT_ROUNDS;
+	if(rounds < 1) rounds = 1;
+
+	char *memory = (char*)malloc(HEAP_SIZE);
+	if(memory == NULL) return 1;
+
+	pmalloc::heap heap(memory, HEAP_SIZE);
+	pmalloc_set_quick(heap, 256, 65536);
+
+	double stdSeconds, pmSeconds;
+	uint64_t stdSum = bench_containers<std::allocator>(rounds, &stdSeconds, std::allocator<int>(), std::allocator<std::pair<const int, int>>());
+	uint64_t pmSum = bench_containers<pmalloc::allocator>(rounds, &pmSeconds, pmalloc::allocator<int>(heap), pmalloc::allocator<std::pair<const int, int>>(heap));
+	if(pmSum != stdSum) {
+		fprintf(stderr, "pmalloc_bench_containers: The containers did different work on each allocator\n");
+		return 1;
+	}
+
+	printf("pmalloc: Container Benchmark (vector, map and list x %u rounds)\n\n", rounds);
+	printf("%20s %12s %10s\n", "allocator", "ms", "speedup");
+	printf("%20s %12.2f\n", "std::allocator", stdSeconds * 1000);
+	printf("%20s %12.2f %9.2fx\n", "pmalloc::allocator", pmSeconds * 1000, stdSeconds / pmSeconds);
+
+	free(memory);
+	return 0;
+}
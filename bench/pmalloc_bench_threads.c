@@ -0,0 +1,162 @@
+//
+// pmalloc_bench_threads - Small allocation throughput against thread count
+//
+// Each thread repeatedly replaces a random slot of its own working set with a new block of a random
+// small size, and every few operations hands a block to the next thread to free, so that cross-thread
+// frees are exercised too. Compares a single pmalloc_t behind a global mutex with pmalloc_mt, and with
+// pmalloc_sharded using a shard per CPU.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pmalloc.h"
+#include "pmalloc_mt.h"
+#include "pmalloc_sharded.h"
+
+#define HEAP_SIZE (256 * 1024 * 1024)
+#define MAX_THREADS 64
+#define WORKING_SET 256
+#define OPS_PER_THREAD 1000000
+#define HANDOFF_EVERY 16
+
+typedef struct bench_thread {
+	pthread_t thread;
+	uint32_t index;
+	uint32_t seed;
+	void *handoff;  // A block left by the previous thread for this one to free
+} bench_thread_t;
+
+static int mode;                // 0: global mutex, 1: pmalloc_mt, 2: pmalloc_sharded
+static uint32_t nthreads;
+static bench_thread_t threads[MAX_THREADS];
+
+static pmalloc_t global;
+static pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+static pmalloc_mt_t mt;
+static pmalloc_sharded_t sharded;
+static uint32_t nshards;
+
+static void *bench_malloc(uint32_t size)
+{
+	if(mode == 1) return pmalloc_mt_malloc(&mt, size);
+	if(mode == 2) return pmalloc_sharded_malloc(&sharded, size);
+	pthread_mutex_lock(&globalLock);
+	void *ptr = pmalloc_malloc(&global, size);
+	pthread_mutex_unlock(&globalLock);
+	return ptr;
+}
+
+static void bench_free(void *ptr)
+{
+	if(mode == 1) { pmalloc_mt_free(&mt, ptr); return; }
+	if(mode == 2) { pmalloc_sharded_free(&sharded, ptr); return; }
+	pthread_mutex_lock(&globalLock);
+	pmalloc_free(&global, ptr);
+	pthread_mutex_unlock(&globalLock);
+}
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *self = (bench_thread_t*)arg;
+	bench_thread_t *next = &threads[(self->index + 1) % nthreads];
+	void *slots[WORKING_SET] = { NULL };
+
+	for(uint32_t op = 0; op < OPS_PER_THREAD; op++) {
+		uint32_t slot = bench_rand(&self->seed) % WORKING_SET;
+
+		if(op % HANDOFF_EVERY == 0) {
+			// Pass the block to the next thread, freeing whatever it hasn't collected yet ourselves
+			void *old = __atomic_exchange_n(&next->handoff, slots[slot], __ATOMIC_ACQ_REL);
+			if(old != NULL) bench_free(old);
+			void *mine = __atomic_exchange_n(&self->handoff, NULL, __ATOMIC_ACQ_REL);
+			if(mine != NULL) bench_free(mine);
+		} else if(slots[slot] != NULL) {
+			bench_free(slots[slot]);
+		}
+
+		slots[slot] = bench_malloc(8 + bench_rand(&self->seed) % 248);
+	}
+
+	for(uint32_t slot = 0; slot < WORKING_SET; slot++) if(slots[slot] != NULL) bench_free(slots[slot]);
+	return NULL;
+}
+
+static double bench_run(char *memory, uint32_t count)
+{
+	nthreads = count;
+
+	if(mode == 1) {
+		pmalloc_mt_init(&mt);
+		pmalloc_mt_addblock(&mt, memory, HEAP_SIZE);
+	} else if(mode == 2) {
+		pmalloc_sharded_init(&sharded, nshards);
+		pmalloc_sharded_addblock(&sharded, memory, HEAP_SIZE);
+	} else {
+		pmalloc_init(&global);
+		pmalloc_addblock(&global, memory, HEAP_SIZE);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(uint32_t i = 0; i < count; i++) {
+		threads[i].index = i;
+		threads[i].seed = i + 1;
+		threads[i].handoff = NULL;
+		pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+	}
+	for(uint32_t i = 0; i < count; i++) pthread_join(threads[i].thread, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for(uint32_t i = 0; i < count; i++) if(threads[i].handoff != NULL) bench_free(threads[i].handoff);
+	if(mode == 1) pmalloc_mt_destroy(&mt);
+	if(mode == 2) pmalloc_sharded_destroy(&sharded);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return (double)count * OPS_PER_THREAD / seconds;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t maxThreads = argc > 1 ? (uint32_t)atoi(argv[1]) : 8;
+	if(maxThreads < 1) maxThreads = 1;
+	if(maxThreads > MAX_THREADS) maxThreads = MAX_THREADS;
+
+	char *memory = malloc(HEAP_SIZE);
+	if(memory == NULL) return 1;
+
+	// A shard per CPU unless told otherwise
+	long cpus = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	nshards = cpus < 1 ? 1 : cpus > PMALLOC_SHARDED_MAX ? PMALLOC_SHARDED_MAX : (uint32_t)cpus;
+
+	printf("pmalloc: Thread Scaling Benchmark (%d ops per thread, malloc+free pairs, %u shards)\n\n", OPS_PER_THREAD, nshards);
+	printf("%8s %18s %18s %10s %18s %10s %10s\n", "threads", "mutex ops/sec", "pmalloc_mt ops/sec", "speedup", "sharded ops/sec", "speedup", "scaling");
+
+	double single = 0;
+	for(uint32_t count = 1; count <= maxThreads; count *= 2) {
+		mode = 0;
+		double locked = bench_run(memory, count);
+		mode = 1;
+		double cached = bench_run(memory, count);
+		mode = 2;
+		double shards = bench_run(memory, count);
+		if(count == 1) single = shards;
+
+		// Scaling is sharded throughput relative to one thread's, ideally the thread count while there are cores to go round
+		printf("%8d %18.0f %18.0f %9.2fx %18.0f %9.2fx %9.2fx\n", count, locked, cached, cached / locked, shards, shards / locked, shards / single);
+	}
+
+	free(memory);
+	return 0;
+}
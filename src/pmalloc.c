@@ -11,73 +11,657 @@
 // allocation.
 //
 
+// For mremap
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+
 #include "pmalloc.h"
 
 #ifdef DEBUG
 	#include <stdio.h>
 #endif
 
+// pmalloc_trim hands the pages of big free blocks back to the OS where there is one
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(PMALLOC_NO_MADVISE)
+	#define PMALLOC_MADVISE
+#endif
+
+// And big allocations can have a mapping of their own, see pmalloc_set_mmap_threshold
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(PMALLOC_NO_MMAP)
+	#define PMALLOC_MMAP
+#endif
+
+#if defined(PMALLOC_MADVISE) || defined(PMALLOC_MMAP)
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+#ifdef PMALLOC_TRACE
+	#include "pmalloc_trace.h"
+	#define PMALLOC_TRACE_RECORD(pm, op, ptr, size, aux, result) do { if((pm)->trace) pmalloc_trace_record((pm)->trace, op, ptr, size, aux, result); } while(0)
+#else
+	#define PMALLOC_TRACE_RECORD(pm, op, ptr, size, aux, result) do { } while(0)
+#endif
+
+// Statistics: count calls and what they did, see pmalloc_stats.h
+#ifdef PMALLOC_STATS
+	#define PMALLOC_STAT(pm, op) do { (pm)->counters.op; } while(0)
+#else
+	#define PMALLOC_STAT(pm, op) do { } while(0)
+#endif
+
+// Bin links of a free block. In the compact layout they live at the start of its payload rather than in the header.
+#ifdef PMALLOC_COMPACT
+	#define PMALLOC_LINK_PREV(node) (((PMALLOC_REF(pmalloc_item_t)*)((char*)(node) + sizeof(pmalloc_item_t)))[0])
+	#define PMALLOC_LINK_NEXT(node) (((PMALLOC_REF(pmalloc_item_t)*)((char*)(node) + sizeof(pmalloc_item_t)))[1])
+	#define PMALLOC_PAYLOAD_LINKS 2
+#else
+	#define PMALLOC_LINK_PREV(node) ((node)->prev)
+	#define PMALLOC_LINK_NEXT(node) ((node)->next)
+	#define PMALLOC_PAYLOAD_LINKS 0
+#endif
+#define PMALLOC_GET_PREV(pm, node) PMALLOC_DEREF(pm, pmalloc_item_t, PMALLOC_LINK_PREV(node))
+#define PMALLOC_GET_NEXT(pm, node) PMALLOC_DEREF(pm, pmalloc_item_t, PMALLOC_LINK_NEXT(node))
+#define PMALLOC_SET_PREV(pm, node, ptr) (PMALLOC_LINK_PREV(node) = PMALLOC_REFER(pm, ptr))
+#define PMALLOC_SET_NEXT(pm, node, ptr) (PMALLOC_LINK_NEXT(node) = PMALLOC_REFER(pm, ptr))
+
+// The heads of the bins and quick lists, and the root of the best fit tree
+#define PMALLOC_BIN(pm, i) PMALLOC_DEREF(pm, pmalloc_item_t, (pm)->bins[i])
+#define PMALLOC_QUICK(pm, i) PMALLOC_DEREF(pm, pmalloc_item_t, (pm)->quick[i])
+#define PMALLOC_ROOT(pm) PMALLOC_DEREF(pm, pmalloc_item_t, (pm)->tree)
+
+// Every block, header and payload, is a multiple of PMALLOC_ALIGN long and starts PMALLOC_ALIGN bytes
+// before an aligned address, less the header, so that every payload is aligned
+#define PMALLOC_ROUND(x) (((x) + PMALLOC_ALIGN - 1) & ~(uintptr_t)(PMALLOC_ALIGN - 1))
+
+// Boundary tags: the block physically after node, the footer at the end of a free block's payload,
+// and the block physically before node (only valid when node has PMALLOC_FLAG_PREV_FREE set)
+#define PMALLOC_NEXT(node) ((pmalloc_item_t*)((char*)(node) + sizeof(pmalloc_item_t) + (node)->size))
+#define PMALLOC_FOOTER(node) ((uint32_t*)PMALLOC_NEXT(node) - 1)
+#define PMALLOC_PREV(node) ((pmalloc_item_t*)((char*)(node) - *((uint32_t*)(node) - 1) - sizeof(pmalloc_item_t)))
+
+// The quick list for blocks with a payload of size bytes
+#define PMALLOC_QUICK_INDEX(size) (((size) + sizeof(pmalloc_item_t)) / PMALLOC_ALIGN)
+
+// Find last set / find first set bit
+#if defined(__GNUC__) || defined(__clang__)
+	#define pmalloc_fls(x) (31 - __builtin_clz(x))
+	#define pmalloc_ffs(x) (__builtin_ctz(x))
+#else
+static inline uint32_t pmalloc_fls(uint32_t x) { uint32_t r = 0; while(x >>= 1) r++; return r; }
+static inline uint32_t pmalloc_ffs(uint32_t x) { uint32_t r = 0; while(!(x & 1)) { x >>= 1; r++; } return r; }
+#endif
+
+#ifdef PMALLOC_STATS
+// Count an allocation of size bytes, which failed if ptr is NULL
+static inline void pmalloc_count_alloc(pmalloc_t *pm, uint32_t size, void *ptr)
+{
+	if(ptr == NULL) {
+		pm->counters.failed++;
+		return;
+	}
+	pm->counters.allocs++;
+	pm->counters.classes[size == 0 ? 0 : pmalloc_fls(size)]++;
+}
+
+// Count a realloc of ptr that returned newPtr, mapped if ptr had a mapping of its own. A new block is never
+// allocated over the old one, so one that covers where ptr was grew down into the free block before it.
+static inline void pmalloc_count_realloc(pmalloc_t *pm, void *ptr, void *newPtr, int mapped)
+{
+	pm->counters.reallocs++;
+	if(newPtr == NULL) pm->counters.failed++;
+	else if(mapped && (((pmalloc_item_t*)newPtr - 1)->flags & PMALLOC_FLAG_MAPPED)) pm->counters.remapped++;
+	else if(newPtr == ptr) pm->counters.inplace++;
+	else if(ptr == NULL) return;
+	else if((char*)newPtr < (char*)ptr && (char*)newPtr + ((pmalloc_item_t*)newPtr - 1)->size > (char*)ptr) pm->counters.expanded++;
+	else pm->counters.relocated++;
+}
+#else
+	#define pmalloc_count_alloc(pm, size, ptr) do { } while(0)
+	#define pmalloc_count_realloc(pm, ptr, newPtr, mapped) do { (void)(mapped); } while(0)
+#endif
+
+// Zero and copy kernels for calloc and realloc. Blocks are always at least word aligned, so these only
+// need dst (and src) to be word aligned. Large runs use SSE2, or AVX2 where the CPU has it.
+#if defined(__GNUC__) || defined(__clang__)
+	typedef uintptr_t __attribute__((__may_alias__)) pmalloc_word_t;
+#else
+	typedef uintptr_t pmalloc_word_t;
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+	#define PMALLOC_X86_SIMD
+	#include <immintrin.h>
+#endif
+
+#define PMALLOC_SIMD_MIN 64     // Below this many bytes, words are as quick
+#define PMALLOC_AVX2_MIN 512    // Below this many bytes, SSE2 is as quick
+
+static inline void pmalloc_zero_words(void *dst, uint32_t n)
+{
+	pmalloc_word_t *d = (pmalloc_word_t*)dst;
+	for(; n >= sizeof(pmalloc_word_t); n -= sizeof(pmalloc_word_t)) *d++ = 0;
+	for(char *c = (char*)d; n > 0; n--) *c++ = 0;
+}
+
+static inline void pmalloc_copy_words(void *dst, const void *src, uint32_t n)
+{
+	pmalloc_word_t *d = (pmalloc_word_t*)dst;
+	const pmalloc_word_t *s = (const pmalloc_word_t*)src;
+	for(; n >= sizeof(pmalloc_word_t); n -= sizeof(pmalloc_word_t)) *d++ = *s++;
+	const char *cs = (const char*)s;
+	for(char *cd = (char*)d; n > 0; n--) *cd++ = *cs++;
+}
+
+#ifdef PMALLOC_X86_SIMD
+__attribute__((target("avx2"))) static void pmalloc_zero_avx2(char *dst, uint32_t n)
+{
+	__m256i zero = _mm256_setzero_si256();
+	for(; n >= 128; n -= 128, dst += 128) {
+		_mm256_storeu_si256((__m256i*)dst, zero);
+		_mm256_storeu_si256((__m256i*)(dst + 32), zero);
+		_mm256_storeu_si256((__m256i*)(dst + 64), zero);
+		_mm256_storeu_si256((__m256i*)(dst + 96), zero);
+	}
+	for(; n >= 32; n -= 32, dst += 32) _mm256_storeu_si256((__m256i*)dst, zero);
+	pmalloc_zero_words(dst, n);
+}
+
+__attribute__((target("avx2"))) static void pmalloc_copy_avx2(char *dst, const char *src, uint32_t n)
+{
+	for(; n >= 128; n -= 128, dst += 128, src += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)src);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+		_mm256_storeu_si256((__m256i*)dst, a);
+		_mm256_storeu_si256((__m256i*)(dst + 32), b);
+		_mm256_storeu_si256((__m256i*)(dst + 64), c);
+		_mm256_storeu_si256((__m256i*)(dst + 96), d);
+	}
+	for(; n >= 32; n -= 32, dst += 32, src += 32) _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+	pmalloc_copy_words(dst, src, n);
+}
+
+static void pmalloc_zero_sse2(char *dst, uint32_t n)
+{
+	__m128i zero = _mm_setzero_si128();
+	for(; n >= 64; n -= 64, dst += 64) {
+		_mm_storeu_si128((__m128i*)dst, zero);
+		_mm_storeu_si128((__m128i*)(dst + 16), zero);
+		_mm_storeu_si128((__m128i*)(dst + 32), zero);
+		_mm_storeu_si128((__m128i*)(dst + 48), zero);
+	}
+	for(; n >= 16; n -= 16, dst += 16) _mm_storeu_si128((__m128i*)dst, zero);
+	pmalloc_zero_words(dst, n);
+}
+
+static void pmalloc_copy_sse2(char *dst, const char *src, uint32_t n)
+{
+	for(; n >= 64; n -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+		_mm_storeu_si128((__m128i*)dst, a);
+		_mm_storeu_si128((__m128i*)(dst + 16), b);
+		_mm_storeu_si128((__m128i*)(dst + 32), c);
+		_mm_storeu_si128((__m128i*)(dst + 48), d);
+	}
+	for(; n >= 16; n -= 16, dst += 16, src += 16) _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+	pmalloc_copy_words(dst, src, n);
+}
+#endif
+
+// Zero n bytes at dst
+static void pmalloc_zero(void *dst, uint32_t n)
+{
+#ifdef PMALLOC_X86_SIMD
+	if(n >= PMALLOC_AVX2_MIN && __builtin_cpu_supports("avx2")) { pmalloc_zero_avx2((char*)dst, n); return; }
+	if(n >= PMALLOC_SIMD_MIN) { pmalloc_zero_sse2((char*)dst, n); return; }
+#endif
+	pmalloc_zero_words(dst, n);
+}
+
+// Copy n bytes from src to dst, which must not overlap unless dst is below src: every kernel copies
+// forwards, loading each run before storing it
+static void pmalloc_copy(void *dst, const void *src, uint32_t n)
+{
+#ifdef PMALLOC_X86_SIMD
+	if(n >= PMALLOC_AVX2_MIN && __builtin_cpu_supports("avx2")) { pmalloc_copy_avx2((char*)dst, (const char*)src, n); return; }
+	if(n >= PMALLOC_SIMD_MIN) { pmalloc_copy_sse2((char*)dst, (const char*)src, n); return; }
+#endif
+	pmalloc_copy_words(dst, src, n);
+}
+
+// The smallest payload a block can have, so that it can hold its links, the best fit tree's parent link and its footer once freed
+static inline uint32_t pmalloc_min_size(pmalloc_t *pm)
+{
+	uint32_t links = PMALLOC_PAYLOAD_LINKS + (pm->engine == PMALLOC_ENGINE_BESTFIT ? 1 : 0);
+	return links * sizeof(pmalloc_item_t*) + sizeof(uint32_t);
+}
+
+// The smallest block, header included, so the smallest remainder worth splitting off
+static inline uint32_t pmalloc_min_block(pmalloc_t *pm)
+{
+	return (uint32_t)PMALLOC_ROUND(sizeof(pmalloc_item_t) + pmalloc_min_size(pm));
+}
+
+// The payload size of a block that can hold size bytes, or 0 if that's more than a block can hold
+static inline uint32_t pmalloc_block_size(pmalloc_t *pm, uint32_t size)
+{
+	if(size < pmalloc_min_size(pm)) size = pmalloc_min_size(pm);
+	if(size > UINT32_MAX - sizeof(pmalloc_item_t) - PMALLOC_ALIGN) return 0;
+	return (uint32_t)(PMALLOC_ROUND(sizeof(pmalloc_item_t) + size) - sizeof(pmalloc_item_t));
+}
+
+// Map a size to its first-level (power of two) and second-level (linear subdivision) class
+static inline void pmalloc_mapping(uint32_t size, uint32_t *fl, uint32_t *sl)
+{
+	if(size < PMALLOC_SL_COUNT) {
+		*fl = 0;
+		*sl = size;
+		return;
+	}
+	*fl = pmalloc_fls(size);
+	*sl = (size >> (*fl - PMALLOC_SL_LOG2)) & (PMALLOC_SL_COUNT - 1);
+}
+
+// Bits strictly above bit n
+#define PMALLOC_ABOVE(n) ((n) >= 31 ? 0 : (~0U << ((n) + 1)))
+
+// The head of the smallest non-empty bin at or above class (fl, sl), using only the bitmaps
+static pmalloc_item_t *pmalloc_bin_first(pmalloc_t *pm, uint32_t fl, uint32_t sl)
+{
+	PMALLOC_STAT(pm, steps++);
+
+	uint32_t map = sl < PMALLOC_SL_COUNT ? pm->slmap[fl] & (~0U << sl) : 0;
+	if(map == 0) {
+		uint32_t flmap = pm->flmap & PMALLOC_ABOVE(fl);
+		if(flmap == 0) return NULL;
+		fl = pmalloc_ffs(flmap);
+		map = pm->slmap[fl];
+	}
+	sl = pmalloc_ffs(map);
+
+	return PMALLOC_BIN(pm, fl * PMALLOC_SL_COUNT + sl);
+}
+
 void pmalloc_init(pmalloc_t *pm) {
 	#ifdef DEBUG
 		printf("pmalloc: DEBUG Enabled\n");
 	#endif
 
-	pm->available = NULL;
-	pm->assigned = NULL;
+	pm->engine = PMALLOC_ENGINE_SEGREGATED;
 	pm->freemem = 0;
 	pm->totalmem = 0;
 	pm->totalnodes = 0;
+
+	pm->flmap = 0;
+	for(uint32_t i = 0; i < PMALLOC_FL_COUNT; i++) pm->slmap[i] = 0;
+	for(uint32_t i = 0; i < PMALLOC_BINS; i++) pm->bins[i] = PMALLOC_REFER(pm, NULL);
+	pm->tree = PMALLOC_REFER(pm, NULL);
+
+	pm->quickmax = 0;
+	pm->quicklimit = 0;
+	pm->quickmem = 0;
+	for(uint32_t i = 0; i < PMALLOC_QUICK_COUNT; i++) pm->quick[i] = PMALLOC_REFER(pm, NULL);
+
+	pm->handles = PMALLOC_REFER(pm, NULL);
+	pm->freehandles = PMALLOC_REFER(pm, NULL);
+
+	pm->regions = PMALLOC_REFER(pm, NULL);
+	pm->release = NULL;
+	pm->releasectx = NULL;
+
+	pm->grow = NULL;
+	pm->growctx = NULL;
+	pm->growsize = 0;
+	pm->shared = 0;
+
+	pm->mmapthreshold = 0;
+	pm->nmapped = 0;
+	pm->mappedmem = 0;
+
+	#ifdef PMALLOC_STATS
+		pm->counters = (pmalloc_counters_t){ 0 };
+	#endif
+
+	#ifdef PMALLOC_TRACE
+		pm->trace = NULL;
+	#endif
 }
 
-void pmalloc_addblock(pmalloc_t *pm, void *ptr, uint32_t size)
+void pmalloc_set_engine(pmalloc_t *pm, pmalloc_engine_t engine)
+{
+	pm->engine = engine;
+}
+
+void pmalloc_set_quick(pmalloc_t *pm, uint32_t maxsize, uint32_t limit)
+{
+	// Anything already waiting may be too big for the new setting
+	pmalloc_consolidate(pm);
+
+	uint32_t largest = (PMALLOC_QUICK_COUNT - 1) * PMALLOC_ALIGN - sizeof(pmalloc_item_t);
+	pm->quickmax = maxsize < largest ? maxsize : largest;
+	pm->quicklimit = limit;
+}
+
+void pmalloc_consolidate(pmalloc_t *pm)
+{
+	for(uint32_t i = 0; i < PMALLOC_QUICK_COUNT; i++) {
+		while(PMALLOC_QUICK(pm, i) != NULL) {
+			pmalloc_item_t *node = PMALLOC_QUICK(pm, i);
+			pm->quick[i] = PMALLOC_LINK_NEXT(node);
+
+			// It's already counted as free memory, it just hasn't been merged
+			node->flags &= ~(PMALLOC_FLAG_USED | PMALLOC_FLAG_QUICK);
+			pmalloc_merge(pm, node);
+		}
+	}
+	pm->quickmem = 0;
+}
+
+// Add a region with room for a block of size bytes, if the heap can grow
+static int pmalloc_grow(pmalloc_t *pm, uint32_t size)
+{
+	if(pm->grow == NULL) return 0;
+
+	// TLSF only looks in classes where every block is big enough, so the block has to reach the next one
+	if(pm->engine == PMALLOC_ENGINE_TLSF && size >= PMALLOC_SL_COUNT) {
+		uint32_t round = (1U << (pmalloc_fls(size) - PMALLOC_SL_LOG2)) - 1;
+		if(size > UINT32_MAX - round) return 0;
+		size += round;
+	}
+
+	// Room for the region record and the block's header, and to align each of them
+	uint64_t min = (uint64_t)size + sizeof(pmalloc_region_t) + sizeof(pmalloc_item_t) + 2 * PMALLOC_ALIGN;
+	if(min > UINT32_MAX) return 0;
+
+	// A request bigger than the next region gets one of its own, otherwise each region is twice the last
+	if(min > pm->growsize) return pm->grow(pm, (uint32_t)min, (uint32_t)min, pm->growctx);
+	if(!pm->grow(pm, (uint32_t)min, pm->growsize, pm->growctx)) return 0;
+	if(pm->growsize <= PMALLOC_GROW_MAX / 2) pm->growsize *= 2;
+	return 1;
+}
+
+// Find a free block of at least size bytes, coalescing the quick lists, then growing the heap, if there isn't one
+static pmalloc_item_t *pmalloc_find(pmalloc_t *pm, uint32_t size)
+{
+	pmalloc_item_t *current = pmalloc_bin_find(pm, size);
+	if(current == NULL && pm->quickmem > 0) {
+		pmalloc_consolidate(pm);
+		current = pmalloc_bin_find(pm, size);
+	}
+	if(current == NULL && pmalloc_grow(pm, size)) current = pmalloc_bin_find(pm, size);
+	return current;
+}
+
+// The region record at the start of the memory at ptr, and the first block after it
+#define PMALLOC_REGION(ptr) ((pmalloc_region_t*)PMALLOC_ROUND((uintptr_t)(ptr)))
+#define PMALLOC_REGION_AT(pm, ref) PMALLOC_DEREF(pm, pmalloc_region_t, ref)
+#define PMALLOC_REGION_FIRST(region) ((pmalloc_item_t*)(PMALLOC_ROUND((uintptr_t)(region) + sizeof(pmalloc_region_t) + sizeof(pmalloc_item_t)) - sizeof(pmalloc_item_t)))
+
+// Add a region, with flags for its block
+static void pmalloc_addregion(pmalloc_t *pm, void *ptr, uint32_t size, uint16_t flags)
 {
-	// Get the usable size of the block
-	((pmalloc_item_t*)ptr)->size = size - sizeof(pmalloc_item_t);
+	// Record the region at its start, then align the first block so that its payload is aligned, and trim
+	// the end to a whole number of alignment units
+	pmalloc_region_t *region = PMALLOC_REGION(ptr);
+	char *start = (char*)PMALLOC_REGION_FIRST(region);
+	if(start - (char*)ptr + pmalloc_min_block(pm) > size) return;
+
+	region->next = pm->regions;
+	region->ptr = PMALLOC_REFER(pm, ptr);
+	region->size = size;
+	pm->regions = PMALLOC_REFER(pm, region);
+
+	size = (size - (uint32_t)(start - (char*)ptr)) & ~(uint32_t)(PMALLOC_ALIGN - 1);
+
+	pmalloc_item_t *node = (pmalloc_item_t*)start;
+
+	// Get the usable size of the block. It has no neighbours, so nothing before it can be free.
+	node->size = size - sizeof(pmalloc_item_t);
+	node->flags = PMALLOC_FLAG_LAST | flags;
 
 	// Update freemem and totalmem
-	pm->freemem += ((pmalloc_item_t*)ptr)->size;
-	pm->totalmem += pm->freemem;
+	pm->freemem += node->size;
+	pm->totalmem += node->size;
 
-	// Add it to the available heap, update totalnodes
-	pmalloc_item_insert(&pm->available, ptr);
+	// Add it to its bin, update totalnodes
+	*PMALLOC_FOOTER(node) = node->size;
+	pmalloc_bin_insert(pm, node);
 	pm->totalnodes++;
 }
 
-void *pmalloc_malloc(pmalloc_t *pm, uint32_t size)
+void pmalloc_addblock(pmalloc_t *pm, void *ptr, uint32_t size)
 {
-	// Find a suitable block
-	pmalloc_item_t *current = pm->available;
-	while(current != NULL && current->size < size) current = current->next;
+	pmalloc_addregion(pm, ptr, size, 0);
+}
 
-	// If there's nothing suitable, we're either out of memory or fragged.
-	if(current == NULL) return NULL;
+void pmalloc_addblock_zeroed(pmalloc_t *pm, void *ptr, uint32_t size)
+{
+	pmalloc_addregion(pm, ptr, size, PMALLOC_FLAG_ZERO);
+}
+
+// Take the region at *link out of the heap, it must be one free block
+static void pmalloc_unlink_region(pmalloc_t *pm, PMALLOC_REF(pmalloc_region_t) *link)
+{
+	pmalloc_region_t *region = PMALLOC_REGION_AT(pm, *link);
+	pmalloc_item_t *node = PMALLOC_REGION_FIRST(region);
+
+	pmalloc_bin_remove(pm, node);
+	pm->freemem -= node->size;
+	pm->totalmem -= node->size;
+	pm->totalnodes--;
+	*link = region->next;
+}
+
+int pmalloc_removeblock(pmalloc_t *pm, void *ptr)
+{
+	// Anything waiting on the quick lists is free, it just hasn't been merged
+	pmalloc_consolidate(pm);
+
+	for(PMALLOC_REF(pmalloc_region_t) *link = &pm->regions; PMALLOC_REGION_AT(pm, *link) != NULL; link = &PMALLOC_REGION_AT(pm, *link)->next) {
+		pmalloc_region_t *region = PMALLOC_REGION_AT(pm, *link);
+		if(PMALLOC_DEREF(pm, void, region->ptr) != ptr) continue;
+
+		// It can only go if it's one free block
+		pmalloc_item_t *node = PMALLOC_REGION_FIRST(region);
+		if((node->flags & PMALLOC_FLAG_USED) || !(node->flags & PMALLOC_FLAG_LAST)) return 0;
+
+		pmalloc_unlink_region(pm, link);
+		return 1;
+	}
+
+	return 0;
+}
+
+void pmalloc_set_release(pmalloc_t *pm, pmalloc_release_t release, void *ctx)
+{
+	// Any process using a shared heap could end up calling it, at an address that's only this one's
+	if(pm->shared && release != NULL) {
+		#ifdef DEBUG
+			printf("pmalloc: pmalloc_set_release on a shared heap\n");
+		#endif
+		return;
+	}
+
+	pm->release = release;
+	pm->releasectx = ctx;
+}
+
+void pmalloc_set_grow(pmalloc_t *pm, pmalloc_grow_t grow, void *ctx, uint32_t size)
+{
+	// As for pmalloc_set_release
+	if(pm->shared && grow != NULL) {
+		#ifdef DEBUG
+			printf("pmalloc: pmalloc_set_grow on a shared heap\n");
+		#endif
+		return;
+	}
+
+	pm->grow = grow;
+	pm->growctx = ctx;
+	pm->growsize = size;
+}
+
+void pmalloc_set_mmap_threshold(pmalloc_t *pm, uint32_t threshold)
+{
+	// A mapping is only there in the process that made it, so a shared heap never has any
+	if(pm->shared && threshold != 0) {
+		#ifdef DEBUG
+			printf("pmalloc: pmalloc_set_mmap_threshold on a shared heap\n");
+		#endif
+		return;
+	}
+
+	pm->mmapthreshold = threshold;
+}
+
+// Direct mapped blocks: an allocation of at least mmapthreshold bytes gets an anonymous mapping of its own
+// instead of a block in a region, so it neither fragments the heap nor outlives its free. Its header is
+// marked PMALLOC_FLAG_MAPPED so it's recognised when it comes back, and the mapping is kept in pm->mapped.
+#ifdef PMALLOC_MMAP
+static inline int pmalloc_mappable(pmalloc_t *pm, uint32_t size)
+{
+	return pm->mmapthreshold != 0 && size >= pm->mmapthreshold && pm->nmapped < PMALLOC_MMAP_MAX;
+}
+
+// Map a block of requestedSize bytes aligned to alignment, returns NULL if that can't be done
+static void *pmalloc_map(pmalloc_t *pm, uint32_t alignment, uint32_t requestedSize)
+{
+	// The header goes just before the payload, which is as close to the start of the mapping as alignment allows
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t offset = PMALLOC_ROUND(sizeof(pmalloc_item_t));
+	if(alignment > offset) offset = alignment;
+	uint64_t length = (offset + requestedSize + page - 1) & ~(page - 1);
+	if(offset > page || length > UINT32_MAX) return NULL;
+
+	char *base = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED) return NULL;
+
+	// It's the only block in its mapping, and sized exactly, so there's no slack to keep
+	pmalloc_item_t *node = (pmalloc_item_t*)(base + offset - sizeof(pmalloc_item_t));
+	node->size = requestedSize;
+	node->flags = PMALLOC_FLAG_USED | PMALLOC_FLAG_LAST | PMALLOC_FLAG_MAPPED;
+	node->owner = 0;
+	node->slack = 0;
+
+	pmalloc_mapping_t *map = &pm->mapped[pm->nmapped++];
+	map->ptr = base + offset;
+	map->base = base;
+	map->length = (uint32_t)length;
+	pm->mappedmem += length;
+
+	return map->ptr;
+}
+
+static pmalloc_mapping_t *pmalloc_mapping_of(pmalloc_t *pm, void *ptr)
+{
+	for(uint32_t i = 0; i < pm->nmapped; i++) if(pm->mapped[i].ptr == ptr) return &pm->mapped[i];
+	return NULL;
+}
+
+// Give a mapped block straight back to the OS
+static void pmalloc_unmap(pmalloc_t *pm, void *ptr)
+{
+	// A mapping this heap doesn't know about isn't this process's to unmap
+	pmalloc_mapping_t *map = pmalloc_mapping_of(pm, ptr);
+	if(map == NULL) return;
+	pm->mappedmem -= map->length;
+	munmap(map->base, map->length);
+	*map = pm->mapped[--pm->nmapped];
+}
+#else
+	#define pmalloc_mappable(pm, size) 0
+	#define pmalloc_map(pm, alignment, size) NULL
+#endif
+
+uint32_t pmalloc_trim(pmalloc_t *pm, uint32_t keep)
+{
+	pmalloc_consolidate(pm);
+	if(pm->freemem <= keep) return 0;
+
+	uint32_t budget = pm->freemem - keep;
+	uint32_t released = 0;
+
+	// Give back regions that are entirely free, if there's somewhere to give them
+	for(PMALLOC_REF(pmalloc_region_t) *link = &pm->regions; PMALLOC_REGION_AT(pm, *link) != NULL && pm->release != NULL; ) {
+		pmalloc_region_t *region = PMALLOC_REGION_AT(pm, *link);
+		pmalloc_item_t *node = PMALLOC_REGION_FIRST(region);
+		if((node->flags & PMALLOC_FLAG_USED) || !(node->flags & PMALLOC_FLAG_LAST) || node->size > budget - released) {
+			link = &region->next;
+			continue;
+		}
 
-	// Remove it from pm->available
-	pmalloc_item_remove(&pm->available, current);
+		// Unlinking it leaves link pointing at the next region
+		void *ptr = PMALLOC_DEREF(pm, void, region->ptr);
+		uint32_t size = region->size;
+		released += node->size;
+		pmalloc_unlink_region(pm, link);
+		pm->release(ptr, size, pm->releasectx);
+	}
+
+#ifdef PMALLOC_MADVISE
+	// Then drop the pages inside big free blocks, keeping the bin links at the start and the footer at the end.
+	// A block already dropped by an earlier trim, and not binned again since, has nothing left to give.
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t links = (PMALLOC_PAYLOAD_LINKS + 1) * sizeof(pmalloc_item_t*);
+	for(pmalloc_region_t *region = PMALLOC_REGION_AT(pm, pm->regions); region != NULL && released < budget; region = PMALLOC_REGION_AT(pm, region->next)) {
+		for(pmalloc_item_t *node = PMALLOC_REGION_FIRST(region); released < budget; node = PMALLOC_NEXT(node)) {
+			if(!(node->flags & (PMALLOC_FLAG_USED | PMALLOC_FLAG_TRIMMED))) {
+				uintptr_t start = ((uintptr_t)node + sizeof(pmalloc_item_t) + links + page - 1) & ~(page - 1);
+				uintptr_t end = (uintptr_t)PMALLOC_FOOTER(node) & ~(page - 1);
+				if(end > start) {
+					int whole = end - start <= budget - released;
+					if(!whole) end = start + ((budget - released) & ~(page - 1));
+					if(end > start && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+						released += (uint32_t)(end - start);
+						if(whole) node->flags |= PMALLOC_FLAG_TRIMMED;
+					}
+				}
+			}
+			if(node->flags & PMALLOC_FLAG_LAST) break;
+		}
+	}
+#endif
 
-	// Add to pm->assigned
-	pmalloc_item_insert(&pm->assigned, current);
+	return released;
+}
 
-	// If it's not the exact size..
-	if(current->size != size) {
-		// Add a free block that's the remainder size
+// Allocate the free block current, already removed from its bin, for a request of requestedSize
+// bytes needing a payload of size bytes. Any remainder big enough for a block of its own is freed.
+static void *pmalloc_take(pmalloc_t *pm, pmalloc_item_t *current, uint32_t size, uint32_t requestedSize)
+{
+	// If the remainder is big enough to be a block of its own..
+	if(current->size - size >= pmalloc_min_block(pm)) {
+		// Add a free block that's the remainder size. The block after it already knows its predecessor is free,
+		// and if this block was known to be zero so is the remainder, the bookkeeping being at either end.
 		pmalloc_item_t *newfree = (pmalloc_item_t*)((char*)current + sizeof(pmalloc_item_t) + size);
 		newfree->size = current->size - sizeof(pmalloc_item_t) - size;
-		newfree->next = current->next;
-		current->next = NULL;
-		
-		// Change pm->assigned size
+		newfree->flags = current->flags & (PMALLOC_FLAG_LAST | PMALLOC_FLAG_ZERO);
+		*PMALLOC_FOOTER(newfree) = newfree->size;
+
+		// Truncate the allocated block
 		current->size = size;
-		pmalloc_item_insert(&pm->available, newfree);
+		current->flags &= ~PMALLOC_FLAG_LAST;
+		pmalloc_bin_insert(pm, newfree);
 
 		// We've lost a bit of overhead making the new node
 		pm->freemem -= sizeof(pmalloc_item_t);
 		pm->totalnodes++;
-
-		// Merge around newfree
-		pmalloc_merge(pm, newfree);
+	} else if(!(current->flags & PMALLOC_FLAG_LAST)) {
+		// The whole block is used, so the block after it has an allocated predecessor
+		PMALLOC_NEXT(current)->flags &= ~PMALLOC_FLAG_PREV_FREE;
 	}
 
+	// Mark it used, dropping any tree colour or owner left over from its previous life
+	current->flags = (current->flags & (PMALLOC_FLAG_LAST | PMALLOC_FLAG_PREV_FREE)) | PMALLOC_FLAG_USED;
+	current->owner = 0;
+	current->slack = current->size - requestedSize;
+
 	// Reduce the amount of free memory
 	pm->freemem -= current->size;
 
@@ -85,41 +669,308 @@ void *pmalloc_malloc(pmalloc_t *pm, uint32_t size)
 	return ((char*)current) + sizeof(pmalloc_item_t);
 }
 
+// pmalloc_malloc, without tracing, for the entry points built on it
+static void *pmalloc_alloc(pmalloc_t *pm, uint32_t requestedSize)
+{
+	// Big enough for a mapping of its own
+	if(pmalloc_mappable(pm, requestedSize)) {
+		void *ptr = pmalloc_map(pm, PMALLOC_ALIGN, requestedSize);
+		if(ptr != NULL) return ptr;
+	}
+
+	// Round up so that the block after this one stays aligned
+	uint32_t size = pmalloc_block_size(pm, requestedSize);
+	if(size == 0) return NULL;
+
+	// Reuse a block of exactly this size from its quick list, as it was when it was freed
+	if(size <= pm->quickmax && PMALLOC_QUICK(pm, PMALLOC_QUICK_INDEX(size)) != NULL) {
+		pmalloc_item_t *current = PMALLOC_QUICK(pm, PMALLOC_QUICK_INDEX(size));
+		pm->quick[PMALLOC_QUICK_INDEX(size)] = PMALLOC_LINK_NEXT(current);
+
+		current->flags &= ~PMALLOC_FLAG_QUICK;
+		current->owner = 0;
+		current->slack = size - requestedSize;
+		pm->freemem -= size;
+		pm->quickmem -= size;
+
+		return ((char*)current) + sizeof(pmalloc_item_t);
+	}
+
+	// Find a suitable block
+	pmalloc_item_t *current = pmalloc_find(pm, size);
+
+	// If there's nothing suitable, we're either out of memory or fragged.
+	if(current == NULL) return NULL;
+
+	// Remove it from its bin
+	pmalloc_bin_remove(pm, current);
+
+	return pmalloc_take(pm, current, size, requestedSize);
+}
+
+void *pmalloc_malloc(pmalloc_t *pm, uint32_t size)
+{
+	void *ptr = pmalloc_alloc(pm, size);
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_MALLOC, NULL, size, 0, ptr);
+	pmalloc_count_alloc(pm, size, ptr);
+	return ptr;
+}
+
+uint32_t pmalloc_malloc_batch(pmalloc_t *pm, uint32_t requestedSize, uint32_t count, void **out)
+{
+	uint32_t size = pmalloc_block_size(pm, requestedSize);
+	if(size == 0 || count == 0) return 0;
+
+	// Look for one free block that can be carved into all of them
+	uint64_t stride = sizeof(pmalloc_item_t) + size;
+	uint64_t needed = stride * count - sizeof(pmalloc_item_t);
+	pmalloc_item_t *current = needed <= UINT32_MAX && !pmalloc_mappable(pm, requestedSize) ? pmalloc_bin_find(pm, (uint32_t)needed) : NULL;
+
+	// If there isn't one, or they should each be mapped, allocate them one at a time
+	if(current == NULL) {
+		uint32_t i;
+		for(i = 0; i < count && (out[i] = pmalloc_alloc(pm, requestedSize)) != NULL; i++) {
+			PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_MALLOC, NULL, requestedSize, 0, out[i]);
+			pmalloc_count_alloc(pm, requestedSize, out[i]);
+		}
+		if(i < count) pmalloc_count_alloc(pm, requestedSize, NULL);
+		return i;
+	}
+
+	pmalloc_bin_remove(pm, current);
+
+	// Cut blocks off the front, each leaving the rest as a block that starts after it
+	uint32_t flags = current->flags;
+	for(uint32_t i = 0; i < count - 1; i++) {
+		pmalloc_item_t *rest = (pmalloc_item_t*)((char*)current + stride);
+		rest->size = current->size - (uint32_t)stride;
+		rest->flags = flags & (PMALLOC_FLAG_LAST | PMALLOC_FLAG_ZERO);
+
+		current->size = size;
+		current->flags = (i == 0 ? flags & PMALLOC_FLAG_PREV_FREE : 0) | PMALLOC_FLAG_USED;
+		current->owner = 0;
+		current->slack = size - requestedSize;
+		out[i] = (char*)current + sizeof(pmalloc_item_t);
+		PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_MALLOC, NULL, requestedSize, 0, out[i]);
+		pmalloc_count_alloc(pm, requestedSize, out[i]);
+
+		pm->freemem -= (uint32_t)stride;
+		pm->totalnodes++;
+		current = rest;
+	}
+
+	// The last one splits off whatever is left, as a single allocation would
+	out[count - 1] = pmalloc_take(pm, current, size, requestedSize);
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_MALLOC, NULL, requestedSize, 0, out[count - 1]);
+	pmalloc_count_alloc(pm, requestedSize, out[count - 1]);
+
+	return count;
+}
+
+static void *pmalloc_alloc_aligned(pmalloc_t *pm, uint32_t alignment, uint32_t requestedSize)
+{
+	// Alignment must be a power of two, and every block is already aligned this much
+	if(alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+	if(alignment <= PMALLOC_ALIGN) return pmalloc_alloc(pm, requestedSize);
+
+	if(pmalloc_mappable(pm, requestedSize)) {
+		void *ptr = pmalloc_map(pm, alignment, requestedSize);
+		if(ptr != NULL) return ptr;
+	}
+
+	uint32_t size = pmalloc_block_size(pm, requestedSize);
+	if(size == 0 || size > UINT32_MAX - alignment - pmalloc_min_block(pm)) return NULL;
+
+	// Find a block with room to move the payload up to the alignment, leaving a free block in front of it
+	pmalloc_item_t *current = pmalloc_find(pm, size + alignment + pmalloc_min_block(pm));
+	if(current == NULL) return NULL;
+
+	pmalloc_bin_remove(pm, current);
+
+	// Find the first aligned address far enough in for the padding to be a block of its own
+	uintptr_t payload = (uintptr_t)current + sizeof(pmalloc_item_t);
+	uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+	if(aligned != payload) {
+		while(aligned - payload < pmalloc_min_block(pm)) aligned += alignment;
+
+		// Split the padding off into a free block. Its predecessor can't be free, or they'd have merged.
+		pmalloc_item_t *node = (pmalloc_item_t*)(aligned - sizeof(pmalloc_item_t));
+		node->size = current->size - (uint32_t)(aligned - payload);
+		node->flags = (current->flags & (PMALLOC_FLAG_LAST | PMALLOC_FLAG_ZERO)) | PMALLOC_FLAG_PREV_FREE;
+
+		current->size = (uint32_t)(aligned - payload) - sizeof(pmalloc_item_t);
+		current->flags &= ~PMALLOC_FLAG_LAST;
+		*PMALLOC_FOOTER(current) = current->size;
+		pmalloc_bin_insert(pm, current);
+
+		// We've lost a bit of overhead making the new node
+		pm->freemem -= sizeof(pmalloc_item_t);
+		pm->totalnodes++;
+
+		current = node;
+	}
+
+	return pmalloc_take(pm, current, size, requestedSize);
+}
+
+void *pmalloc_memalign(pmalloc_t *pm, uint32_t alignment, uint32_t size)
+{
+	void *ptr = pmalloc_alloc_aligned(pm, alignment, size);
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_MEMALIGN, NULL, size, alignment, ptr);
+	pmalloc_count_alloc(pm, size, ptr);
+	return ptr;
+}
+
+void *pmalloc_aligned_alloc(pmalloc_t *pm, uint32_t alignment, uint32_t size)
+{
+	return pmalloc_memalign(pm, alignment, size);
+}
+
+// pmalloc_calloc, without tracing
+static void *pmalloc_alloc_zero(pmalloc_t *pm, uint32_t num, uint32_t requestedSize)
+{
+	uint64_t total = (uint64_t)num * requestedSize;
+	if(total > UINT32_MAX) return NULL;
+
+	// Fresh mappings are already zero
+	if(pmalloc_mappable(pm, (uint32_t)total)) {
+		void *ptr = pmalloc_map(pm, PMALLOC_ALIGN, (uint32_t)total);
+		if(ptr != NULL) return ptr;
+	}
+
+	uint32_t size = pmalloc_block_size(pm, (uint32_t)total);
+	if(size == 0) return NULL;
+
+	pmalloc_item_t *current = pmalloc_find(pm, size);
+	if(current == NULL) return NULL;
+	pmalloc_bin_remove(pm, current);
+
+	uint32_t zero = current->flags & PMALLOC_FLAG_ZERO;
+	char *mem = pmalloc_take(pm, current, size, (uint32_t)total);
+
+	if(zero) {
+		// Only the bin links and footer the block held while free can be non-zero
+		uint32_t links = (PMALLOC_PAYLOAD_LINKS + 1) * sizeof(pmalloc_item_t*);
+		pmalloc_zero(mem, links < current->size ? links : current->size);
+		pmalloc_zero(mem + current->size - sizeof(uint32_t), sizeof(uint32_t));
+	} else {
+		pmalloc_zero(mem, (uint32_t)total);
+	}
+
+	return mem;
+}
+
 void *pmalloc_calloc(pmalloc_t *pm, uint32_t num, uint32_t size)
 {
-	char *mem = pmalloc_malloc(pm, num * size);
-	if(mem==NULL) return NULL;
-	for(uint32_t i=0; i<num * size; i++) mem[i]=0;
+	void *mem = pmalloc_alloc_zero(pm, num, size);
+
+	// A total that overflows is recorded as UINT32_MAX, which fails in a replay just as it failed here
+	uint64_t total = (uint64_t)num * size;
+	uint32_t requested = total > UINT32_MAX ? UINT32_MAX : (uint32_t)total;
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_CALLOC, NULL, requested, 0, mem);
+	pmalloc_count_alloc(pm, requested, mem);
 	return mem;
 }
 
-void *pmalloc_realloc(pmalloc_t *pm, void *ptr, uint32_t requestedSize)
+static void pmalloc_release(pmalloc_t *pm, void *ptr);
+
+#ifdef PMALLOC_MMAP
+// pmalloc_resize for a mapped block
+static void *pmalloc_remap(pmalloc_t *pm, void *ptr, uint32_t requestedSize)
+{
+	pmalloc_item_t *node = (pmalloc_item_t*)((char*)ptr - sizeof(pmalloc_item_t));
+
+	// Small enough to live in the heap now, so move it back if there's room
+	if(pm->mmapthreshold == 0 || requestedSize < pm->mmapthreshold) {
+		void *newPtr = pmalloc_alloc(pm, requestedSize);
+		if(newPtr != NULL) {
+			pmalloc_copy(newPtr, ptr, requestedSize < node->size ? requestedSize : node->size);
+			pmalloc_unmap(pm, ptr);
+			return newPtr;
+		}
+	}
+
+	pmalloc_mapping_t *map = pmalloc_mapping_of(pm, ptr);
+	if(map == NULL) return NULL;
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t offset = (char*)ptr - (char*)map->base;
+	uint64_t length = (offset + requestedSize + page - 1) & ~(page - 1);
+	if(length > UINT32_MAX) return NULL;
+
+	// Resize the mapping if the block no longer fits the pages it has, letting the kernel move them where it can
+	if(length != map->length) {
+		char *base;
+	#ifdef __linux__
+		base = (char*)mremap(map->base, map->length, length, MREMAP_MAYMOVE);
+		if(base == MAP_FAILED) return NULL;
+	#else
+		if(length < map->length) {
+			base = (char*)map->base;
+			munmap(base + length, map->length - length);
+		} else {
+			base = (char*)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(base == MAP_FAILED) return NULL;
+			pmalloc_copy(base, map->base, offset + node->size);
+			munmap(map->base, map->length);
+		}
+	#endif
+		pm->mappedmem = pm->mappedmem - map->length + length;
+		map->base = base;
+		map->ptr = base + offset;
+		map->length = (uint32_t)length;
+		node = (pmalloc_item_t*)(base + offset - sizeof(pmalloc_item_t));
+	}
+
+	node->size = requestedSize;
+	return map->ptr;
+}
+#endif
+
+// pmalloc_realloc, without tracing
+static void *pmalloc_resize(pmalloc_t *pm, void *ptr, uint32_t requestedSize)
 {
     // Match stdlib realloc() NULL interface
-    if (ptr == NULL) return pmalloc_malloc(pm, requestedSize);
+    if (ptr == NULL) return pmalloc_alloc(pm, requestedSize);
+
+#ifdef PMALLOC_MMAP
+    // A block with a mapping of its own is resized with it
+    if (((pmalloc_item_t*)((char*)ptr - sizeof(pmalloc_item_t)))->flags & PMALLOC_FLAG_MAPPED) return pmalloc_remap(pm, ptr, requestedSize);
+#endif
 
     // Get the actual pmalloc_item_t of the block
 	pmalloc_item_t *node = (pmalloc_item_t*)(ptr - sizeof(pmalloc_item_t));
+
+    // Round up so that the block after this one stays aligned
+    uint32_t size = pmalloc_block_size(pm, requestedSize);
+    if (size == 0) return NULL;
     
-    // If the requested size is equal to the current size, return the original pointer
-    if (node->size == requestedSize) return ptr;
+    // If the block size is unchanged, return the original pointer
+    if (node->size == size) {
+    	node->slack = size - requestedSize;
+    	return ptr;
+    }
 
     // If the requested size is smaller:
-    if (requestedSize < node->size) {
-     	// If the difference is less than twice sizeof(pmalloc_item_t), it's not worth doing anything, return the original pointer
-     	if(node->size - requestedSize < sizeof(pmalloc_item_t)*2) return ptr;
+    if (size < node->size) {
+     	// If the difference couldn't be a block of its own, it's not worth doing anything, return the original pointer
+     	if(node->size - size < pmalloc_min_block(pm)) {
+     		node->slack = node->size - requestedSize;
+     		return ptr;
+     	}
 
      	// Otherwise, create a free block for the extra space, truncate the block at the new size, and merge around it
-     	pmalloc_item_t *newFree = (pmalloc_item_t*)((char*)node + sizeof(pmalloc_item_t) + requestedSize);
-     	newFree->size = (node->size - requestedSize) - sizeof(pmalloc_item_t);
-     	pmalloc_item_insert(&pm->available, newFree);
+     	pmalloc_item_t *newFree = (pmalloc_item_t*)((char*)node + sizeof(pmalloc_item_t) + size);
+     	newFree->size = (node->size - size) - sizeof(pmalloc_item_t);
+     	newFree->flags = node->flags & PMALLOC_FLAG_LAST;
 
      	// Update free memory and node count
-     	pm->freemem += (node->size - requestedSize) - sizeof(pmalloc_item_t);
+     	pm->freemem += newFree->size;
      	pm->totalnodes++;
 
      	// Resize this block
-     	node->size = requestedSize;
+     	node->size = size;
+     	node->slack = size - requestedSize;
+     	node->flags &= ~PMALLOC_FLAG_LAST;
 
      	// Merge around the new free block
      	pmalloc_merge(pm, newFree);
@@ -128,184 +979,841 @@ void *pmalloc_realloc(pmalloc_t *pm, void *ptr, uint32_t requestedSize)
      	return ptr;
     }
 
-    // // Shortcut if we know there's not enough memory
-    if (requestedSize - node->size > pmalloc_freemem(pm)) return NULL;
+    // Shortcut if we know there's not enough memory, and no way to get more
+    if (pm->grow == NULL && !pmalloc_mappable(pm, requestedSize) && size - node->size > pmalloc_freemem(pm)) return NULL;
 
-    // Expand the block if the requested size is larger than the current size
-    if (requestedSize > node->size) {
-    	// Does the next allocated block have enough space before it for this node to expand?
-    	if(node->next == NULL || (char*)(node->next) > (char*)node + sizeof(pmalloc_item_t) + requestedSize) {
-    		// Get the existing block of free space in between node and the next
-    		pmalloc_item_t *freeBlock = (pmalloc_item_t*)((char*)node + sizeof(pmalloc_item_t) + node->size);
-    		// Get the free block current size
-    		uint32_t freeBlockSize = freeBlock->size;
-    		// Remove that block from the free chain
-    		pmalloc_item_remove(&pm->available, freeBlock);
+    // Is the block physically after this one free, and big enough for this node to expand into?
+    pmalloc_item_t *freeBlock = PMALLOC_NEXT(node);
+    if (!(node->flags & PMALLOC_FLAG_LAST) && !(freeBlock->flags & PMALLOC_FLAG_USED) && node->size + sizeof(pmalloc_item_t) + freeBlock->size >= size) {
+    	// Get the free block current size and flags, the new free block may overwrite them
+    	uint32_t freeBlockSize = freeBlock->size;
+    	uint32_t freeBlockLast = freeBlock->flags & PMALLOC_FLAG_LAST;
 
-    		// Create a new free block with the difference in size, after this node if it was resized
-    		freeBlock = (pmalloc_item_t*)((char*)node + sizeof(pmalloc_item_t) + requestedSize);
-    		freeBlock->size = freeBlockSize - (requestedSize - node->size);
+    	// Remove that block from the free chain
+    	pmalloc_bin_remove(pm, freeBlock);
 
-    		// Add it to the free list
-    		pmalloc_item_insert(&pm->available, freeBlock);
+    	// If what would be left over can't hold a block of its own, absorb all of it
+    	if (node->size + sizeof(pmalloc_item_t) + freeBlockSize - size < pmalloc_min_block(pm)) {
+    		pm->freemem -= freeBlockSize;
+    		pm->totalnodes--;
+    		node->size += sizeof(pmalloc_item_t) + freeBlockSize;
+    		node->slack = node->size - requestedSize;
+    		node->flags |= freeBlockLast;
+    		if (!freeBlockLast) PMALLOC_NEXT(node)->flags &= ~PMALLOC_FLAG_PREV_FREE;
+    		return ptr;
+    	}
 
-    		// Update the stats
-    		pm->freemem -= requestedSize - node->size;
-    		// pm->totalnodes stays the same, we removed one and added one
+    	// Create a new free block with the difference in size, after this node if it was resized
+    	freeBlock = (pmalloc_item_t*)((char*)node + sizeof(pmalloc_item_t) + size);
+    	freeBlock->size = freeBlockSize - (size - node->size);
+    	freeBlock->flags = freeBlockLast;
+    	*PMALLOC_FOOTER(freeBlock) = freeBlock->size;
 
-    		// Resize this block
-    		node->size = requestedSize;
+    	// Add it to the free list
+    	pmalloc_bin_insert(pm, freeBlock);
 
-    		// Merge around the new free block
-     		pmalloc_merge(pm, freeBlock);
+    	// Update the stats
+    	pm->freemem -= size - node->size;
+    	// pm->totalnodes stays the same, we removed one and added one
 
-    		// Return original pointer
-    		return ptr;
-    	};
+    	// Resize this block
+    	node->size = size;
+    	node->slack = size - requestedSize;
+
+    	// Return original pointer
+    	return ptr;
+    }
+
+    // Otherwise, could it grow into the free block physically before it, and the one after too if that's free?
+    if (node->flags & PMALLOC_FLAG_PREV_FREE) {
+    	pmalloc_item_t *prevBlock = PMALLOC_PREV(node);
+    	pmalloc_item_t *nextBlock = !(node->flags & PMALLOC_FLAG_LAST) && !(freeBlock->flags & PMALLOC_FLAG_USED) ? freeBlock : NULL;
+    	uint32_t room = prevBlock->size + sizeof(pmalloc_item_t) + node->size;
+    	if (nextBlock != NULL) room += sizeof(pmalloc_item_t) + nextBlock->size;
+
+    	if (room >= size) {
+    		uint16_t flags = (node->flags & ~(PMALLOC_FLAG_ZERO | PMALLOC_FLAG_PREV_FREE)) | (prevBlock->flags & PMALLOC_FLAG_PREV_FREE);
+    		uint8_t owner = node->owner;
+    		uint32_t used = node->size - node->slack;
+
+    		// Take the neighbours out of their bins, and out of the free memory
+    		pmalloc_bin_remove(pm, prevBlock);
+    		pm->freemem -= prevBlock->size;
+    		pm->totalnodes--;
+    		if (nextBlock != NULL) {
+    			pmalloc_bin_remove(pm, nextBlock);
+    			flags |= nextBlock->flags & PMALLOC_FLAG_LAST;
+    			pm->freemem -= nextBlock->size;
+    			pm->totalnodes--;
+    		}
+
+    		// Slide the contents down to the start of the free block before, pmalloc_copy is safe going downwards
+    		pmalloc_copy((char*)prevBlock + sizeof(pmalloc_item_t), ptr, used);
+    		node = prevBlock;
+    		node->size = room;
+    		node->flags = flags;
+    		node->owner = owner;
+    		if (!(flags & PMALLOC_FLAG_LAST)) PMALLOC_NEXT(node)->flags &= ~PMALLOC_FLAG_PREV_FREE;
+
+    		// Give back what's left at the end, if it can be a block of its own
+    		if (room - size >= pmalloc_min_block(pm)) {
+    			pmalloc_item_t *newFree = (pmalloc_item_t*)((char*)node + sizeof(pmalloc_item_t) + size);
+    			newFree->size = (room - size) - sizeof(pmalloc_item_t);
+    			newFree->flags = flags & PMALLOC_FLAG_LAST;
+    			pm->freemem += newFree->size;
+    			pm->totalnodes++;
+    			node->size = size;
+    			node->flags &= ~PMALLOC_FLAG_LAST;
+    			pmalloc_merge(pm, newFree);
+    		}
+    		node->slack = node->size - requestedSize;
+
+    		return (char*)node + sizeof(pmalloc_item_t);
+    	}
     }
 
     // If all else fails, completely reallocate the block, copy its contents, and free the old block.
 
     // Allocate a new block with the requested size
-    void *newPtr = pmalloc_malloc(pm, requestedSize);
+    void *newPtr = pmalloc_alloc(pm, requestedSize);
 
     // Copy the data from the original block to the new block
     if (newPtr != NULL)
     {
-        // Copy the data using memcpy
-        for(uint32_t i = 0; i<node->size; i++) *((char*)newPtr + i) = *((char*)ptr + i);
+        // Copy the data
+        pmalloc_copy(newPtr, ptr, node->size - node->slack);
 
         // Free the original block
-        pmalloc_free(pm, ptr);
+        pmalloc_release(pm, ptr);
     }
 
     return newPtr;
 }
 
+void *pmalloc_realloc(pmalloc_t *pm, void *ptr, uint32_t size)
+{
+	int mapped = ptr != NULL && (((pmalloc_item_t*)((char*)ptr - sizeof(pmalloc_item_t)))->flags & PMALLOC_FLAG_MAPPED);
+	void *newPtr = pmalloc_resize(pm, ptr, size);
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_REALLOC, ptr, size, 0, newPtr);
+	pmalloc_count_realloc(pm, ptr, newPtr, mapped);
+	return newPtr;
+}
+
 void pmalloc_free(pmalloc_t *pm, void *ptr)
 {
 	// Match stdlib free() NULL interface
 	if(ptr == NULL) return;
 
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_FREE, ptr, 0, 0, NULL);
+	PMALLOC_STAT(pm, frees++);
+	pmalloc_release(pm, ptr);
+}
+
+void pmalloc_free_sized(pmalloc_t *pm, void *ptr, uint32_t size)
+{
+	// Match stdlib free() NULL interface
+	if(ptr == NULL) return;
+
+	// The size is next to the block anyway, so it's only used to catch callers that got it wrong
+	#ifdef DEBUG
+		if(pmalloc_sizeof(pm, ptr) != size) printf("pmalloc: pmalloc_free_sized %p was %u bytes, not %u\n", ptr, pmalloc_sizeof(pm, ptr), size);
+	#else
+		(void)size;
+	#endif
+
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_FREE, ptr, 0, 0, NULL);
+	PMALLOC_STAT(pm, frees++);
+	pmalloc_release(pm, ptr);
+}
+
+// pmalloc_free, without tracing
+static void pmalloc_release(pmalloc_t *pm, void *ptr)
+{
 	// Get the node of this memory
 	pmalloc_item_t *node = (pmalloc_item_t*)(ptr - sizeof(pmalloc_item_t));
 
-	// Remove it from pm->assigned
-	pmalloc_item_remove(&pm->assigned, node);
+#ifdef PMALLOC_MMAP
+	// A block with a mapping of its own goes straight back to the OS
+	if(node->flags & PMALLOC_FLAG_MAPPED) {
+		pmalloc_unmap(pm, ptr);
+		return;
+	}
+#endif
 
 	pm->freemem += node->size;
 
-	// Add to pm->available
-	pmalloc_item_insert(&pm->available, node);
+	// Small blocks wait on their quick list, still marked used, until they're reused or consolidated
+	if(node->size <= pm->quickmax) {
+		PMALLOC_LINK_NEXT(node) = pm->quick[PMALLOC_QUICK_INDEX(node->size)];
+		pm->quick[PMALLOC_QUICK_INDEX(node->size)] = PMALLOC_REFER(pm, node);
+		node->flags |= PMALLOC_FLAG_QUICK;
+		pm->quickmem += node->size;
 
-	// Merge around current
+		if(pm->quicklimit != 0 && pm->quickmem > pm->quicklimit) pmalloc_consolidate(pm);
+		return;
+	}
+
+	// Mark it free, merge around it and add it to its bin
+	node->flags &= ~PMALLOC_FLAG_USED;
 	pmalloc_merge(pm, node);
 }
 
-void pmalloc_merge(pmalloc_t *pm, pmalloc_item_t* node) {
-	// Scan backward for contiguous blocks
-	while (node->prev != NULL && (char*)node == (char*)node->prev + sizeof(pmalloc_item_t) + node->prev->size)
-		node = node->prev;
+// Sort pointers into address order, in place (heapsort, so no recursion or extra memory)
+static void pmalloc_sort_ptrs(void **ptrs, uint32_t count)
+{
+	for(uint32_t end = count, start = count / 2; end > 1; ) {
+		void *ptr;
+		if(start > 0) {
+			ptr = ptrs[--start];
+		} else {
+			ptr = ptrs[--end];
+			ptrs[end] = ptrs[0];
+		}
 
-	// Scan forward and merge free blocks
-	while (node->next == (pmalloc_item_t*)((char*)node + sizeof(pmalloc_item_t) + node->size)) {
-		uint32_t nodesize = node->next->size + sizeof(pmalloc_item_t);
+		// Sift ptr down from start
+		uint32_t parent = start, child;
+		while((child = parent * 2 + 1) < end) {
+			if(child + 1 < end && (uintptr_t)ptrs[child + 1] > (uintptr_t)ptrs[child]) child++;
+			if((uintptr_t)ptrs[child] <= (uintptr_t)ptr) break;
+			ptrs[parent] = ptrs[child];
+			parent = child;
+		}
+		ptrs[parent] = ptr;
+	}
+}
+
+void pmalloc_free_batch(pmalloc_t *pm, void **ptrs, uint32_t count)
+{
+	pmalloc_sort_ptrs(ptrs, count);
+
+	for(uint32_t i = 0; i < count; ) {
+		// Match stdlib free() NULL interface, they sort first
+		if(ptrs[i] == NULL) { i++; continue; }
+		PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_FREE, ptrs[i], 0, 0, NULL);
+		PMALLOC_STAT(pm, frees++);
+
+		pmalloc_item_t *node = (pmalloc_item_t*)((char*)ptrs[i++] - sizeof(pmalloc_item_t));
+#ifdef PMALLOC_MMAP
+		if(node->flags & PMALLOC_FLAG_MAPPED) {
+			pmalloc_unmap(pm, (char*)node + sizeof(pmalloc_item_t));
+			continue;
+		}
+#endif
+		pm->freemem += node->size;
+
+		// Absorb the blocks being freed that physically follow this one, then merge and bin the run once
+		while(i < count && !(node->flags & PMALLOC_FLAG_LAST) && (char*)ptrs[i] - sizeof(pmalloc_item_t) == (char*)PMALLOC_NEXT(node)) {
+			PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_FREE, ptrs[i], 0, 0, NULL);
+			PMALLOC_STAT(pm, frees++);
+			PMALLOC_STAT(pm, merges++);
+			pmalloc_item_t *next = PMALLOC_NEXT(node);
+			node->size += sizeof(pmalloc_item_t) + next->size;
+			node->flags |= next->flags & PMALLOC_FLAG_LAST;
+			pm->freemem += sizeof(pmalloc_item_t) + next->size;
+			pm->totalnodes--;
+			i++;
+		}
+
+		node->flags &= ~PMALLOC_FLAG_USED;
+		pmalloc_merge(pm, node);
+	}
+}
+
+void pmalloc_merge(pmalloc_t *pm, pmalloc_item_t* node) {
+	// Merge into the block before, if it's free
+	if (node->flags & PMALLOC_FLAG_PREV_FREE) {
+		pmalloc_item_t *prev = PMALLOC_PREV(node);
+		pmalloc_bin_remove(pm, prev);
+		prev->size += sizeof(pmalloc_item_t) + node->size;
+		prev->flags |= node->flags & PMALLOC_FLAG_LAST;
 		pm->freemem += sizeof(pmalloc_item_t);
-		pmalloc_item_remove(&pm->available, node->next);
 		pm->totalnodes--;
-		node->size += nodesize;
+		PMALLOC_STAT(pm, merges++);
+		node = prev;
+	}
+
+	// Merge the block after into this one, if it's free
+	if (!(node->flags & PMALLOC_FLAG_LAST)) {
+		pmalloc_item_t *next = PMALLOC_NEXT(node);
+		if (!(next->flags & PMALLOC_FLAG_USED)) {
+			pmalloc_bin_remove(pm, next);
+			node->size += sizeof(pmalloc_item_t) + next->size;
+			node->flags |= next->flags & PMALLOC_FLAG_LAST;
+			pm->freemem += sizeof(pmalloc_item_t);
+			pm->totalnodes--;
+			PMALLOC_STAT(pm, merges++);
+		}
+	}
+
+	// It holds whatever was in the block being freed now
+	node->flags &= ~PMALLOC_FLAG_ZERO;
+
+	// Write the footer and tell the block after that this one is free
+	*PMALLOC_FOOTER(node) = node->size;
+	if (!(node->flags & PMALLOC_FLAG_LAST)) PMALLOC_NEXT(node)->flags |= PMALLOC_FLAG_PREV_FREE;
+
+	pmalloc_bin_insert(pm, node);
+}
+
+// A movable block starts with a pointer back to its handle, so pmalloc_compact can find the handle to
+// update. The memory the handle gives out starts after it, still aligned.
+#define PMALLOC_HANDLE_PREFIX ((uint32_t)PMALLOC_ROUND(sizeof(PMALLOC_REF(pmalloc_handle_t))))
+#define PMALLOC_HANDLE_LINK(node) (*(PMALLOC_REF(pmalloc_handle_t)*)((char*)(node) + sizeof(pmalloc_item_t)))
+#define PMALLOC_HANDLE_OF(pm, node) PMALLOC_DEREF(pm, pmalloc_handle_t, PMALLOC_HANDLE_LINK(node))
+#define PMALLOC_HANDLE_PTR(pm, handle) PMALLOC_DEREF(pm, void, (handle)->ptr)
+#define PMALLOC_HANDLE_NODE(pm, handle) ((pmalloc_item_t*)((char*)PMALLOC_HANDLE_PTR(pm, handle) - PMALLOC_HANDLE_PREFIX - sizeof(pmalloc_item_t)))
+#define PMALLOC_FREEHANDLES(pm) PMALLOC_DEREF(pm, pmalloc_handle_t, (pm)->freehandles)
+
+static uint32_t pmalloc_slide_all(pmalloc_t *pm, uint32_t budget);
+
+// pmalloc_alloc, compacting the heap and trying again if there's no block big enough
+static void *pmalloc_alloc_compacting(pmalloc_t *pm, uint32_t size)
+{
+	void *ptr = pmalloc_alloc(pm, size);
+	if(ptr == NULL && PMALLOC_DEREF(pm, pmalloc_handle_table_t, pm->handles) != NULL && pmalloc_slide_all(pm, 0) > 0) ptr = pmalloc_alloc(pm, size);
+	return ptr;
+}
+
+// pmalloc_halloc, without tracing
+static pmalloc_handle_t *pmalloc_handle_alloc(pmalloc_t *pm, uint32_t size)
+{
+	if(size > UINT32_MAX - PMALLOC_HANDLE_PREFIX) return NULL;
+
+	// Take an unused handle, making a new table of them if there aren't any
+	if(PMALLOC_FREEHANDLES(pm) == NULL) {
+		pmalloc_handle_table_t *table = (pmalloc_handle_table_t*)pmalloc_alloc_compacting(pm, sizeof(pmalloc_handle_table_t));
+		if(table == NULL) {
+			pmalloc_count_alloc(pm, size, NULL);
+			return NULL;
+		}
+
+		for(uint32_t i = 0; i < PMALLOC_HANDLE_TABLE; i++) {
+			table->handles[i].ptr = PMALLOC_REFER(pm, i + 1 < PMALLOC_HANDLE_TABLE ? &table->handles[i + 1] : NULL);
+			table->handles[i].locks = 0;
+			table->handles[i].live = 0;
+		}
+		table->next = pm->handles;
+		pm->handles = PMALLOC_REFER(pm, table);
+		pm->freehandles = PMALLOC_REFER(pm, &table->handles[0]);
+	}
+
+	char *mem = (char*)pmalloc_alloc_compacting(pm, size + PMALLOC_HANDLE_PREFIX);
+	pmalloc_count_alloc(pm, size, mem);
+	if(mem == NULL) return NULL;
+
+	pmalloc_handle_t *handle = PMALLOC_FREEHANDLES(pm);
+	pm->freehandles = PMALLOC_REFER(pm, (pmalloc_handle_t*)PMALLOC_HANDLE_PTR(pm, handle));
+
+	pmalloc_item_t *node = (pmalloc_item_t*)(mem - sizeof(pmalloc_item_t));
+	node->flags |= PMALLOC_FLAG_HANDLE;
+	PMALLOC_HANDLE_LINK(node) = PMALLOC_REFER(pm, handle);
+
+	handle->ptr = PMALLOC_REFER(pm, mem + PMALLOC_HANDLE_PREFIX);
+	handle->locks = 0;
+	handle->live = 1;
+
+	return handle;
+}
+
+pmalloc_handle_t *pmalloc_halloc(pmalloc_t *pm, uint32_t size)
+{
+	pmalloc_handle_t *handle = pmalloc_handle_alloc(pm, size);
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_HALLOC, NULL, size, 0, handle);
+	return handle;
+}
+
+void *pmalloc_hlock(pmalloc_t *pm, pmalloc_handle_t *handle)
+{
+	(void)pm;
+	handle->locks++;
+	return PMALLOC_HANDLE_PTR(pm, handle);
+}
+
+void pmalloc_hunlock(pmalloc_t *pm, pmalloc_handle_t *handle)
+{
+	(void)pm;
+	handle->locks--;
+}
+
+void pmalloc_hfree(pmalloc_t *pm, pmalloc_handle_t *handle)
+{
+	// Match stdlib free() NULL interface
+	if(handle == NULL) return;
+
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_HFREE, handle, 0, 0, NULL);
+	pmalloc_item_t *node = PMALLOC_HANDLE_NODE(pm, handle);
+	node->flags &= ~PMALLOC_FLAG_HANDLE;
+	PMALLOC_STAT(pm, frees++);
+	pmalloc_release(pm, (char*)node + sizeof(pmalloc_item_t));
+
+	// Back on the unused list
+	handle->ptr = pm->freehandles;
+	handle->locks = 0;
+	handle->live = 0;
+	pm->freehandles = PMALLOC_REFER(pm, handle);
+}
+
+// Whether pmalloc_compact can move a block
+static inline int pmalloc_movable(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	(void)pm;
+	return (node->flags & PMALLOC_FLAG_HANDLE) && PMALLOC_HANDLE_OF(pm, node)->locks == 0;
+}
+
+// Move the movable block node down over the free block before it, which ends up after it, merged with
+// anything free there. Returns the block after that free space, or NULL if it's the end of the region.
+static pmalloc_item_t *pmalloc_slide(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	pmalloc_item_t *moved = PMALLOC_PREV(node);
+	pmalloc_bin_remove(pm, moved);
+
+	// The copy may run over node's header, so keep what's needed from both first
+	uint32_t freeSize = moved->size;
+	uint16_t prevFree = moved->flags & PMALLOC_FLAG_PREV_FREE;
+	uint32_t size = node->size;
+	uint16_t flags = node->flags;
+	uint8_t owner = node->owner;
+	uint8_t slack = node->slack;
+
+	// Copy the block down to where the free block started, and tell its handle where it is now
+	pmalloc_copy((char*)moved + sizeof(pmalloc_item_t), (char*)node + sizeof(pmalloc_item_t), size);
+	moved->size = size;
+	moved->flags = (flags & ~(PMALLOC_FLAG_LAST | PMALLOC_FLAG_PREV_FREE)) | prevFree;
+	moved->owner = owner;
+	moved->slack = slack;
+	PMALLOC_HANDLE_OF(pm, moved)->ptr = PMALLOC_REFER(pm, (char*)moved + sizeof(pmalloc_item_t) + PMALLOC_HANDLE_PREFIX);
+
+	// The free space is now after it, and joins whatever is free beyond
+	pmalloc_item_t *rest = PMALLOC_NEXT(moved);
+	rest->size = freeSize;
+	rest->flags = flags & PMALLOC_FLAG_LAST;
+	pmalloc_merge(pm, rest);
+
+	return (rest->flags & PMALLOC_FLAG_LAST) ? NULL : PMALLOC_NEXT(rest);
+}
+
+// pmalloc_compact, without tracing
+static uint32_t pmalloc_slide_all(pmalloc_t *pm, uint32_t budget)
+{
+	uint32_t moved = 0;
+
+	// Free blocks waiting on the quick lists are holes that can't be filled until they're merged
+	pmalloc_consolidate(pm);
+
+	for(pmalloc_handle_table_t *table = PMALLOC_DEREF(pm, pmalloc_handle_table_t, pm->handles); table != NULL; table = PMALLOC_DEREF(pm, pmalloc_handle_table_t, table->next)) {
+		for(uint32_t i = 0; i < PMALLOC_HANDLE_TABLE; i++) {
+			if(!table->handles[i].live) continue;
+
+			// Slide it down over the free block before it, then the run of movable blocks after it over the
+			// same free space as it moves up
+			pmalloc_item_t *node = PMALLOC_HANDLE_NODE(pm, &table->handles[i]);
+			while(node != NULL && (node->flags & PMALLOC_FLAG_PREV_FREE) && pmalloc_movable(pm, node)) {
+				// Stop short of the budget rather than past it, so one call never copies more than it allows
+				if(budget != 0 && moved + node->size > budget) return moved;
+				moved += node->size;
+				node = pmalloc_slide(pm, node);
+			}
+		}
 	}
+
+	return moved;
+}
+
+uint32_t pmalloc_compact(pmalloc_t *pm, uint32_t budget)
+{
+	PMALLOC_TRACE_RECORD(pm, PMALLOC_TRACE_COMPACT, NULL, budget, 0, NULL);
+	return pmalloc_slide_all(pm, budget);
 }
 
 uint32_t pmalloc_sizeof(pmalloc_t *pm, void *ptr) {
 	// Get the actual pmalloc_item_t of the block
 	pmalloc_item_t *node = (pmalloc_item_t*)(ptr - sizeof(pmalloc_item_t));
 
-	// Return its size
-	return node->size;
+	// Return the size that was asked for
+	return node->size - node->slack;
 }
 
 uint32_t pmalloc_totalmem(pmalloc_t *pm) { return pm->totalmem; }
 uint32_t pmalloc_freemem(pmalloc_t *pm) { return pm->freemem; }
 uint32_t pmalloc_usedmem(pmalloc_t *pm) { return pm->totalmem - pm->freemem; }
 uint32_t pmalloc_overheadmem(pmalloc_t *pm) { return pm->totalnodes * sizeof(pmalloc_item_t); }
+uint64_t pmalloc_mappedmem(pmalloc_t *pm) { return pm->mappedmem; }
+
+// Best fit tree: a red-black tree of free blocks ordered by size, then address. The bin links
+// are the left/right children, the parent link is at the start of the payload and the colour is a flag.
+#define PMALLOC_LINK_PARENT(node) (((PMALLOC_REF(pmalloc_item_t)*)((char*)(node) + sizeof(pmalloc_item_t)))[PMALLOC_PAYLOAD_LINKS])
+#define PMALLOC_LEFT(pm, node) PMALLOC_GET_PREV(pm, node)
+#define PMALLOC_RIGHT(pm, node) PMALLOC_GET_NEXT(pm, node)
+#define PMALLOC_PARENT(pm, node) PMALLOC_DEREF(pm, pmalloc_item_t, PMALLOC_LINK_PARENT(node))
+#define PMALLOC_SET_LEFT(pm, node, ptr) PMALLOC_SET_PREV(pm, node, ptr)
+#define PMALLOC_SET_RIGHT(pm, node, ptr) PMALLOC_SET_NEXT(pm, node, ptr)
+#define PMALLOC_SET_PARENT(pm, node, ptr) (PMALLOC_LINK_PARENT(node) = PMALLOC_REFER(pm, ptr))
+#define PMALLOC_IS_RED(node) ((node) != NULL && ((node)->flags & PMALLOC_FLAG_RED))
+#define PMALLOC_SET_RED(node) ((node)->flags |= PMALLOC_FLAG_RED)
+#define PMALLOC_SET_BLACK(node) ((node)->flags &= ~PMALLOC_FLAG_RED)
 
-void pmalloc_item_insert(pmalloc_item_t **root, void *ptr)
+static inline int pmalloc_tree_less(pmalloc_item_t *a, pmalloc_item_t *b)
 {
-	// No existing root
-	if(*root == NULL) {
-		*root = (pmalloc_item_t*)ptr;
-		(*root)->prev = NULL;
-		(*root)->next = NULL;
-		return;
+	return a->size < b->size || (a->size == b->size && a < b);
+}
+
+// Replace the subtree at old with the one at new in old's parent
+static void pmalloc_tree_replace(pmalloc_t *pm, pmalloc_item_t *old, pmalloc_item_t *new)
+{
+	pmalloc_item_t *parent = PMALLOC_PARENT(pm, old);
+	if(parent == NULL) pm->tree = PMALLOC_REFER(pm, new);
+	else if(old == PMALLOC_LEFT(pm, parent)) PMALLOC_SET_LEFT(pm, parent, new);
+	else PMALLOC_SET_RIGHT(pm, parent, new);
+	if(new) PMALLOC_SET_PARENT(pm, new, parent);
+}
+
+static void pmalloc_tree_rotate_left(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	pmalloc_item_t *right = PMALLOC_RIGHT(pm, node);
+	PMALLOC_SET_RIGHT(pm, node, PMALLOC_LEFT(pm, right));
+	if(PMALLOC_LEFT(pm, right)) PMALLOC_SET_PARENT(pm, PMALLOC_LEFT(pm, right), node);
+	pmalloc_tree_replace(pm, node, right);
+	PMALLOC_SET_LEFT(pm, right, node);
+	PMALLOC_SET_PARENT(pm, node, right);
+}
+
+static void pmalloc_tree_rotate_right(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	pmalloc_item_t *left = PMALLOC_LEFT(pm, node);
+	PMALLOC_SET_LEFT(pm, node, PMALLOC_RIGHT(pm, left));
+	if(PMALLOC_RIGHT(pm, left)) PMALLOC_SET_PARENT(pm, PMALLOC_RIGHT(pm, left), node);
+	pmalloc_tree_replace(pm, node, left);
+	PMALLOC_SET_RIGHT(pm, left, node);
+	PMALLOC_SET_PARENT(pm, node, left);
+}
+
+static void pmalloc_tree_insert(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	// Plain binary tree insert
+	pmalloc_item_t *parent = NULL;
+	for(pmalloc_item_t *current = PMALLOC_ROOT(pm); current != NULL; current = pmalloc_tree_less(node, current) ? PMALLOC_LEFT(pm, current) : PMALLOC_RIGHT(pm, current))
+		parent = current;
+
+	PMALLOC_SET_LEFT(pm, node, NULL);
+	PMALLOC_SET_RIGHT(pm, node, NULL);
+	PMALLOC_SET_PARENT(pm, node, parent);
+	PMALLOC_SET_RED(node);
+
+	if(parent == NULL) pm->tree = PMALLOC_REFER(pm, node);
+	else if(pmalloc_tree_less(node, parent)) PMALLOC_SET_LEFT(pm, parent, node);
+	else PMALLOC_SET_RIGHT(pm, parent, node);
+
+	// Restore the red-black properties. A red parent is never the root, so there is always a grandparent.
+	while(PMALLOC_IS_RED(PMALLOC_PARENT(pm, node))) {
+		parent = PMALLOC_PARENT(pm, node);
+		pmalloc_item_t *grandparent = PMALLOC_PARENT(pm, parent);
+
+		if(parent == PMALLOC_LEFT(pm, grandparent)) {
+			pmalloc_item_t *uncle = PMALLOC_RIGHT(pm, grandparent);
+			if(PMALLOC_IS_RED(uncle)) {
+				PMALLOC_SET_BLACK(parent);
+				PMALLOC_SET_BLACK(uncle);
+				PMALLOC_SET_RED(grandparent);
+				node = grandparent;
+			} else {
+				if(node == PMALLOC_RIGHT(pm, parent)) {
+					node = parent;
+					pmalloc_tree_rotate_left(pm, node);
+					parent = PMALLOC_PARENT(pm, node);
+				}
+				PMALLOC_SET_BLACK(parent);
+				PMALLOC_SET_RED(grandparent);
+				pmalloc_tree_rotate_right(pm, grandparent);
+			}
+		} else {
+			pmalloc_item_t *uncle = PMALLOC_LEFT(pm, grandparent);
+			if(PMALLOC_IS_RED(uncle)) {
+				PMALLOC_SET_BLACK(parent);
+				PMALLOC_SET_BLACK(uncle);
+				PMALLOC_SET_RED(grandparent);
+				node = grandparent;
+			} else {
+				if(node == PMALLOC_LEFT(pm, parent)) {
+					node = parent;
+					pmalloc_tree_rotate_right(pm, node);
+					parent = PMALLOC_PARENT(pm, node);
+				}
+				PMALLOC_SET_BLACK(parent);
+				PMALLOC_SET_RED(grandparent);
+				pmalloc_tree_rotate_left(pm, grandparent);
+			}
+		}
 	}
 
-	// Where is the block in relation to the root?
-	if(ptr < (void*)*root) {
-		// New block before root
-		pmalloc_item_t *node = (pmalloc_item_t*)ptr;
-		pmalloc_item_t *oldroot = *root;
-		oldroot->prev = node;
-		node->next = oldroot;
-		*root = node;
+	PMALLOC_SET_BLACK(PMALLOC_ROOT(pm));
+}
+
+static void pmalloc_tree_remove(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	pmalloc_item_t *child, *parent;
+	int removedRed = PMALLOC_IS_RED(node);
+
+	// Unlink node, or swap its in-order successor into its place. child takes the place of whatever was unlinked.
+	if(PMALLOC_LEFT(pm, node) == NULL) {
+		child = PMALLOC_RIGHT(pm, node);
+		parent = PMALLOC_PARENT(pm, node);
+		pmalloc_tree_replace(pm, node, child);
+	} else if(PMALLOC_RIGHT(pm, node) == NULL) {
+		child = PMALLOC_LEFT(pm, node);
+		parent = PMALLOC_PARENT(pm, node);
+		pmalloc_tree_replace(pm, node, child);
 	} else {
-		// New block within or at end of list
-		pmalloc_item_t *current = *root;
-		pmalloc_item_t *node = (pmalloc_item_t*)ptr;
-		
-		// Skip until we find the right place to insert, or the end of the list
-		while(current->next != NULL && node > current->next) current = current->next;
-
-		// We're inserting the block at...
-		if(current->next == NULL) {
-			// The end of list
-			node->prev = current;
-			current->next = node;
+		pmalloc_item_t *successor = PMALLOC_RIGHT(pm, node);
+		while(PMALLOC_LEFT(pm, successor)) successor = PMALLOC_LEFT(pm, successor);
+
+		removedRed = PMALLOC_IS_RED(successor);
+		child = PMALLOC_RIGHT(pm, successor);
+		if(PMALLOC_PARENT(pm, successor) == node) {
+			parent = successor;
 		} else {
-			// Somewhere in the middle
-			pmalloc_item_t *oldnext = current->next;
+			parent = PMALLOC_PARENT(pm, successor);
+			pmalloc_tree_replace(pm, successor, child);
+			PMALLOC_SET_RIGHT(pm, successor, PMALLOC_RIGHT(pm, node));
+			PMALLOC_SET_PARENT(pm, PMALLOC_RIGHT(pm, successor), successor);
+		}
+		pmalloc_tree_replace(pm, node, successor);
+		PMALLOC_SET_LEFT(pm, successor, PMALLOC_LEFT(pm, node));
+		PMALLOC_SET_PARENT(pm, PMALLOC_LEFT(pm, successor), successor);
+		if(PMALLOC_IS_RED(node)) PMALLOC_SET_RED(successor); else PMALLOC_SET_BLACK(successor);
+	}
 
-			current->next = node;
-			node->prev = current;
-			node->next = oldnext;
-			oldnext->prev = node;
+	PMALLOC_SET_BLACK(node);
+
+	// Removing a black node leaves child's side one black short
+	if(removedRed) return;
+
+	while(child != PMALLOC_ROOT(pm) && !PMALLOC_IS_RED(child)) {
+		if(child == PMALLOC_LEFT(pm, parent)) {
+			pmalloc_item_t *sibling = PMALLOC_RIGHT(pm, parent);
+			if(PMALLOC_IS_RED(sibling)) {
+				PMALLOC_SET_BLACK(sibling);
+				PMALLOC_SET_RED(parent);
+				pmalloc_tree_rotate_left(pm, parent);
+				sibling = PMALLOC_RIGHT(pm, parent);
+			}
+			if(!PMALLOC_IS_RED(PMALLOC_LEFT(pm, sibling)) && !PMALLOC_IS_RED(PMALLOC_RIGHT(pm, sibling))) {
+				PMALLOC_SET_RED(sibling);
+				child = parent;
+				parent = PMALLOC_PARENT(pm, child);
+			} else {
+				if(!PMALLOC_IS_RED(PMALLOC_RIGHT(pm, sibling))) {
+					PMALLOC_SET_BLACK(PMALLOC_LEFT(pm, sibling));
+					PMALLOC_SET_RED(sibling);
+					pmalloc_tree_rotate_right(pm, sibling);
+					sibling = PMALLOC_RIGHT(pm, parent);
+				}
+				if(PMALLOC_IS_RED(parent)) PMALLOC_SET_RED(sibling); else PMALLOC_SET_BLACK(sibling);
+				PMALLOC_SET_BLACK(parent);
+				PMALLOC_SET_BLACK(PMALLOC_RIGHT(pm, sibling));
+				pmalloc_tree_rotate_left(pm, parent);
+				child = PMALLOC_ROOT(pm);
+			}
+		} else {
+			pmalloc_item_t *sibling = PMALLOC_LEFT(pm, parent);
+			if(PMALLOC_IS_RED(sibling)) {
+				PMALLOC_SET_BLACK(sibling);
+				PMALLOC_SET_RED(parent);
+				pmalloc_tree_rotate_right(pm, parent);
+				sibling = PMALLOC_LEFT(pm, parent);
+			}
+			if(!PMALLOC_IS_RED(PMALLOC_LEFT(pm, sibling)) && !PMALLOC_IS_RED(PMALLOC_RIGHT(pm, sibling))) {
+				PMALLOC_SET_RED(sibling);
+				child = parent;
+				parent = PMALLOC_PARENT(pm, child);
+			} else {
+				if(!PMALLOC_IS_RED(PMALLOC_LEFT(pm, sibling))) {
+					PMALLOC_SET_BLACK(PMALLOC_RIGHT(pm, sibling));
+					PMALLOC_SET_RED(sibling);
+					pmalloc_tree_rotate_left(pm, sibling);
+					sibling = PMALLOC_LEFT(pm, parent);
+				}
+				if(PMALLOC_IS_RED(parent)) PMALLOC_SET_RED(sibling); else PMALLOC_SET_BLACK(sibling);
+				PMALLOC_SET_BLACK(parent);
+				PMALLOC_SET_BLACK(PMALLOC_LEFT(pm, sibling));
+				pmalloc_tree_rotate_right(pm, parent);
+				child = PMALLOC_ROOT(pm);
+			}
 		}
-	} 
+	}
+
+	if(child) PMALLOC_SET_BLACK(child);
 }
 
-void pmalloc_item_remove(pmalloc_item_t **root, pmalloc_item_t *node) 
+// The smallest block of at least size bytes, the lowest addressed of those if there's a tie
+static pmalloc_item_t *pmalloc_tree_find(pmalloc_t *pm, uint32_t size)
 {
-	// Remove the node
-	if(node->prev) node->prev->next = node->next;
-	if(node->next) node->next->prev = node->prev;
-	
-	// Fixup root if the node was root
-	if(node==*root) {
-		if (node->prev) 
-			*root = node->prev; 
-		else 
-			*root = node->next; 
+	pmalloc_item_t *best = NULL;
+	for(pmalloc_item_t *current = PMALLOC_ROOT(pm); current != NULL; ) {
+		PMALLOC_STAT(pm, steps++);
+		if(current->size >= size) {
+			best = current;
+			current = PMALLOC_LEFT(pm, current);
+		} else {
+			current = PMALLOC_RIGHT(pm, current);
+		}
 	}
+	return best;
+}
 
-	// Clear the next and previous pointers
-	node->next = NULL;
-	node->prev = NULL;
+void pmalloc_bin_insert(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	// A block being binned has changed, so its pages may be in use again
+	node->flags &= ~PMALLOC_FLAG_TRIMMED;
+
+	if(pm->engine == PMALLOC_ENGINE_BESTFIT) {
+		pmalloc_tree_insert(pm, node);
+		return;
+	}
+
+	uint32_t fl, sl;
+	pmalloc_mapping(node->size, &fl, &sl);
+	uint32_t bin = fl * PMALLOC_SL_COUNT + sl;
+	pmalloc_item_t *head = PMALLOC_BIN(pm, bin);
+
+	// Push onto the head of the bin
+	PMALLOC_SET_PREV(pm, node, NULL);
+	PMALLOC_SET_NEXT(pm, node, head);
+	if(head) PMALLOC_SET_PREV(pm, head, node);
+	pm->bins[bin] = PMALLOC_REFER(pm, node);
+
+	// Mark the class as non-empty
+	pm->flmap |= 1U << fl;
+	pm->slmap[fl] |= 1U << sl;
+}
+
+void pmalloc_bin_remove(pmalloc_t *pm, pmalloc_item_t *node)
+{
+	if(pm->engine == PMALLOC_ENGINE_BESTFIT) {
+		pmalloc_tree_remove(pm, node);
+		return;
+	}
+
+	uint32_t fl, sl;
+	pmalloc_mapping(node->size, &fl, &sl);
+	uint32_t bin = fl * PMALLOC_SL_COUNT + sl;
+	pmalloc_item_t *prev = PMALLOC_GET_PREV(pm, node), *next = PMALLOC_GET_NEXT(pm, node);
+
+	// Unlink the node
+	if(prev) PMALLOC_SET_NEXT(pm, prev, next); else pm->bins[bin] = PMALLOC_REFER(pm, next);
+	if(next) PMALLOC_SET_PREV(pm, next, prev);
+
+	// Mark the class as empty if that was the last block in it
+	if(PMALLOC_BIN(pm, bin) == NULL) {
+		pm->slmap[fl] &= ~(1U << sl);
+		if(pm->slmap[fl] == 0) pm->flmap &= ~(1U << fl);
+	}
+}
+
+// pmalloc_bin_find, without counting the search
+static pmalloc_item_t *pmalloc_bin_search(pmalloc_t *pm, uint32_t size)
+{
+	uint32_t fl, sl;
+
+	if(pm->engine == PMALLOC_ENGINE_BESTFIT) return pmalloc_tree_find(pm, size);
+
+	if(pm->engine == PMALLOC_ENGINE_TLSF) {
+		// Round the request up to the next class boundary, so that every block in the class it maps to is big enough
+		if(size >= PMALLOC_SL_COUNT) {
+			uint32_t round = (1U << (pmalloc_fls(size) - PMALLOC_SL_LOG2)) - 1;
+			if(size > UINT32_MAX - round) return NULL;
+			size += round;
+		}
+		pmalloc_mapping(size, &fl, &sl);
+
+		// Good fit: the head of the first non-empty bin from there, without walking any list
+		return pmalloc_bin_first(pm, fl, sl);
+	}
+
+	pmalloc_mapping(size, &fl, &sl);
+
+	// First fit within the request's own class, which may hold blocks smaller than size
+	for(pmalloc_item_t *current = PMALLOC_BIN(pm, fl * PMALLOC_SL_COUNT + sl); current != NULL; current = PMALLOC_GET_NEXT(pm, current)) {
+		PMALLOC_STAT(pm, steps++);
+		if(current->size >= size) return current;
+	}
+
+	// Any block in a higher class is big enough
+	return pmalloc_bin_first(pm, fl, sl + 1);
+}
+
+pmalloc_item_t *pmalloc_bin_find(pmalloc_t *pm, uint32_t size)
+{
+#ifdef PMALLOC_STATS
+	uint64_t steps = pm->counters.steps;
+	pmalloc_item_t *found = pmalloc_bin_search(pm, size);
+	steps = pm->counters.steps - steps;
+
+	pm->counters.searches++;
+	if(steps > pm->counters.maxsteps) pm->counters.maxsteps = steps;
+	return found;
+#else
+	return pmalloc_bin_search(pm, size);
+#endif
+}
+
+uint32_t pmalloc_largestfree(pmalloc_t *pm)
+{
+	uint32_t largest = 0;
+
+	// The rightmost block in the tree
+	if(pm->engine == PMALLOC_ENGINE_BESTFIT) {
+		for(pmalloc_item_t *current = PMALLOC_ROOT(pm); current != NULL; current = PMALLOC_RIGHT(pm, current)) largest = current->size;
+		return largest;
+	}
+
+	// The biggest block in the highest non-empty bin
+	if(pm->flmap == 0) return 0;
+	uint32_t fl = pmalloc_fls(pm->flmap);
+	uint32_t sl = pmalloc_fls(pm->slmap[fl]);
+	for(pmalloc_item_t *current = PMALLOC_BIN(pm, fl * PMALLOC_SL_COUNT + sl); current != NULL; current = PMALLOC_GET_NEXT(pm, current))
+		if(current->size > largest) largest = current->size;
+
+	return largest;
 }
 
 #ifdef DEBUG
+static void pmalloc_dump_tree(pmalloc_t *pm, pmalloc_item_t *node, int depth) {
+	if(node == NULL) return;
+	pmalloc_dump_tree(pm, PMALLOC_LEFT(pm, node), depth + 1);
+	printf("   - (%016llx) %016llx -> %016llx - size: %lld (%ld sys, %d usr) - depth %d %s\n", (unsigned long long)(char*)node, (unsigned long long)(char*)node + sizeof(pmalloc_item_t), (unsigned long long)(char*)node + node->size + sizeof(pmalloc_item_t), (unsigned long long)(node->size + sizeof(pmalloc_item_t)), sizeof(pmalloc_item_t), node->size, depth, PMALLOC_IS_RED(node) ? "red" : "black");
+	pmalloc_dump_tree(pm, PMALLOC_RIGHT(pm, node), depth + 1);
+}
+
 void pmalloc_dump_stats(pmalloc_t *pm) {
 	printf("---------------------\n");
 	printf(" - freemem: %d\n", pm->freemem);
 	printf(" - totalmem: %d\n", pm->totalmem);
 	printf(" - totalnodes: %d (sizeof %d)\n", pm->totalnodes, (int)sizeof(pmalloc_item_t));
-	printf(" - assigned:\n");
-	for(pmalloc_item_t* current = pm->assigned; current != NULL; current=current->next) {
-		printf("  - (%016llx) %016llx -> %016llx - size: %lld (%ld sys, %d usr)\n", (unsigned long long)(char*)current, (unsigned long long)(char*)current + sizeof(pmalloc_item_t), (unsigned long long)(char*)current + current->size + sizeof(pmalloc_item_t), (unsigned long long)(current->size + sizeof(pmalloc_item_t)), sizeof(pmalloc_item_t), current->size);
-	} 
 	printf(" - available:\n");
-	for(pmalloc_item_t* current = pm->available; current != NULL; current=current->next) {
-		printf("  - (%016llx) %016llx -> %016llx - size: %lld (%ld sys, %d usr)\n", (unsigned long long)(char*)current, (unsigned long long)(char*)current + sizeof(pmalloc_item_t), (unsigned long long)(char*)current + current->size + sizeof(pmalloc_item_t), (unsigned long long)(current->size + sizeof(pmalloc_item_t)), sizeof(pmalloc_item_t), current->size);
-	} 
+	if(pm->engine == PMALLOC_ENGINE_BESTFIT) {
+		printf("  - tree:\n");
+		pmalloc_dump_tree(pm, PMALLOC_ROOT(pm), 0);
+	}
+	for(uint32_t i = 0; i < PMALLOC_BINS; i++) {
+		if(PMALLOC_BIN(pm, i) == NULL) continue;
+		printf("  - class %d.%d:\n", i / PMALLOC_SL_COUNT, i % PMALLOC_SL_COUNT);
+		for(pmalloc_item_t* current = PMALLOC_BIN(pm, i); current != NULL; current = PMALLOC_GET_NEXT(pm, current)) {
+			printf("   - (%016llx) %016llx -> %016llx - size: %lld (%ld sys, %d usr)\n", (unsigned long long)(char*)current, (unsigned long long)(char*)current + sizeof(pmalloc_item_t), (unsigned long long)(char*)current + current->size + sizeof(pmalloc_item_t), (unsigned long long)(current->size + sizeof(pmalloc_item_t)), sizeof(pmalloc_item_t), current->size);
+		}
+	}
+	for(uint32_t i = 0; i < PMALLOC_QUICK_COUNT; i++) {
+		if(PMALLOC_QUICK(pm, i) == NULL) continue;
+		printf("  - quick %d:\n", i);
+		for(pmalloc_item_t* current = PMALLOC_QUICK(pm, i); current != NULL; current = PMALLOC_GET_NEXT(pm, current)) {
+			printf("   - (%016llx) %016llx -> %016llx - size: %lld (%ld sys, %d usr)\n", (unsigned long long)(char*)current, (unsigned long long)(char*)current + sizeof(pmalloc_item_t), (unsigned long long)(char*)current + current->size + sizeof(pmalloc_item_t), (unsigned long long)(current->size + sizeof(pmalloc_item_t)), sizeof(pmalloc_item_t), current->size);
+		}
+	}
+	if(pm->nmapped > 0) {
+		printf("  - mapped (%llu bytes):\n", (unsigned long long)pm->mappedmem);
+		for(uint32_t i = 0; i < pm->nmapped; i++) {
+			printf("   - %016llx -> %016llx - length: %u\n", (unsigned long long)(char*)pm->mapped[i].ptr, (unsigned long long)(char*)pm->mapped[i].base + pm->mapped[i].length, pm->mapped[i].length);
+		}
+	}
 
 	printf("---------------------\n");
 }
@@ -4,37 +4,209 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// Alignment of every block returned by pmalloc_malloc, at least that of max_align_t
+#ifndef PMALLOC_ALIGN
+#define PMALLOC_ALIGN __alignof__(max_align_t)
+#endif
+
+// Size classes: each power of two is split into PMALLOC_SL_COUNT linear sub-classes
+#ifndef PMALLOC_SL_LOG2
+#define PMALLOC_SL_LOG2 2
+#endif
+#define PMALLOC_SL_COUNT (1 << PMALLOC_SL_LOG2)
+#define PMALLOC_FL_COUNT 32
+#define PMALLOC_BINS (PMALLOC_FL_COUNT * PMALLOC_SL_COUNT)
+
+// Quick lists: one per block size, in steps of PMALLOC_ALIGN, for blocks freed while deferring coalescing
+#ifndef PMALLOC_QUICK_COUNT
+#define PMALLOC_QUICK_COUNT 32
+#endif
+
+// Block flags
+#define PMALLOC_FLAG_USED       0x01    // The block is allocated
+#define PMALLOC_FLAG_PREV_FREE  0x02    // The block physically before this one is free, and its size is in the footer just before this header
+#define PMALLOC_FLAG_LAST       0x04    // The block is the last one in its addblock region
+#define PMALLOC_FLAG_RED        0x08    // The free block is red in the best fit tree
+#define PMALLOC_FLAG_ZERO       0x10    // The free block's payload is known to be zero, apart from its bin links and footer
+#define PMALLOC_FLAG_QUICK      0x20    // The block is free on a quick list, but still marked used so its neighbours don't merge with it
+#define PMALLOC_FLAG_HANDLE     0x40    // The block belongs to a handle, and may be moved by pmalloc_compact while it isn't locked
+#define PMALLOC_FLAG_MAPPED     0x80    // The block has a mapping of its own, outside every region (see pmalloc_set_mmap_threshold)
+#define PMALLOC_FLAG_TRIMMED    0x100   // The free block's pages were dropped by pmalloc_trim, and it hasn't been binned again since
+
+// Define PMALLOC_RELATIVE to keep every link as an offset from the pmalloc_t instead of an address, so a
+// heap that lives in the same mapping as its pmalloc_t works wherever it's mapped (see pmalloc_file.h).
+// PMALLOC_DEREF turns a link back into a pointer, PMALLOC_REFER a pointer into a link.
+#ifdef PMALLOC_RELATIVE
+#define PMALLOC_REF(type) uintptr_t
+#define PMALLOC_DEREF(pm, type, ref) ((ref) != 0 ? (type*)((char*)(pm) + (ref)) : (type*)NULL)
+#define PMALLOC_REFER(pm, ptr) ((ptr) != NULL ? (uintptr_t)((char*)(ptr) - (char*)(pm)) : 0)
+#else
+#define PMALLOC_REF(type) type*
+#define PMALLOC_DEREF(pm, type, ref) (ref)
+#define PMALLOC_REFER(pm, ptr) (ptr)
+#endif
+
+// Define PMALLOC_COMPACT for an 8 byte header: the bin links move into the payload of free blocks,
+// so allocated blocks carry only their size and flags
 typedef struct pmalloc_item {
-    struct pmalloc_item *prev;  // The previous block in the chain
-    struct pmalloc_item *next;  // The next block in the chain
-    uint32_t size;              // This is the size of the block as reported to the user 
+#ifndef PMALLOC_COMPACT
+    PMALLOC_REF(struct pmalloc_item) prev;  // The previous block in the bin (free blocks only)
+    PMALLOC_REF(struct pmalloc_item) next;  // The next block in the bin (free blocks only)
+#endif
+    uint32_t size;              // The size of the block's payload
+    uint16_t flags;             // PMALLOC_FLAG_*
+    uint8_t owner;              // Cleared by pmalloc_malloc, for layers built on pmalloc to tag the blocks they hand out
+    uint8_t slack;              // How much of the payload is beyond the size the user asked for
 } pmalloc_item_t;
 
-typedef struct pmalloc {
-    pmalloc_item_t *available;  // The linked list of available blocks
-    pmalloc_item_t *assigned;   // The linked list of allocated blocks
+// The start of every region added with pmalloc_addblock, ahead of its first block
+typedef struct pmalloc_region {
+    PMALLOC_REF(struct pmalloc_region) next;   // The region added before this one
+    PMALLOC_REF(void) ptr;                     // The memory passed to pmalloc_addblock
+    uint32_t size;                  // And its size
+} pmalloc_region_t;
+
+// Called with each region pmalloc_trim takes out of the heap, to give it back to wherever it came from
+typedef void (*pmalloc_release_t)(void *ptr, uint32_t size, void *ctx);
+
+// Called when nothing in the heap is big enough, to add a region of at least min bytes, ideally size, with
+// pmalloc_addblock or pmalloc_addblock_zeroed. Returns 0 if there's no more memory to be had.
+struct pmalloc_heap;
+typedef int (*pmalloc_grow_t)(struct pmalloc_heap *pm, uint32_t min, uint32_t size, void *ctx);
+
+// The largest region asked for when growing geometrically
+#ifndef PMALLOC_GROW_MAX
+#define PMALLOC_GROW_MAX 0x40000000
+#endif
+
+// Direct mapped blocks: the most a heap keeps track of, allocations beyond that come from the heap
+#ifndef PMALLOC_MMAP_MAX
+#define PMALLOC_MMAP_MAX 32
+#endif
+
+// A block with a mapping of its own
+typedef struct pmalloc_mapping {
+    void *ptr;                  // The block's payload
+    void *base;                 // The start of its mapping, a page or less before ptr
+    uint32_t length;            // The length of the mapping
+} pmalloc_mapping_t;
+
+// Handles: movable blocks, reached through an entry in a handle table that pmalloc_compact keeps up to date
+#ifndef PMALLOC_HANDLE_TABLE
+#define PMALLOC_HANDLE_TABLE 64
+#endif
+
+typedef struct pmalloc_handle {
+    PMALLOC_REF(void) ptr;      // The handle's memory, or the next unused handle while it's unused
+    uint32_t locks;             // How many pmalloc_hlock calls haven't been undone, it can only move at 0
+    uint32_t live;              // Set while the handle is allocated
+} pmalloc_handle_t;
+
+typedef struct pmalloc_handle_table {
+    PMALLOC_REF(struct pmalloc_handle_table) next;     // The table allocated before this one
+    pmalloc_handle_t handles[PMALLOC_HANDLE_TABLE];
+} pmalloc_handle_table_t;
+
+// Allocation engines, selecting how a free block is found for a request
+typedef enum pmalloc_engine {
+    PMALLOC_ENGINE_SEGREGATED = 0,  // First fit within the request's size class, then the next non-empty class (default)
+    PMALLOC_ENGINE_TLSF,            // Two-level segregated fit: good fit from the bitmaps alone, O(1) worst case
+    PMALLOC_ENGINE_BESTFIT,         // Smallest sufficient block, lowest address first, from a balanced tree: O(log n)
+} pmalloc_engine_t;
+
+#ifdef PMALLOC_STATS
+// Running counts kept by every pmalloc_t when built with PMALLOC_STATS, see pmalloc_stats.h for reading them
+typedef struct pmalloc_counters {
+    uint64_t allocs;            // Successful malloc, calloc and memalign calls, and blocks from malloc_batch
+    uint64_t frees;             // Blocks freed
+    uint64_t reallocs;          // realloc calls
+    uint64_t failed;            // Allocations and reallocs that returned NULL
+    uint64_t inplace;           // reallocs that kept their block, growing or shrinking it where it was
+    uint64_t expanded;          // reallocs that grew into the free block before theirs, sliding their contents down
+    uint64_t relocated;         // reallocs that moved to a new block
+    uint64_t remapped;          // reallocs of blocks with a mapping of their own that kept it, resized to fit
+    uint64_t merges;            // Free blocks merged with a physical neighbour
+    uint64_t searches;          // Searches for a free block
+    uint64_t steps;             // Blocks and bitmaps looked at by those searches
+    uint64_t maxsteps;          // The most looked at by one search
+    uint64_t classes[PMALLOC_FL_COUNT];     // Successful allocations by the power of two below the size asked for
+} pmalloc_counters_t;
+#endif
+
+typedef struct pmalloc_heap {
+    pmalloc_engine_t engine;    // The allocation engine in use
     uint32_t freemem;           // The current free memory count
     uint32_t totalmem;          // The total available free memory
-    uint32_t totalnodes;        // The number of nodes in the allocated list
+    uint32_t totalnodes;        // The number of nodes, allocated and free
+    uint32_t flmap;                         // Bitmap of first-level classes with a non-empty bin
+    uint32_t slmap[PMALLOC_FL_COUNT];       // Per first-level class, bitmap of non-empty second-level bins
+    PMALLOC_REF(pmalloc_item_t) bins[PMALLOC_BINS];    // Heads of the free blocks bucketed by size class
+    PMALLOC_REF(pmalloc_item_t) tree;                  // Root of the best fit tree of free blocks
+    uint32_t quickmax;                      // The largest payload freed to the quick lists, 0 to coalesce every free
+    uint32_t quicklimit;                    // Consolidate when the quick lists hold more than this many bytes, 0 for no limit
+    uint32_t quickmem;                      // The number of bytes of payload on the quick lists, counted in freemem
+    PMALLOC_REF(pmalloc_item_t) quick[PMALLOC_QUICK_COUNT];    // Heads of the quick lists, by block size
+    PMALLOC_REF(pmalloc_handle_table_t) handles;       // The handle tables, newest first
+    PMALLOC_REF(pmalloc_handle_t) freehandles;         // Unused handles, linked through their ptr
+    PMALLOC_REF(pmalloc_region_t) regions;             // The regions added with pmalloc_addblock, newest first
+    pmalloc_release_t release;              // Where pmalloc_trim sends regions that are entirely free, NULL to keep them
+    void *releasectx;                       // Passed to release
+    pmalloc_grow_t grow;                    // Where new regions come from when the heap runs out, NULL for nowhere
+    void *growctx;                          // Passed to grow
+    uint32_t growsize;                      // The size of the next region to ask grow for, doubling each time
+    uint32_t shared;                        // Set for a heap other processes use too, which keeps no grow or release function, trace or mappings
+    uint32_t mmapthreshold;                 // Blocks of at least this many bytes get a mapping of their own, 0 for none
+    uint32_t nmapped;                       // The number of blocks in mapped
+    uint64_t mappedmem;                     // The bytes mapped for them
+    pmalloc_mapping_t mapped[PMALLOC_MMAP_MAX];    // The blocks with a mapping of their own, in no order
+#ifdef PMALLOC_STATS
+    pmalloc_counters_t counters;            // Running counts, see pmalloc_stats.h
+#endif
+#ifdef PMALLOC_TRACE
+    struct pmalloc_trace *trace;            // Where to record calls, NULL when not tracing (see pmalloc_trace.h)
+#endif
 } pmalloc_t;
 
 void pmalloc_init(pmalloc_t *pm);
+void pmalloc_set_engine(pmalloc_t *pm, pmalloc_engine_t engine);        // Select the allocation engine, before calling pmalloc_addblock
+void pmalloc_set_quick(pmalloc_t *pm, uint32_t maxsize, uint32_t limit);   // Defer coalescing blocks of up to maxsize bytes, until more than limit bytes are waiting
+void pmalloc_consolidate(pmalloc_t *pm);                                // Coalesce every block on the quick lists and return them to their bins
 void pmalloc_addblock(pmalloc_t *pm, void *ptr, uint32_t size);         // Add an area of memory available for allocation
+void pmalloc_addblock_zeroed(pmalloc_t *pm, void *ptr, uint32_t size);  // Add an area of memory that is known to be all zero, like fresh pages from mmap
+int pmalloc_removeblock(pmalloc_t *pm, void *ptr);                      // Take back a region added at ptr, if none of it is allocated, returns 1 if it was removed
+void pmalloc_set_release(pmalloc_t *pm, pmalloc_release_t release, void *ctx);  // Set where pmalloc_trim gives back regions that are entirely free
+uint32_t pmalloc_trim(pmalloc_t *pm, uint32_t keep);                    // Give back free memory beyond keep bytes, returns how much was given back
+void pmalloc_set_grow(pmalloc_t *pm, pmalloc_grow_t grow, void *ctx, uint32_t size);    // Grow the heap with grow when it runs out, starting with regions of size bytes (see pmalloc_provider.h)
+void pmalloc_set_mmap_threshold(pmalloc_t *pm, uint32_t threshold);    // Give allocations of at least threshold bytes a mapping of their own, 0 (the default) for none
 void *pmalloc_malloc(pmalloc_t *pm, uint32_t size);                     // Allocate size bytes of memory, returns NULL if out of memory
+void *pmalloc_memalign(pmalloc_t *pm, uint32_t alignment, uint32_t size);       // Allocate size bytes aligned to alignment, a power of two, returns NULL if out of memory
+void *pmalloc_aligned_alloc(pmalloc_t *pm, uint32_t alignment, uint32_t size);  // Same as pmalloc_memalign
 void *pmalloc_calloc(pmalloc_t *pm, uint32_t num, uint32_t size);       // Allocate num blocks each of size bytes, clear the memory first
 void *pmalloc_realloc(pmalloc_t *pm, void *ptr, uint32_t size);         // Reallocate the existing block ptr to a new size and return the new block
 void pmalloc_free(pmalloc_t *pm, void *ptr);                            // Deallocate a block of previously allocated memory
+void pmalloc_free_sized(pmalloc_t *pm, void *ptr, uint32_t size);      // Deallocate a block, given the size it was allocated with
+uint32_t pmalloc_malloc_batch(pmalloc_t *pm, uint32_t size, uint32_t count, void **out);   // Allocate count blocks of size bytes into out, returns how many were allocated
+void pmalloc_free_batch(pmalloc_t *pm, void **ptrs, uint32_t count);                       // Deallocate count blocks, sorting ptrs into address order
+
+pmalloc_handle_t *pmalloc_halloc(pmalloc_t *pm, uint32_t size);        // Allocate a movable block of size bytes, returns NULL if out of memory
+void *pmalloc_hlock(pmalloc_t *pm, pmalloc_handle_t *handle);           // Pin a movable block and return its memory, valid until it's unlocked
+void pmalloc_hunlock(pmalloc_t *pm, pmalloc_handle_t *handle);          // Undo a pmalloc_hlock, letting the block move again once none are left
+void pmalloc_hfree(pmalloc_t *pm, pmalloc_handle_t *handle);            // Deallocate a movable block and its handle
+uint32_t pmalloc_compact(pmalloc_t *pm, uint32_t budget);               // Slide unlocked movable blocks down over free space, moving at most budget bytes (0 for no limit), returns the bytes moved
 
 uint32_t pmalloc_sizeof(pmalloc_t *pm, void *ptr);                      // Return the size of a block of previously allocated memory
 uint32_t pmalloc_freemem(pmalloc_t *pm);                                // Return the amount of free memory 
 uint32_t pmalloc_totalmem(pmalloc_t *pm);                               // Return the total amount of memory
 uint32_t pmalloc_usedmem(pmalloc_t *pm);                                // Return the amount of used memory
 uint32_t pmalloc_overheadmem(pmalloc_t *pm);                            // Return the current memory overhead
+uint32_t pmalloc_largestfree(pmalloc_t *pm);                            // Return the size of the largest free block
+uint64_t pmalloc_mappedmem(pmalloc_t *pm);                              // Return the memory mapped for blocks with a mapping of their own
 
 // Internals
-void pmalloc_merge(pmalloc_t *pm, pmalloc_item_t* node);                // Merge free blocks around this block
-void pmalloc_item_insert(pmalloc_item_t **root, void *ptr);             // Insert an item into the linked list
-void pmalloc_item_remove(pmalloc_item_t **root, pmalloc_item_t *node);  // Remove an item from a linked list
+void pmalloc_merge(pmalloc_t *pm, pmalloc_item_t* node);                // Merge a free block with its free neighbours and add it to its bin
+void pmalloc_bin_insert(pmalloc_t *pm, pmalloc_item_t *node);           // Add a free block to its size class bin, or the best fit tree
+void pmalloc_bin_remove(pmalloc_t *pm, pmalloc_item_t *node);           // Remove a free block from its size class bin, or the best fit tree
+pmalloc_item_t *pmalloc_bin_find(pmalloc_t *pm, uint32_t size);         // Find a free block of at least size bytes, or NULL
 
 #ifdef DEBUG
 void pmalloc_dump_stats(pmalloc_t *pm);                                 // Debug Function
@@ -0,0 +1,202 @@
+#ifndef PMALLOC_HPP
+#define PMALLOC_HPP
+
+//
+// pmalloc.hpp - Standard C++ containers in pmalloc heaps
+//
+// pmalloc::allocator<T> is an allocator for the containers in <vector>, <map> and the rest, and
+// pmalloc::memory_resource a std::pmr::memory_resource for the polymorphic ones (C++17). Both hand out
+// memory from a pmalloc_t and give it back with pmalloc_free_sized, which checks the size it's given
+// back with against the one it was allocated with in Debug builds. pmalloc::heap,
+// pmalloc::region and pmalloc::arena set up and tear down heaps, blocks of memory and arenas with
+// their scope.
+//
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+extern "C" {
+    #include "pmalloc.h"
+    #include "pmalloc_arena.h"
+}
+
+#if __cplusplus >= 201703L && defined(__has_include)
+    #if __has_include(<memory_resource>)
+        #include <memory_resource>
+        #define PMALLOC_PMR
+    #endif
+#endif
+
+namespace pmalloc {
+
+// Allocate size bytes aligned to alignment from pm, throwing std::bad_alloc if it's out of memory
+inline void *allocate(pmalloc_t *pm, std::size_t size, std::size_t alignment = PMALLOC_ALIGN)
+{
+    if(size > UINT32_MAX || alignment > UINT32_MAX) throw std::bad_alloc();
+
+    void *ptr = alignment > PMALLOC_ALIGN ? pmalloc_memalign(pm, (uint32_t)alignment, (uint32_t)size) : pmalloc_malloc(pm, (uint32_t)size);
+    if(ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+
+// Give back memory from allocate, size being the number of bytes that were asked for. The block knows its
+// own size, so size is only checked, in Debug builds. One allocate would have refused is passed on as
+// UINT32_MAX, which no block can be, rather than truncated to a size that might match.
+inline void deallocate(pmalloc_t *pm, void *ptr, std::size_t size) noexcept
+{
+    pmalloc_free_sized(pm, ptr, size > UINT32_MAX ? UINT32_MAX : (uint32_t)size);
+}
+
+// An allocator for the standard containers. Copies, including those rebound to other types, share the
+// heap, and compare equal when it's the same one.
+template <class T>
+class allocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    allocator(pmalloc_t *pm) noexcept : pm(pm) {}
+    template <class U> allocator(const allocator<U> &other) noexcept : pm(other.heap()) {}
+
+    T *allocate(std::size_t n)
+    {
+        if(n > UINT32_MAX / sizeof(T)) throw std::bad_array_new_length();
+        return static_cast<T*>(pmalloc::allocate(pm, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        pmalloc::deallocate(pm, ptr, n * sizeof(T));
+    }
+
+    pmalloc_t *heap() const noexcept { return pm; }
+
+private:
+    pmalloc_t *pm;
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &a, const allocator<U> &b) noexcept { return a.heap() == b.heap(); }
+
+template <class T, class U>
+bool operator!=(const allocator<T> &a, const allocator<U> &b) noexcept { return a.heap() != b.heap(); }
+
+#ifdef PMALLOC_PMR
+// A memory resource for the std::pmr containers, and for the pools and buffers in <memory_resource> to
+// take their memory from
+class memory_resource : public std::pmr::memory_resource {
+public:
+    explicit memory_resource(pmalloc_t *pm) noexcept : pm(pm) {}
+
+    pmalloc_t *heap() const noexcept { return pm; }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        return pmalloc::allocate(pm, bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t) override
+    {
+        pmalloc::deallocate(pm, ptr, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const memory_resource *resource = dynamic_cast<const memory_resource*>(&other);
+        return resource != nullptr && resource->pm == pm;
+    }
+
+private:
+    pmalloc_t *pm;
+};
+#endif
+
+// A pmalloc_t, set up when it's constructed. It can't be copied or moved, as blocks point back at it.
+class heap {
+public:
+    heap() noexcept { pmalloc_init(&pm); }
+    heap(void *ptr, uint32_t size) noexcept
+    {
+        pmalloc_init(&pm);
+        pmalloc_addblock(&pm, ptr, size);
+    }
+    heap(const heap&) = delete;
+    heap &operator=(const heap&) = delete;
+
+    pmalloc_t *get() noexcept { return &pm; }
+    operator pmalloc_t*() noexcept { return &pm; }
+
+private:
+    pmalloc_t pm;
+};
+
+// A block of memory lent to a heap for as long as the region is in scope. Everything allocated from it
+// has to be freed before it goes out of scope: if it can't be taken back the heap would go on using
+// memory that's gone, so the program is stopped there instead.
+class region {
+public:
+    region(pmalloc_t *pm, void *ptr, uint32_t size) noexcept : pm(pm), ptr(ptr)
+    {
+        // A block too small to hold anything isn't added at all
+        uint32_t total = pmalloc_totalmem(pm);
+        pmalloc_addblock(pm, ptr, size);
+        added = pmalloc_totalmem(pm) != total;
+    }
+    ~region()
+    {
+        if(added && !pmalloc_removeblock(pm, ptr)) std::abort();
+    }
+    region(const region&) = delete;
+    region &operator=(const region&) = delete;
+
+private:
+    pmalloc_t *pm;
+    void *ptr;
+    bool added;
+};
+
+// A pmalloc_arena_t, destroyed with its scope
+class arena {
+public:
+    // Frees everything allocated from the arena since it was constructed, when it goes out of scope
+    class scope {
+    public:
+        explicit scope(arena &a) noexcept : a(a), mark(pmalloc_arena_save(a.get())) {}
+        ~scope() { pmalloc_arena_rollback(a.get(), mark); }
+        scope(const scope&) = delete;
+        scope &operator=(const scope&) = delete;
+
+    private:
+        arena &a;
+        pmalloc_arena_mark_t mark;
+    };
+
+    arena(pmalloc_t *pm, uint32_t chunksize) : ar(pmalloc_arena_init(pm, chunksize))
+    {
+        if(ar == NULL) throw std::bad_alloc();
+    }
+    ~arena() { pmalloc_arena_destroy(ar); }
+    arena(const arena&) = delete;
+    arena &operator=(const arena&) = delete;
+
+    void *alloc(uint32_t size)
+    {
+        void *ptr = pmalloc_arena_alloc(ar, size);
+        if(ptr == NULL) throw std::bad_alloc();
+        return ptr;
+    }
+    void reset() noexcept { pmalloc_arena_reset(ar); }
+
+    pmalloc_arena_t *get() noexcept { return ar; }
+
+private:
+    pmalloc_arena_t *ar;
+};
+
+}
+
+#endif
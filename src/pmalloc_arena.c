@@ -0,0 +1,104 @@
+//
+// pmalloc_arena - Bump pointer allocation for objects that are freed all at once
+//
+// An arena is a chain of chunks allocated from a pmalloc_t. Allocating moves a pointer up through the
+// newest chunk, starting a new one when it runs out, so objects have no header and can't be freed
+// individually. Instead the whole arena, or everything since a saved mark, is freed in one go by
+// handing whole chunks back to the pmalloc_t. The arena itself lives at the start of its first chunk.
+//
+
+#include "pmalloc_arena.h"
+
+#define PMALLOC_ARENA_ALIGN(x) (((uintptr_t)(x) + PMALLOC_ALIGN - 1) & ~(uintptr_t)(PMALLOC_ALIGN - 1))
+
+// Add a chunk of at least size bytes of space, returns NULL if out of memory
+static pmalloc_arena_chunk_t *pmalloc_arena_grow(pmalloc_arena_t *arena, uint32_t size)
+{
+	uint64_t total = PMALLOC_ARENA_ALIGN(sizeof(pmalloc_arena_chunk_t)) + (uint64_t)size;
+	if(total < arena->chunksize) total = arena->chunksize;
+	if(total > UINT32_MAX) return NULL;
+
+	pmalloc_arena_chunk_t *chunk = (pmalloc_arena_chunk_t*)pmalloc_malloc(arena->pm, (uint32_t)total);
+	if(chunk == NULL) return NULL;
+
+	chunk->prev = arena->chunk;
+	chunk->end = (char*)chunk + total;
+	arena->chunk = chunk;
+	arena->ptr = (char*)PMALLOC_ARENA_ALIGN(chunk + 1);
+
+	return chunk;
+}
+
+pmalloc_arena_t *pmalloc_arena_init(pmalloc_t *pm, uint32_t chunksize)
+{
+	// Make the first chunk with room for the arena, then move the arena into it
+	pmalloc_arena_t first;
+	first.pm = pm;
+	first.chunksize = chunksize;
+	first.chunk = NULL;
+	first.ptr = NULL;
+
+	if(pmalloc_arena_grow(&first, sizeof(pmalloc_arena_t)) == NULL) return NULL;
+
+	pmalloc_arena_t *arena = (pmalloc_arena_t*)first.ptr;
+	*arena = first;
+	arena->ptr = (char*)PMALLOC_ARENA_ALIGN(arena + 1);
+
+	return arena;
+}
+
+void pmalloc_arena_destroy(pmalloc_arena_t *arena)
+{
+	pmalloc_t *pm = arena->pm;
+
+	// The first chunk, which holds the arena, goes last
+	for(pmalloc_arena_chunk_t *chunk = arena->chunk; chunk != NULL; ) {
+		pmalloc_arena_chunk_t *prev = chunk->prev;
+		pmalloc_free(pm, chunk);
+		chunk = prev;
+	}
+}
+
+void *pmalloc_arena_alloc(pmalloc_arena_t *arena, uint32_t size)
+{
+	// Round up so the next allocation stays aligned
+	uint32_t rounded = (uint32_t)PMALLOC_ARENA_ALIGN(size);
+	if(rounded < size) return NULL;
+
+	if(rounded > (uint32_t)(arena->chunk->end - arena->ptr) && pmalloc_arena_grow(arena, rounded) == NULL) return NULL;
+
+	void *ptr = arena->ptr;
+	arena->ptr += rounded;
+	return ptr;
+}
+
+pmalloc_arena_mark_t pmalloc_arena_save(pmalloc_arena_t *arena)
+{
+	pmalloc_arena_mark_t mark;
+	mark.chunk = arena->chunk;
+	mark.ptr = arena->ptr;
+	return mark;
+}
+
+void pmalloc_arena_rollback(pmalloc_arena_t *arena, pmalloc_arena_mark_t mark)
+{
+	// Return the chunks started since the mark
+	while(arena->chunk != mark.chunk) {
+		pmalloc_arena_chunk_t *prev = arena->chunk->prev;
+		pmalloc_free(arena->pm, arena->chunk);
+		arena->chunk = prev;
+	}
+	arena->ptr = mark.ptr;
+}
+
+void pmalloc_arena_reset(pmalloc_arena_t *arena)
+{
+	// Roll back to just after the arena in its first chunk
+	pmalloc_arena_chunk_t *first = arena->chunk;
+	while(first->prev != NULL) first = first->prev;
+
+	pmalloc_arena_mark_t mark;
+	mark.chunk = first;
+	mark.ptr = (char*)PMALLOC_ARENA_ALIGN(arena + 1);
+	pmalloc_arena_rollback(arena, mark);
+}
@@ -0,0 +1,30 @@
+#ifndef PMALLOC_ARENA
+#define PMALLOC_ARENA
+
+#include "pmalloc.h"
+
+typedef struct pmalloc_arena_chunk {
+    struct pmalloc_arena_chunk *prev;   // The chunk allocated before this one, NULL for the first
+    char *end;                          // The end of this chunk's memory
+} pmalloc_arena_chunk_t;
+
+typedef struct pmalloc_arena {
+    pmalloc_t *pm;                      // Where chunks come from
+    uint32_t chunksize;                 // The size of each chunk requested from pm, unless an allocation needs more
+    pmalloc_arena_chunk_t *chunk;       // The chunk being allocated from, the newest
+    char *ptr;                          // The next free byte in chunk
+} pmalloc_arena_t;
+
+typedef struct pmalloc_arena_mark {
+    pmalloc_arena_chunk_t *chunk;       // The chunk being allocated from when the mark was taken
+    char *ptr;                          // And how far into it
+} pmalloc_arena_mark_t;
+
+pmalloc_arena_t *pmalloc_arena_init(pmalloc_t *pm, uint32_t chunksize);                // Create an arena in pm that grows chunksize bytes at a time, returns NULL if out of memory
+void pmalloc_arena_destroy(pmalloc_arena_t *arena);                                     // Return every chunk, and the arena itself, to pm
+void *pmalloc_arena_alloc(pmalloc_arena_t *arena, uint32_t size);                       // Allocate size bytes from the arena, returns NULL if out of memory
+void pmalloc_arena_reset(pmalloc_arena_t *arena);                                       // Free everything allocated from the arena, keeping its first chunk
+pmalloc_arena_mark_t pmalloc_arena_save(pmalloc_arena_t *arena);                        // Mark the arena's current position
+void pmalloc_arena_rollback(pmalloc_arena_t *arena, pmalloc_arena_mark_t mark);         // Free everything allocated from the arena since mark was taken
+
+#endif
@@ -0,0 +1,148 @@
+//
+// pmalloc_file - A heap kept in a memory mapped file
+//
+// The file starts with a pmalloc_file_header_t holding the pmalloc_t, followed by the heap's single
+// region. Built with PMALLOC_RELATIVE every link in the heap is an offset from the pmalloc_t, so the
+// file can be mapped anywhere. Without it the links are addresses, and the file can only be reopened at
+// the address it was created at. Nothing here locks the heap, and opening it writes to it, so a file may
+// be open in only one mapping at a time. pmalloc_shared_t is for a heap several processes use at once.
+//
+
+#include <stddef.h>
+
+#include "pmalloc_file.h"
+#include "pmalloc_layout.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+
+#define PMALLOC_FILE_HEADER(pm) ((pmalloc_file_header_t*)((char*)(pm) - offsetof(pmalloc_file_header_t, heap)))
+
+#define PMALLOC_FILE_FLAGS PMALLOC_LAYOUT_FLAGS(PMALLOC_FILE_RELATIVE, PMALLOC_FILE_COMPACT)
+
+// Lay out a new heap in a freshly extended, and so zeroed, file
+static void pmalloc_file_create(pmalloc_file_header_t *header, uint32_t size)
+{
+	header->version = PMALLOC_FILE_VERSION;
+	PMALLOC_LAYOUT_SET(header, PMALLOC_FILE_FLAGS, size);
+	header->root = 0;
+
+	pmalloc_init(&header->heap);
+	pmalloc_addblock_zeroed(&header->heap, header + 1, size - sizeof(pmalloc_file_header_t));
+
+	// Only a heap that was completely set up is ever recognised
+	header->magic = PMALLOC_FILE_MAGIC;
+}
+
+// Whether the heap in a file was made by a build laid out like this one, and is mapped where it can be used
+static int pmalloc_file_valid(pmalloc_file_header_t *header, uint32_t size)
+{
+	if(header->magic != PMALLOC_FILE_MAGIC || header->version != PMALLOC_FILE_VERSION) return 0;
+	return PMALLOC_LAYOUT_VALID(header, PMALLOC_FILE_FLAGS, size);
+}
+
+pmalloc_t *pmalloc_open_file(const char *path, uint32_t size)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(fd < 0) return NULL;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	// An empty file gets a new heap, anything else must already be one
+	int create = st.st_size == 0;
+	if(create) {
+		if(size < sizeof(pmalloc_file_header_t) + sizeof(pmalloc_region_t) + 4 * PMALLOC_ALIGN || ftruncate(fd, size) != 0) {
+			close(fd);
+			return NULL;
+		}
+	} else {
+		if((uint64_t)st.st_size < sizeof(pmalloc_file_header_t) || (uint64_t)st.st_size > UINT32_MAX) {
+			close(fd);
+			return NULL;
+		}
+		size = (uint32_t)st.st_size;
+	}
+
+	// A heap of addresses has to go back where it was, so ask for that first
+	void *hint = NULL;
+#ifndef PMALLOC_RELATIVE
+	if(!create) {
+		uint64_t base;
+		if(pread(fd, &base, sizeof(base), offsetof(pmalloc_file_header_t, base)) != sizeof(base)) {
+			close(fd);
+			return NULL;
+		}
+		hint = (void*)(uintptr_t)base;
+	}
+#endif
+
+	int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+	if(hint != NULL) flags |= MAP_FIXED_NOREPLACE;
+#endif
+	void *ptr = mmap(hint, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	close(fd);
+	if(ptr == MAP_FAILED) return NULL;
+
+	pmalloc_file_header_t *header = (pmalloc_file_header_t*)ptr;
+	if(create) pmalloc_file_create(header, size);
+	else if(!pmalloc_file_valid(header, size)) {
+		munmap(ptr, size);
+		return NULL;
+	}
+
+	// Callbacks belonged to whoever had the file open before, and this heap can't grow or give back memory
+	pmalloc_set_grow(&header->heap, NULL, NULL, 0);
+	pmalloc_set_release(&header->heap, NULL, NULL);
+#ifdef PMALLOC_TRACE
+	header->heap.trace = NULL;
+#endif
+
+	// Nor can it have blocks mapped outside the file, and any mappings in it were another process's
+	pmalloc_set_mmap_threshold(&header->heap, 0);
+	header->heap.nmapped = 0;
+	header->heap.mappedmem = 0;
+
+	return &header->heap;
+}
+
+int pmalloc_sync(pmalloc_t *pm)
+{
+	pmalloc_file_header_t *header = PMALLOC_FILE_HEADER(pm);
+	return msync(header, header->size, MS_SYNC) == 0;
+}
+
+void pmalloc_close_file(pmalloc_t *pm)
+{
+	pmalloc_file_header_t *header = PMALLOC_FILE_HEADER(pm);
+	pmalloc_sync(pm);
+	munmap(header, header->size);
+}
+
+void pmalloc_file_set_root(pmalloc_t *pm, void *ptr)
+{
+	PMALLOC_FILE_HEADER(pm)->root = pmalloc_file_offset(pm, ptr);
+}
+
+void *pmalloc_file_root(pmalloc_t *pm)
+{
+	return pmalloc_file_pointer(pm, PMALLOC_FILE_HEADER(pm)->root);
+}
+
+uint32_t pmalloc_file_offset(pmalloc_t *pm, void *ptr)
+{
+	return ptr != NULL ? (uint32_t)((char*)ptr - (char*)PMALLOC_FILE_HEADER(pm)) : 0;
+}
+
+void *pmalloc_file_pointer(pmalloc_t *pm, uint32_t offset)
+{
+	return offset != 0 ? (char*)PMALLOC_FILE_HEADER(pm) + offset : NULL;
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef PMALLOC_FILE
+#define PMALLOC_FILE
+
+#include "pmalloc.h"
+
+// File heap header
+#define PMALLOC_FILE_MAGIC      0x48464D50  // "PMFH"
+#define PMALLOC_FILE_VERSION    1
+
+#define PMALLOC_FILE_RELATIVE   0x01        // The heap was built with PMALLOC_RELATIVE, and can be mapped anywhere
+#define PMALLOC_FILE_COMPACT    0x02        // The heap was built with PMALLOC_COMPACT
+
+// The start of every heap file, followed by the heap's memory. Everything a build needs to agree on to
+// use the heap is checked when it's opened, so attaching to an existing heap doesn't look at its blocks.
+typedef struct pmalloc_file_header {
+    uint32_t magic;             // PMALLOC_FILE_MAGIC, written last when the file is created
+    uint16_t version;           // PMALLOC_FILE_VERSION
+    uint16_t flags;             // PMALLOC_FILE_*
+    uint16_t itemsize;          // sizeof(pmalloc_item_t)
+    uint16_t align;             // PMALLOC_ALIGN
+    uint32_t heapsize;          // sizeof(pmalloc_t)
+    uint32_t size;              // The size of the file
+    uint32_t root;              // The offset of the caller's root block, 0 for none
+    uint64_t base;              // Where the file was mapped when it was created, the only place a heap without PMALLOC_RELATIVE works
+    pmalloc_t heap;
+} pmalloc_file_header_t;
+
+pmalloc_t *pmalloc_open_file(const char *path, uint32_t size);          // Map the heap in the file at path, creating a size byte heap if the file is empty or missing. NULL if it can't be used.
+int pmalloc_sync(pmalloc_t *pm);                                        // Write a file heap out to its file, returning 0 on failure
+void pmalloc_close_file(pmalloc_t *pm);                                 // Write out and unmap a file heap
+
+void pmalloc_file_set_root(pmalloc_t *pm, void *ptr);                   // Remember a block as the way into the data in a file heap
+void *pmalloc_file_root(pmalloc_t *pm);                                 // The block last passed to pmalloc_file_set_root, or NULL
+
+uint32_t pmalloc_file_offset(pmalloc_t *pm, void *ptr);                 // The offset of a pointer into a file heap, 0 for NULL, for keeping links in blocks
+void *pmalloc_file_pointer(pmalloc_t *pm, uint32_t offset);             // The pointer for an offset from pmalloc_file_offset in the heap as it's mapped now
+
+#endif
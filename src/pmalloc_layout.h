@@ -0,0 +1,45 @@
+#ifndef PMALLOC_LAYOUT
+#define PMALLOC_LAYOUT
+
+//
+// pmalloc_layout - Internal to pmalloc_file.c and pmalloc_shared.c
+//
+// A heap kept in a file or a shared memory segment outlives the process that made it, so its header
+// records how the build that made it lays out a heap, and only a build that agrees can use it. Both
+// headers have the same flags, itemsize, align, heapsize, size and base fields. Their magic numbers and
+// versions are their own.
+//
+
+#include "pmalloc.h"
+
+// The header flags for this build, given the file's or segment's own names for the two bits
+#ifdef PMALLOC_RELATIVE
+    #define PMALLOC_LAYOUT_RELATIVE(bit) (bit)
+    #define PMALLOC_LAYOUT_BASE_VALID(header) 1
+#else
+    #define PMALLOC_LAYOUT_RELATIVE(bit) 0
+    #define PMALLOC_LAYOUT_BASE_VALID(header) ((header)->base == (uintptr_t)(header))
+#endif
+#ifdef PMALLOC_COMPACT
+    #define PMALLOC_LAYOUT_COMPACT(bit) (bit)
+#else
+    #define PMALLOC_LAYOUT_COMPACT(bit) 0
+#endif
+#define PMALLOC_LAYOUT_FLAGS(relative, compact) (PMALLOC_LAYOUT_RELATIVE(relative) | PMALLOC_LAYOUT_COMPACT(compact))
+
+// Record this build's layout in a header, which is where the heap is mapped now, for heapbytes bytes in all
+#define PMALLOC_LAYOUT_SET(header, flagbits, heapbytes) do { \
+        (header)->flags = (flagbits); \
+        (header)->itemsize = sizeof(pmalloc_item_t); \
+        (header)->align = PMALLOC_ALIGN; \
+        (header)->heapsize = sizeof(pmalloc_t); \
+        (header)->size = (heapbytes); \
+        (header)->base = (uintptr_t)(header); \
+    } while(0)
+
+// Whether the heap behind a header was made by a build laid out like this one, and is mapped where it can be used
+#define PMALLOC_LAYOUT_VALID(header, flagbits, heapbytes) \
+    ((header)->flags == (flagbits) && (header)->itemsize == sizeof(pmalloc_item_t) && (header)->align == PMALLOC_ALIGN && \
+     (header)->heapsize == sizeof(pmalloc_t) && (header)->size == (heapbytes) && PMALLOC_LAYOUT_BASE_VALID(header))
+
+#endif
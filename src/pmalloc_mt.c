@@ -0,0 +1,292 @@
+//
+// pmalloc_mt - A thread safe pmalloc with per-thread caches
+//
+// The central pmalloc_t is protected by a mutex. Each thread keeps a cache of small free blocks
+// per size class, refilled from and flushed back to the central heap in batches, so most small
+// allocations and frees never take the lock. A block freed by a thread other than the one whose
+// cache handed it out is pushed onto that cache's remote free stack, which its owner drains the
+// next time it runs out of blocks.
+//
+
+#include <string.h>
+
+#include "pmalloc_mt.h"
+
+// The header of a block given to the user, and the link used while it sits in a cache stack
+#define PMALLOC_MT_NODE(ptr) ((pmalloc_item_t*)((char*)(ptr) - sizeof(pmalloc_item_t)))
+#define PMALLOC_MT_LINK(ptr) (*(void**)(ptr))
+
+// The class to allocate a request of size bytes from, and the class a cached block of size bytes can serve
+#define PMALLOC_MT_CLASS_CEIL(size) ((size) == 0 ? 0 : ((size) - 1) / PMALLOC_MT_CLASS_SIZE)
+#define PMALLOC_MT_CLASS_FLOOR(size) ((size) / PMALLOC_MT_CLASS_SIZE > PMALLOC_MT_CLASSES ? PMALLOC_MT_CLASSES - 1 : (size) / PMALLOC_MT_CLASS_SIZE - 1)
+
+// Marks threads that couldn't get a cache, so they don't keep asking for one
+static char pmalloc_mt_uncached;
+
+// Return up to count blocks from a cache stack to the central heap. The lock must be held.
+static void pmalloc_mt_release(pmalloc_mt_t *mt, pmalloc_mt_cache_t *cache, uint32_t cls, uint32_t count)
+{
+	while(count-- > 0 && cache->bins[cls] != NULL) {
+		void *ptr = cache->bins[cls];
+		cache->bins[cls] = PMALLOC_MT_LINK(ptr);
+		cache->counts[cls]--;
+		pmalloc_free(&mt->heap, ptr);
+	}
+}
+
+// Return every block in a cache, including its remote frees, to the central heap. The lock must be held.
+static void pmalloc_mt_flush_cache(pmalloc_mt_t *mt, pmalloc_mt_cache_t *cache)
+{
+	for(uint32_t cls = 0; cls < PMALLOC_MT_CLASSES; cls++) pmalloc_mt_release(mt, cache, cls, cache->counts[cls]);
+
+	void *list = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+	while(list != NULL) {
+		void *next = PMALLOC_MT_LINK(list);
+		pmalloc_free(&mt->heap, list);
+		list = next;
+	}
+}
+
+// Push a block onto a stack of the calling thread's cache, flushing half the stack if it's grown too big
+static void pmalloc_mt_push(pmalloc_mt_cache_t *cache, void *ptr)
+{
+	uint32_t cls = PMALLOC_MT_CLASS_FLOOR(PMALLOC_MT_NODE(ptr)->size);
+
+	PMALLOC_MT_LINK(ptr) = cache->bins[cls];
+	cache->bins[cls] = ptr;
+	cache->counts[cls]++;
+
+	if(cache->counts[cls] > PMALLOC_MT_CACHE_MAX) {
+		pthread_mutex_lock(&cache->mt->lock);
+		pmalloc_mt_release(cache->mt, cache, cls, PMALLOC_MT_CACHE_MAX / 2);
+		pthread_mutex_unlock(&cache->mt->lock);
+	}
+}
+
+// Move the blocks other threads have freed into the calling thread's cache
+static void pmalloc_mt_drain(pmalloc_mt_cache_t *cache)
+{
+	void *list = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+	while(list != NULL) {
+		void *next = PMALLOC_MT_LINK(list);
+		pmalloc_mt_push(cache, list);
+		list = next;
+	}
+}
+
+// Fetch a batch of blocks for a class from the central heap, tagged as owned by the cache
+static void pmalloc_mt_refill(pmalloc_mt_t *mt, pmalloc_mt_cache_t *cache, uint32_t cls)
+{
+	uint32_t size = (cls + 1) * PMALLOC_MT_CLASS_SIZE;
+
+	pthread_mutex_lock(&mt->lock);
+	for(uint32_t i = 0; i < PMALLOC_MT_BATCH; i++) {
+		void *ptr = pmalloc_malloc(&mt->heap, size);
+		if(ptr == NULL) break;
+		PMALLOC_MT_NODE(ptr)->owner = cache->id;
+		PMALLOC_MT_LINK(ptr) = cache->bins[cls];
+		cache->bins[cls] = ptr;
+		cache->counts[cls]++;
+	}
+	pthread_mutex_unlock(&mt->lock);
+}
+
+// Called when a thread with a cache exits: give its blocks back, and leave the cache for the next new thread
+static void pmalloc_mt_thread_exit(void *value)
+{
+	if(value == &pmalloc_mt_uncached) return;
+
+	pmalloc_mt_cache_t *cache = (pmalloc_mt_cache_t*)value;
+	pmalloc_mt_t *mt = cache->mt;
+
+	pthread_mutex_lock(&mt->lock);
+	pmalloc_mt_flush_cache(mt, cache);
+	cache->active = 0;
+	pthread_mutex_unlock(&mt->lock);
+}
+
+// Get the calling thread's cache, adopting an abandoned one or making a new one the first time. NULL if there are none left.
+static pmalloc_mt_cache_t *pmalloc_mt_cache(pmalloc_mt_t *mt)
+{
+	void *value = pthread_getspecific(mt->key);
+	if(value == &pmalloc_mt_uncached) return NULL;
+	if(value != NULL) return (pmalloc_mt_cache_t*)value;
+
+	pmalloc_mt_cache_t *cache = NULL;
+
+	pthread_mutex_lock(&mt->lock);
+
+	// Adopt the cache of a thread that has exited, along with anything freed to it since
+	for(uint32_t i = 0; i < mt->ncaches && cache == NULL; i++)
+		if(!mt->caches[i]->active) cache = mt->caches[i];
+
+	// Otherwise make a new one, from the central heap itself
+	if(cache == NULL && mt->ncaches < PMALLOC_MT_MAX_THREADS) {
+		cache = (pmalloc_mt_cache_t*)pmalloc_malloc(&mt->heap, sizeof(pmalloc_mt_cache_t));
+		if(cache != NULL) {
+			memset(cache, 0, sizeof(pmalloc_mt_cache_t));
+			cache->mt = mt;
+			cache->id = ++mt->ncaches;
+			mt->caches[cache->id - 1] = cache;
+		}
+	}
+
+	if(cache != NULL) cache->active = 1;
+
+	pthread_mutex_unlock(&mt->lock);
+
+	pthread_setspecific(mt->key, cache != NULL ? (void*)cache : (void*)&pmalloc_mt_uncached);
+	return cache;
+}
+
+void pmalloc_mt_init(pmalloc_mt_t *mt)
+{
+	pmalloc_init(&mt->heap);
+	pthread_mutex_init(&mt->lock, NULL);
+	pthread_key_create(&mt->key, pmalloc_mt_thread_exit);
+
+	mt->ncaches = 0;
+	for(uint32_t i = 0; i < PMALLOC_MT_MAX_THREADS; i++) mt->caches[i] = NULL;
+}
+
+void pmalloc_mt_destroy(pmalloc_mt_t *mt)
+{
+	pthread_mutex_lock(&mt->lock);
+	for(uint32_t i = 0; i < mt->ncaches; i++) {
+		pmalloc_mt_flush_cache(mt, mt->caches[i]);
+		pmalloc_free(&mt->heap, mt->caches[i]);
+		mt->caches[i] = NULL;
+	}
+	mt->ncaches = 0;
+	pthread_mutex_unlock(&mt->lock);
+
+	pthread_key_delete(mt->key);
+	pthread_mutex_destroy(&mt->lock);
+}
+
+void pmalloc_mt_addblock(pmalloc_mt_t *mt, void *ptr, uint32_t size)
+{
+	pthread_mutex_lock(&mt->lock);
+	pmalloc_addblock(&mt->heap, ptr, size);
+	pthread_mutex_unlock(&mt->lock);
+}
+
+void *pmalloc_mt_malloc(pmalloc_mt_t *mt, uint32_t size)
+{
+	pmalloc_mt_cache_t *cache = NULL;
+
+	// Large requests, and threads without a cache, go straight to the central heap
+	if(size > PMALLOC_MT_SMALL_MAX || (cache = pmalloc_mt_cache(mt)) == NULL) {
+		pthread_mutex_lock(&mt->lock);
+		void *ptr = pmalloc_malloc(&mt->heap, size);
+		pthread_mutex_unlock(&mt->lock);
+		return ptr;
+	}
+
+	uint32_t cls = PMALLOC_MT_CLASS_CEIL(size);
+
+	if(cache->bins[cls] == NULL) {
+		// Use what other threads have given back first, then fetch a batch
+		pmalloc_mt_drain(cache);
+		if(cache->bins[cls] == NULL) pmalloc_mt_refill(mt, cache, cls);
+
+		// The central heap may only be out of memory because this cache is holding on to it
+		if(cache->bins[cls] == NULL) {
+			pmalloc_mt_flush(mt);
+			pmalloc_mt_refill(mt, cache, cls);
+		}
+		if(cache->bins[cls] == NULL) return NULL;
+	}
+
+	void *ptr = cache->bins[cls];
+	cache->bins[cls] = PMALLOC_MT_LINK(ptr);
+	cache->counts[cls]--;
+
+	// The block was sized for its class, so record what was asked for, as the central heap would
+	PMALLOC_MT_NODE(ptr)->slack = PMALLOC_MT_NODE(ptr)->size - size;
+	return ptr;
+}
+
+void *pmalloc_mt_calloc(pmalloc_mt_t *mt, uint32_t num, uint32_t size)
+{
+	// The total has to fit in a block, not wrap around to a small one
+	if(size && num > UINT32_MAX / size) return NULL;
+
+	void *mem = pmalloc_mt_malloc(mt, num * size);
+	if(mem == NULL) return NULL;
+	memset(mem, 0, num * size);
+	return mem;
+}
+
+void *pmalloc_mt_realloc(pmalloc_mt_t *mt, void *ptr, uint32_t size)
+{
+	// Match stdlib realloc() NULL interface
+	if(ptr == NULL) return pmalloc_mt_malloc(mt, size);
+
+	uint32_t owner = PMALLOC_MT_NODE(ptr)->owner;
+	uint32_t oldSize = PMALLOC_MT_NODE(ptr)->size;
+
+	// Large blocks that stay large can be resized in place by the central heap
+	if(owner == 0 && size > PMALLOC_MT_SMALL_MAX) {
+		pthread_mutex_lock(&mt->lock);
+		void *newPtr = pmalloc_realloc(&mt->heap, ptr, size);
+		pthread_mutex_unlock(&mt->lock);
+		return newPtr;
+	}
+
+	// A cached block that's already big enough stays where it is, unless it's so much bigger that the
+	// difference won't fit in its slack
+	if(owner != 0 && size <= oldSize && oldSize - size <= UINT8_MAX) {
+		PMALLOC_MT_NODE(ptr)->slack = oldSize - size;
+		return ptr;
+	}
+
+	// Otherwise move it
+	void *newPtr = pmalloc_mt_malloc(mt, size);
+	if(newPtr == NULL) return NULL;
+	memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+	pmalloc_mt_free(mt, ptr);
+
+	return newPtr;
+}
+
+void pmalloc_mt_free(pmalloc_mt_t *mt, void *ptr)
+{
+	// Match stdlib free() NULL interface
+	if(ptr == NULL) return;
+
+	// The central heap may be updating this header's flags under the lock, but never its owner
+	uint32_t owner = PMALLOC_MT_NODE(ptr)->owner;
+
+	// Not from a cache, it goes straight back to the central heap
+	if(owner == 0) {
+		pthread_mutex_lock(&mt->lock);
+		pmalloc_free(&mt->heap, ptr);
+		pthread_mutex_unlock(&mt->lock);
+		return;
+	}
+
+	// Ours, back on the stack
+	pmalloc_mt_cache_t *cache = pmalloc_mt_cache(mt);
+	if(cache != NULL && cache->id == owner) {
+		pmalloc_mt_push(cache, ptr);
+		return;
+	}
+
+	// Another thread's, push it onto that cache's remote free stack
+	pmalloc_mt_cache_t *ownerCache = mt->caches[owner - 1];
+	void *head = __atomic_load_n(&ownerCache->remote, __ATOMIC_RELAXED);
+	do {
+		PMALLOC_MT_LINK(ptr) = head;
+	} while(!__atomic_compare_exchange_n(&ownerCache->remote, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void pmalloc_mt_flush(pmalloc_mt_t *mt)
+{
+	void *value = pthread_getspecific(mt->key);
+	if(value == NULL || value == &pmalloc_mt_uncached) return;
+
+	pthread_mutex_lock(&mt->lock);
+	pmalloc_mt_flush_cache(mt, (pmalloc_mt_cache_t*)value);
+	pthread_mutex_unlock(&mt->lock);
+}
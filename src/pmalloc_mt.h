@@ -0,0 +1,49 @@
+#ifndef PMALLOC_MT
+#define PMALLOC_MT
+
+#include <pthread.h>
+
+#include "pmalloc.h"
+
+// Per-thread cache size classes: multiples of PMALLOC_MT_CLASS_SIZE up to PMALLOC_MT_SMALL_MAX bytes
+#define PMALLOC_MT_CLASS_SIZE 16
+#define PMALLOC_MT_CLASSES 32
+#define PMALLOC_MT_SMALL_MAX (PMALLOC_MT_CLASS_SIZE * PMALLOC_MT_CLASSES)
+
+#ifndef PMALLOC_MT_BATCH
+#define PMALLOC_MT_BATCH 16         // Blocks fetched from the central heap per refill
+#endif
+#ifndef PMALLOC_MT_CACHE_MAX
+#define PMALLOC_MT_CACHE_MAX 64     // Blocks cached per class before half of them are flushed back
+#endif
+#ifndef PMALLOC_MT_MAX_THREADS
+#define PMALLOC_MT_MAX_THREADS 64   // Threads beyond this many allocate straight from the central heap
+#endif
+
+typedef struct pmalloc_mt_cache {
+    struct pmalloc_mt *mt;                  // The heap this cache belongs to
+    uint32_t id;                            // The owner tag stored in the blocks it hands out
+    uint32_t active;                        // Whether a live thread owns this cache
+    void *bins[PMALLOC_MT_CLASSES];         // Stacks of cached free blocks, linked through their first word
+    uint32_t counts[PMALLOC_MT_CLASSES];    // The number of blocks in each stack
+    void *remote;                           // Stack of blocks freed by other threads, pushed atomically
+} pmalloc_mt_cache_t;
+
+typedef struct pmalloc_mt {
+    pmalloc_t heap;                                     // The central heap
+    pthread_mutex_t lock;                               // Protects the central heap and the cache registry
+    pthread_key_t key;                                  // The calling thread's cache
+    uint32_t ncaches;                                   // The number of caches created
+    pmalloc_mt_cache_t *caches[PMALLOC_MT_MAX_THREADS]; // All caches, indexed by id - 1
+} pmalloc_mt_t;
+
+void pmalloc_mt_init(pmalloc_mt_t *mt);
+void pmalloc_mt_destroy(pmalloc_mt_t *mt);                                  // Return all cached blocks to the central heap, no threads may be using mt
+void pmalloc_mt_addblock(pmalloc_mt_t *mt, void *ptr, uint32_t size);       // Add an area of memory available for allocation
+void *pmalloc_mt_malloc(pmalloc_mt_t *mt, uint32_t size);                   // Allocate size bytes of memory, returns NULL if out of memory
+void *pmalloc_mt_calloc(pmalloc_mt_t *mt, uint32_t num, uint32_t size);     // Allocate num blocks each of size bytes, clear the memory first
+void *pmalloc_mt_realloc(pmalloc_mt_t *mt, void *ptr, uint32_t size);       // Reallocate the existing block ptr to a new size and return the new block
+void pmalloc_mt_free(pmalloc_mt_t *mt, void *ptr);                          // Deallocate a block, from any thread
+void pmalloc_mt_flush(pmalloc_mt_t *mt);                                    // Return the calling thread's cached blocks to the central heap
+
+#endif
@@ -0,0 +1,74 @@
+//
+// pmalloc_pool - Lock-free pools of fixed size objects
+//
+// A pool is a single pmalloc block holding the pool itself followed by count objects. Objects carry no
+// header: while free, the first word of each holds the index of the next free object, forming a
+// Treiber stack. The stack head packs the top index with a tag that changes on every update, so a
+// compare-and-swap can't succeed against a head that was popped and pushed back in the meantime (ABA).
+//
+
+#include "pmalloc_pool.h"
+
+#define PMALLOC_POOL_INDEX(head) ((uint32_t)(head))
+#define PMALLOC_POOL_HEAD(head, index) ((((head) >> 32) + 1) << 32 | (index))
+#define PMALLOC_POOL_NEXT(obj) ((uint32_t*)(obj))
+
+// Objects are aligned like any other pmalloc block, so they start after the pool rounded up to PMALLOC_ALIGN
+#define PMALLOC_POOL_ROUND(x) (((x) + PMALLOC_ALIGN - 1) & ~(uint64_t)(PMALLOC_ALIGN - 1))
+#define PMALLOC_POOL_OFFSET PMALLOC_POOL_ROUND(sizeof(pmalloc_pool_t))
+
+pmalloc_pool_t *pmalloc_pool_init(pmalloc_t *pm, uint32_t objsize, uint32_t count)
+{
+	// Each object must hold the free stack link, and stay aligned
+	if(objsize < sizeof(uint32_t)) objsize = sizeof(uint32_t);
+	if(PMALLOC_POOL_ROUND((uint64_t)objsize) > UINT32_MAX) return NULL;
+	objsize = (uint32_t)PMALLOC_POOL_ROUND((uint64_t)objsize);
+
+	uint64_t total = PMALLOC_POOL_OFFSET + (uint64_t)objsize * count;
+	if(total > UINT32_MAX) return NULL;
+
+	pmalloc_pool_t *pool = (pmalloc_pool_t*)pmalloc_malloc(pm, (uint32_t)total);
+	if(pool == NULL) return NULL;
+
+	pool->objsize = objsize;
+	pool->count = count;
+	pool->objects = (char*)pool + PMALLOC_POOL_OFFSET;
+
+	// Chain every object onto the free stack in address order
+	for(uint32_t i = 0; i < count; i++)
+		*PMALLOC_POOL_NEXT(pool->objects + (size_t)i * objsize) = i + 1 < count ? i + 2 : 0;
+	pool->head = count > 0 ? 1 : 0;
+
+	return pool;
+}
+
+void pmalloc_pool_destroy(pmalloc_t *pm, pmalloc_pool_t *pool)
+{
+	pmalloc_free(pm, pool);
+}
+
+void *pmalloc_pool_get(pmalloc_pool_t *pool)
+{
+	uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+
+	for(;;) {
+		uint32_t index = PMALLOC_POOL_INDEX(head);
+		if(index == 0) return NULL;
+
+		// The object may be popped and written to by another thread while we read its link, the tag catches that
+		char *obj = pool->objects + (size_t)(index - 1) * pool->objsize;
+		uint32_t next = __atomic_load_n(PMALLOC_POOL_NEXT(obj), __ATOMIC_RELAXED);
+
+		if(__atomic_compare_exchange_n(&pool->head, &head, PMALLOC_POOL_HEAD(head, next), 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) return obj;
+	}
+}
+
+void pmalloc_pool_put(pmalloc_pool_t *pool, void *ptr)
+{
+	uint32_t index = (uint32_t)(((char*)ptr - pool->objects) / pool->objsize) + 1;
+	uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+
+	do {
+		__atomic_store_n(PMALLOC_POOL_NEXT(ptr), PMALLOC_POOL_INDEX(head), __ATOMIC_RELAXED);
+	} while(!__atomic_compare_exchange_n(&pool->head, &head, PMALLOC_POOL_HEAD(head, index), 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
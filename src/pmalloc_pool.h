@@ -0,0 +1,18 @@
+#ifndef PMALLOC_POOL
+#define PMALLOC_POOL
+
+#include "pmalloc.h"
+
+typedef struct pmalloc_pool {
+    uint64_t head;              // Top of the free stack: ABA tag in the upper 32 bits, object index + 1 in the lower 32 (0 when empty)
+    uint32_t objsize;           // The size of each object, rounded up to PMALLOC_ALIGN to keep them aligned
+    uint32_t count;             // The number of objects
+    char *objects;              // The first object, after this struct in the same block, PMALLOC_ALIGN aligned
+} pmalloc_pool_t;
+
+pmalloc_pool_t *pmalloc_pool_init(pmalloc_t *pm, uint32_t objsize, uint32_t count);    // Carve a pool of count objects out of pm, returns NULL if out of memory
+void pmalloc_pool_destroy(pmalloc_t *pm, pmalloc_pool_t *pool);                         // Return the whole pool to pm
+void *pmalloc_pool_get(pmalloc_pool_t *pool);                                           // Take an object from the pool, returns NULL if it's empty
+void pmalloc_pool_put(pmalloc_pool_t *pool, void *ptr);                                 // Return an object to the pool
+
+#endif
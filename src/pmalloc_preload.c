@@ -0,0 +1,302 @@
+//
+// pmalloc_preload - The C library's malloc replaced with pmalloc, for LD_PRELOAD
+//
+// LD_PRELOAD=libpmalloc_preload.so runs an unmodified program with its allocations served by
+// PMALLOC_PRELOAD_HEAPS pmalloc_t heaps, each behind its own lock and grown with anonymous mmap
+// regions. A thread allocates from the heap for the CPU it's on, and each block is tagged with its
+// heap in the header's owner byte, so any thread can free it back there. A large free trims its heap
+// by as much as it freed, unmapping the region it leaves empty or dropping the pages inside it. Blocks
+// of PMALLOC_PRELOAD_MMAP bytes or more skip the heaps and get a mapping of their own, unmapped as soon
+// as they're freed and resized with mremap.
+//
+// Nothing here calls into the real allocator, so there's no dlsym bootstrap to recurse through: the
+// heaps are set up on the first call with nothing but mutex initialisation, before anything that might
+// allocate itself (pthread_atfork, atexit) is registered. Every lock is held across fork and released
+// on both sides, so a child always starts with usable heaps.
+//
+// With PMALLOC_PRELOAD_STATS set in the environment a summary of every heap is written to stderr at
+// exit, with the process's peak RSS. It goes to a copy of stderr taken at startup, as some programs
+// close stderr itself on the way out.
+//
+
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "pmalloc.h"
+#include "pmalloc_provider.h"
+#ifdef PMALLOC_STATS
+	#include "pmalloc_stats.h"
+#endif
+
+#ifndef PMALLOC_PRELOAD_HEAPS
+#define PMALLOC_PRELOAD_HEAPS 8                 // Independent heaps, picked by CPU, at most 255
+#endif
+#ifndef PMALLOC_PRELOAD_GROW
+#define PMALLOC_PRELOAD_GROW (1024 * 1024)      // The first region each heap maps, doubling from there
+#endif
+#ifndef PMALLOC_PRELOAD_QUICK
+#define PMALLOC_PRELOAD_QUICK 256               // Frees up to this size go to the quick lists
+#endif
+#ifndef PMALLOC_PRELOAD_TRIM
+#define PMALLOC_PRELOAD_TRIM (1024 * 1024)      // Frees at least this big trim their heap
+#endif
+#ifndef PMALLOC_PRELOAD_MMAP
+#define PMALLOC_PRELOAD_MMAP (256 * 1024)       // Allocations at least this big get a mapping of their own
+#endif
+
+#define PMALLOC_PRELOAD_EXPORT __attribute__((visibility("default")))
+#define PMALLOC_PRELOAD_NODE(ptr) ((pmalloc_item_t*)((char*)(ptr) - sizeof(pmalloc_item_t)))
+
+typedef struct pmalloc_preload_heap {
+	pmalloc_t heap;
+	pthread_mutex_t lock;
+} __attribute__((aligned(64))) pmalloc_preload_heap_t;
+
+static pmalloc_preload_heap_t pmalloc_preload_heaps[PMALLOC_PRELOAD_HEAPS];
+static int pmalloc_preload_state;               // 0 before setup, 1 while one thread sets up, 2 once ready
+static int pmalloc_preload_report_fd = -1;      // Where to write the summary at exit
+
+static void pmalloc_preload_prepare(void)
+{
+	for(uint32_t i = 0; i < PMALLOC_PRELOAD_HEAPS; i++) pthread_mutex_lock(&pmalloc_preload_heaps[i].lock);
+}
+
+static void pmalloc_preload_release(void)
+{
+	for(uint32_t i = 0; i < PMALLOC_PRELOAD_HEAPS; i++) pthread_mutex_unlock(&pmalloc_preload_heaps[i].lock);
+}
+
+static void pmalloc_preload_report(void)
+{
+	FILE *out = fdopen(pmalloc_preload_report_fd, "w");
+	if(out == NULL) return;
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	uint64_t totalmem = 0, usedmem = 0, mappedmem = 0;
+	for(uint32_t i = 0; i < PMALLOC_PRELOAD_HEAPS; i++) {
+		pthread_mutex_lock(&pmalloc_preload_heaps[i].lock);
+		totalmem += pmalloc_totalmem(&pmalloc_preload_heaps[i].heap);
+		usedmem += pmalloc_usedmem(&pmalloc_preload_heaps[i].heap);
+		mappedmem += pmalloc_mappedmem(&pmalloc_preload_heaps[i].heap);
+		pthread_mutex_unlock(&pmalloc_preload_heaps[i].lock);
+	}
+	fprintf(out, "pmalloc: pid %d, %d heaps, %llu KB in heaps, %llu KB used, %llu KB mapped, max RSS %ld KB\n", (int)getpid(), PMALLOC_PRELOAD_HEAPS,
+		(unsigned long long)totalmem / 1024, (unsigned long long)usedmem / 1024, (unsigned long long)mappedmem / 1024, usage.ru_maxrss);
+
+#ifdef PMALLOC_STATS
+	for(uint32_t i = 0; i < PMALLOC_PRELOAD_HEAPS; i++) {
+		pmalloc_stats_t stats;
+		pthread_mutex_lock(&pmalloc_preload_heaps[i].lock);
+		pmalloc_stats_get(&pmalloc_preload_heaps[i].heap, &stats);
+		pthread_mutex_unlock(&pmalloc_preload_heaps[i].lock);
+		if(stats.allocs == 0 && stats.totalmem == 0) continue;
+
+		fprintf(out, "pmalloc: heap %u ", i);
+		pmalloc_stats_json(&stats, out);
+	}
+#endif
+
+	fclose(out);
+}
+
+static void pmalloc_preload_setup(void)
+{
+	int expected = 0;
+	if(!__atomic_compare_exchange_n(&pmalloc_preload_state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		// Someone else is setting up, which never allocates, so it won't be long
+		while(__atomic_load_n(&pmalloc_preload_state, __ATOMIC_ACQUIRE) != 2) sched_yield();
+		return;
+	}
+
+	for(uint32_t i = 0; i < PMALLOC_PRELOAD_HEAPS; i++) {
+		pmalloc_t *pm = &pmalloc_preload_heaps[i].heap;
+		pmalloc_init(pm);
+		pmalloc_set_engine(pm, PMALLOC_ENGINE_TLSF);
+		pmalloc_set_quick(pm, PMALLOC_PRELOAD_QUICK, PMALLOC_PRELOAD_GROW);
+		pmalloc_provider_mmap(pm, PMALLOC_PRELOAD_GROW);
+		pmalloc_set_mmap_threshold(pm, PMALLOC_PRELOAD_MMAP);
+		pthread_mutex_init(&pmalloc_preload_heaps[i].lock, NULL);
+	}
+	__atomic_store_n(&pmalloc_preload_state, 2, __ATOMIC_RELEASE);
+
+	// These may allocate, which is fine now
+	pthread_atfork(pmalloc_preload_prepare, pmalloc_preload_release, pmalloc_preload_release);
+	if(getenv("PMALLOC_PRELOAD_STATS") != NULL && (pmalloc_preload_report_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3)) >= 0)
+		atexit(pmalloc_preload_report);
+}
+
+// The calling thread's heap
+static inline uint32_t pmalloc_preload_home(void)
+{
+	if(__builtin_expect(__atomic_load_n(&pmalloc_preload_state, __ATOMIC_ACQUIRE) != 2, 0)) pmalloc_preload_setup();
+
+	int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : (uint32_t)cpu % PMALLOC_PRELOAD_HEAPS;
+}
+
+// Allocate from the calling thread's heap, or any other if that fails, aligned to alignment if it's more than PMALLOC_ALIGN
+static void *pmalloc_preload_alloc(size_t alignment, size_t size, int zero)
+{
+	if(size > UINT32_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	uint32_t home = pmalloc_preload_home();
+	for(uint32_t i = 0; i < PMALLOC_PRELOAD_HEAPS; i++) {
+		uint32_t index = (home + i) % PMALLOC_PRELOAD_HEAPS;
+		pmalloc_preload_heap_t *heap = &pmalloc_preload_heaps[index];
+
+		pthread_mutex_lock(&heap->lock);
+		void *ptr;
+		if(alignment > PMALLOC_ALIGN) ptr = pmalloc_memalign(&heap->heap, (uint32_t)alignment, (uint32_t)size);
+		else if(zero) ptr = pmalloc_calloc(&heap->heap, 1, (uint32_t)size);
+		else ptr = pmalloc_malloc(&heap->heap, (uint32_t)size);
+		if(ptr != NULL) PMALLOC_PRELOAD_NODE(ptr)->owner = (uint8_t)(index + 1);
+		pthread_mutex_unlock(&heap->lock);
+
+		if(ptr != NULL) {
+			if(zero && alignment > PMALLOC_ALIGN) memset(ptr, 0, size);
+			return ptr;
+		}
+	}
+
+	errno = ENOMEM;
+	return NULL;
+}
+
+// The heap a block came from
+static inline pmalloc_preload_heap_t *pmalloc_preload_owner(void *ptr)
+{
+	return &pmalloc_preload_heaps[PMALLOC_PRELOAD_NODE(ptr)->owner - 1];
+}
+
+PMALLOC_PRELOAD_EXPORT void *malloc(size_t size)
+{
+	return pmalloc_preload_alloc(0, size, 0);
+}
+
+PMALLOC_PRELOAD_EXPORT void *calloc(size_t num, size_t size)
+{
+	size_t total;
+	if(__builtin_mul_overflow(num, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return pmalloc_preload_alloc(0, total, 1);
+}
+
+PMALLOC_PRELOAD_EXPORT void free(void *ptr)
+{
+	// Match stdlib free() NULL interface
+	if(ptr == NULL) return;
+
+	pmalloc_preload_heap_t *heap = pmalloc_preload_owner(ptr);
+	pthread_mutex_lock(&heap->lock);
+	// A block with a mapping of its own leaves nothing in the heap to trim
+	uint32_t size = PMALLOC_PRELOAD_NODE(ptr)->flags & PMALLOC_FLAG_MAPPED ? 0 : PMALLOC_PRELOAD_NODE(ptr)->size;
+	uint32_t freemem = pmalloc_freemem(&heap->heap);
+	pmalloc_free(&heap->heap, ptr);
+	if(size >= PMALLOC_PRELOAD_TRIM) pmalloc_trim(&heap->heap, freemem);
+	pthread_mutex_unlock(&heap->lock);
+}
+
+PMALLOC_PRELOAD_EXPORT void *realloc(void *ptr, size_t size)
+{
+	if(ptr == NULL) return malloc(size);
+	if(size == 0) {
+		free(ptr);
+		return NULL;
+	}
+	if(size > UINT32_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Resize it within its own heap if it can be
+	pmalloc_preload_heap_t *heap = pmalloc_preload_owner(ptr);
+	uint8_t owner = PMALLOC_PRELOAD_NODE(ptr)->owner;
+	pthread_mutex_lock(&heap->lock);
+	uint32_t oldSize = pmalloc_sizeof(&heap->heap, ptr);
+	void *newPtr = pmalloc_realloc(&heap->heap, ptr, (uint32_t)size);
+	if(newPtr != NULL) PMALLOC_PRELOAD_NODE(newPtr)->owner = owner;
+	pthread_mutex_unlock(&heap->lock);
+	if(newPtr != NULL) return newPtr;
+
+	// Otherwise move it to another
+	newPtr = malloc(size);
+	if(newPtr == NULL) return NULL;
+	memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+	free(ptr);
+
+	return newPtr;
+}
+
+PMALLOC_PRELOAD_EXPORT void *reallocarray(void *ptr, size_t num, size_t size)
+{
+	size_t total;
+	if(__builtin_mul_overflow(num, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, total);
+}
+
+PMALLOC_PRELOAD_EXPORT void *memalign(size_t alignment, size_t size)
+{
+	if(alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > UINT32_MAX / 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return pmalloc_preload_alloc(alignment, size, 0);
+}
+
+PMALLOC_PRELOAD_EXPORT int posix_memalign(void **out, size_t alignment, size_t size)
+{
+	if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment > UINT32_MAX / 2) return EINVAL;
+
+	void *ptr = pmalloc_preload_alloc(alignment, size, 0);
+	if(ptr == NULL) return ENOMEM;
+	*out = ptr;
+	return 0;
+}
+
+PMALLOC_PRELOAD_EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+PMALLOC_PRELOAD_EXPORT void *valloc(size_t size)
+{
+	return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+PMALLOC_PRELOAD_EXPORT void *pvalloc(size_t size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+PMALLOC_PRELOAD_EXPORT size_t malloc_usable_size(void *ptr)
+{
+	if(ptr == NULL) return 0;
+
+	pmalloc_preload_heap_t *heap = pmalloc_preload_owner(ptr);
+	pthread_mutex_lock(&heap->lock);
+	size_t size = pmalloc_sizeof(&heap->heap, ptr);
+	pthread_mutex_unlock(&heap->lock);
+	return size;
+}
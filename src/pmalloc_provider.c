@@ -0,0 +1,68 @@
+//
+// pmalloc_provider - Where a pmalloc_t gets more memory from when it runs out
+//
+// The mmap provider maps fresh anonymous pages for each region, which the kernel has already zeroed, and
+// unmaps any region pmalloc_trim finds entirely free. The static provider hands out a caller's block of
+// memory one region at a time, so a heap with a fixed budget still only touches what it uses.
+//
+
+#include "pmalloc_provider.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+	#include <unistd.h>
+
+static int pmalloc_mmap_grow(pmalloc_t *pm, uint32_t min, uint32_t size, void *ctx)
+{
+	(void)min;
+	(void)ctx;
+
+	// Whole pages, as that's what will be mapped anyway
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t length = ((uint64_t)size + page - 1) & ~(page - 1);
+	if(length > UINT32_MAX) length = (uint64_t)UINT32_MAX & ~(page - 1);
+	if(length < min) return 0;
+
+	void *ptr = mmap(NULL, (size_t)length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ptr == MAP_FAILED) return 0;
+
+	pmalloc_addblock_zeroed(pm, ptr, (uint32_t)length);
+	return 1;
+}
+
+static void pmalloc_mmap_release(void *ptr, uint32_t size, void *ctx)
+{
+	(void)ctx;
+	munmap(ptr, size);
+}
+
+void pmalloc_provider_mmap(pmalloc_t *pm, uint32_t size)
+{
+	pmalloc_set_grow(pm, pmalloc_mmap_grow, NULL, size);
+	pmalloc_set_release(pm, pmalloc_mmap_release, NULL);
+}
+#endif
+
+static int pmalloc_static_grow(pmalloc_t *pm, uint32_t min, uint32_t size, void *ctx)
+{
+	pmalloc_static_t *pool = (pmalloc_static_t*)ctx;
+
+	// Whatever is left if there isn't size bytes, as long as there's min
+	uint32_t left = pool->size - pool->used;
+	if(left < min) return 0;
+	if(size > left) size = left;
+
+	pmalloc_addblock(pm, pool->ptr + pool->used, size);
+	pool->used += size;
+	return 1;
+}
+
+void pmalloc_provider_static(pmalloc_t *pm, pmalloc_static_t *pool, void *ptr, uint32_t size, uint32_t chunksize)
+{
+	pool->ptr = (char*)ptr;
+	pool->size = size;
+	pool->used = 0;
+
+	// The regions are carved out of one block, so there's nowhere to give them back to
+	pmalloc_set_grow(pm, pmalloc_static_grow, pool, chunksize);
+}
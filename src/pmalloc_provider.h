@@ -0,0 +1,16 @@
+#ifndef PMALLOC_PROVIDER
+#define PMALLOC_PROVIDER
+
+#include "pmalloc.h"
+
+// A caller supplied block of memory that a heap grows into a region at a time
+typedef struct pmalloc_static {
+    char *ptr;                  // The memory
+    uint32_t size;              // Its size
+    uint32_t used;              // How much of it has been handed out, from the start
+} pmalloc_static_t;
+
+void pmalloc_provider_mmap(pmalloc_t *pm, uint32_t size);              // Grow pm with anonymous mmap regions, starting at size bytes, and unmap them in pmalloc_trim
+void pmalloc_provider_static(pmalloc_t *pm, pmalloc_static_t *pool, void *ptr, uint32_t size, uint32_t chunksize);  // Grow pm from the size bytes at ptr, chunksize bytes at first
+
+#endif
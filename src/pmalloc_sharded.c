@@ -0,0 +1,158 @@
+//
+// pmalloc_sharded - Independent heaps per CPU, for allocation that scales with cores
+//
+// The memory is split between several pmalloc_t shards, each behind a lock of its own. A thread
+// allocates from the shard for the CPU it's running on, so threads on different CPUs rarely contend,
+// and takes from the others in turn when that shard is out of memory. A block is freed back to the
+// shard whose slice of memory it's in, found by a binary search of the slices.
+//
+
+#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <string.h>
+
+#include "pmalloc_sharded.h"
+
+// The shard for the calling thread: its CPU where that's known, otherwise a hash of the thread
+static uint32_t pmalloc_sharded_home(pmalloc_sharded_t *sh)
+{
+#ifdef __linux__
+	int cpu = sched_getcpu();
+	if(cpu >= 0) return (uint32_t)cpu % sh->count;
+#endif
+	uint64_t id = (uint64_t)(uintptr_t)pthread_self();
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	return (uint32_t)id % sh->count;
+}
+
+// The shard a block was allocated from
+static pmalloc_shard_t *pmalloc_sharded_owner(pmalloc_sharded_t *sh, void *ptr)
+{
+	uint32_t low = 0, high = sh->nranges;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		if((char*)ptr < sh->ranges[mid].start) high = mid;
+		else if((char*)ptr >= sh->ranges[mid].end) low = mid + 1;
+		else return &sh->shards[sh->ranges[mid].shard];
+	}
+	return NULL;
+}
+
+void pmalloc_sharded_init(pmalloc_sharded_t *sh, uint32_t count)
+{
+	if(count < 1) count = 1;
+	if(count > PMALLOC_SHARDED_MAX) count = PMALLOC_SHARDED_MAX;
+
+	sh->count = count;
+	sh->nranges = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		pmalloc_init(&sh->shards[i].heap);
+		pthread_mutex_init(&sh->shards[i].lock, NULL);
+	}
+}
+
+void pmalloc_sharded_destroy(pmalloc_sharded_t *sh)
+{
+	for(uint32_t i = 0; i < sh->count; i++) pthread_mutex_destroy(&sh->shards[i].lock);
+}
+
+int pmalloc_sharded_addblock(pmalloc_sharded_t *sh, void *ptr, uint32_t size)
+{
+	// Every slice has to be found again when its blocks are freed
+	if(sh->nranges + sh->count > PMALLOC_SHARDED_RANGES) return 0;
+
+	// An equal slice each, the last taking what's left over
+	uint32_t slice = (size / sh->count) & ~(uint32_t)(PMALLOC_ALIGN - 1);
+	for(uint32_t i = 0; i < sh->count; i++) {
+		pmalloc_sharded_range_t range;
+		range.start = (char*)ptr + i * slice;
+		range.end = i + 1 < sh->count ? range.start + slice : (char*)ptr + size;
+		range.shard = i;
+		pmalloc_addblock(&sh->shards[i].heap, range.start, (uint32_t)(range.end - range.start));
+
+		// Keep the slices in address order
+		uint32_t at = sh->nranges++;
+		while(at > 0 && sh->ranges[at - 1].start > range.start) {
+			sh->ranges[at] = sh->ranges[at - 1];
+			at--;
+		}
+		sh->ranges[at] = range;
+	}
+
+	return 1;
+}
+
+void *pmalloc_sharded_malloc(pmalloc_sharded_t *sh, uint32_t size)
+{
+	uint32_t home = pmalloc_sharded_home(sh);
+
+	// Our own shard, then steal from the others
+	for(uint32_t i = 0; i < sh->count; i++) {
+		pmalloc_shard_t *shard = &sh->shards[(home + i) % sh->count];
+		pthread_mutex_lock(&shard->lock);
+		void *ptr = pmalloc_malloc(&shard->heap, size);
+		pthread_mutex_unlock(&shard->lock);
+		if(ptr != NULL) return ptr;
+	}
+
+	return NULL;
+}
+
+void *pmalloc_sharded_calloc(pmalloc_sharded_t *sh, uint32_t num, uint32_t size)
+{
+	// The total has to fit in a block, not wrap around to a small one
+	if(size && num > UINT32_MAX / size) return NULL;
+
+	void *mem = pmalloc_sharded_malloc(sh, num * size);
+	if(mem == NULL) return NULL;
+	memset(mem, 0, num * size);
+	return mem;
+}
+
+void *pmalloc_sharded_realloc(pmalloc_sharded_t *sh, void *ptr, uint32_t size)
+{
+	// Match stdlib realloc() NULL interface
+	if(ptr == NULL) return pmalloc_sharded_malloc(sh, size);
+
+	// Resize it in its own shard if it can be
+	pmalloc_shard_t *shard = pmalloc_sharded_owner(sh, ptr);
+	pthread_mutex_lock(&shard->lock);
+	uint32_t oldSize = pmalloc_sizeof(&shard->heap, ptr);
+	void *newPtr = pmalloc_realloc(&shard->heap, ptr, size);
+	pthread_mutex_unlock(&shard->lock);
+	if(newPtr != NULL) return newPtr;
+
+	// Otherwise move it to whichever shard has room
+	newPtr = pmalloc_sharded_malloc(sh, size);
+	if(newPtr == NULL) return NULL;
+	memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+	pmalloc_sharded_free(sh, ptr);
+
+	return newPtr;
+}
+
+void pmalloc_sharded_free(pmalloc_sharded_t *sh, void *ptr)
+{
+	// Match stdlib free() NULL interface
+	if(ptr == NULL) return;
+
+	pmalloc_shard_t *shard = pmalloc_sharded_owner(sh, ptr);
+	pthread_mutex_lock(&shard->lock);
+	pmalloc_free(&shard->heap, ptr);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+uint32_t pmalloc_sharded_freemem(pmalloc_sharded_t *sh)
+{
+	uint32_t freemem = 0;
+	for(uint32_t i = 0; i < sh->count; i++) {
+		pthread_mutex_lock(&sh->shards[i].lock);
+		freemem += pmalloc_freemem(&sh->shards[i].heap);
+		pthread_mutex_unlock(&sh->shards[i].lock);
+	}
+	return freemem;
+}
@@ -0,0 +1,44 @@
+#ifndef PMALLOC_SHARDED
+#define PMALLOC_SHARDED
+
+#include <pthread.h>
+
+#include "pmalloc.h"
+
+#ifndef PMALLOC_SHARDED_MAX
+#define PMALLOC_SHARDED_MAX 64          // The most shards a pmalloc_sharded_t can have
+#endif
+#ifndef PMALLOC_SHARDED_RANGES
+#define PMALLOC_SHARDED_RANGES 256      // The most slices of memory it can look up, blocks that would need more aren't added
+#endif
+
+// An independent heap with a lock of its own, on a cache line of its own
+typedef struct pmalloc_shard {
+    pmalloc_t heap;
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) pmalloc_shard_t;
+
+// The slice of an added block given to a shard
+typedef struct pmalloc_sharded_range {
+    char *start;
+    char *end;
+    uint32_t shard;
+} pmalloc_sharded_range_t;
+
+typedef struct pmalloc_sharded {
+    uint32_t count;                                         // The number of shards
+    uint32_t nranges;                                       // The number of slices, sorted by address
+    pmalloc_sharded_range_t ranges[PMALLOC_SHARDED_RANGES];
+    pmalloc_shard_t shards[PMALLOC_SHARDED_MAX];
+} pmalloc_sharded_t;
+
+void pmalloc_sharded_init(pmalloc_sharded_t *sh, uint32_t count);                   // Set up count shards, at most PMALLOC_SHARDED_MAX
+void pmalloc_sharded_destroy(pmalloc_sharded_t *sh);                                // No threads may be using sh
+int pmalloc_sharded_addblock(pmalloc_sharded_t *sh, void *ptr, uint32_t size);      // Split an area of memory between the shards, before any thread allocates, returns 1 if it was added
+void *pmalloc_sharded_malloc(pmalloc_sharded_t *sh, uint32_t size);                 // Allocate from the calling CPU's shard, or any other if it's out of memory
+void *pmalloc_sharded_calloc(pmalloc_sharded_t *sh, uint32_t num, uint32_t size);   // Allocate num blocks each of size bytes, clear the memory first
+void *pmalloc_sharded_realloc(pmalloc_sharded_t *sh, void *ptr, uint32_t size);     // Reallocate the existing block ptr to a new size and return the new block
+void pmalloc_sharded_free(pmalloc_sharded_t *sh, void *ptr);                        // Deallocate a block, from any thread
+uint32_t pmalloc_sharded_freemem(pmalloc_sharded_t *sh);                            // The free memory of all the shards together
+
+#endif
@@ -0,0 +1,226 @@
+//
+// pmalloc_shared - A heap in shared memory, used by several processes at once
+//
+// The segment starts with a pmalloc_shared_t holding a process shared mutex and the pmalloc_t, followed
+// by the heap's single region, so every process that maps it is working on the same heap and can pass
+// blocks to the others as offsets without copying them. Built with PMALLOC_RELATIVE the links in the heap
+// are offsets too, and each process can map the segment wherever it likes. Without it the segment has to
+// be mapped at the same address in every process. The lock is robust where the system supports it, so a
+// process that dies holding it doesn't leave the others waiting forever. It may have died part way
+// through changing the heap, though, so from then on the heap is suspect and every call fails until
+// pmalloc_shared_recover says otherwise.
+//
+
+#include <stddef.h>
+
+#include "pmalloc_shared.h"
+#include "pmalloc_layout.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <errno.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+	#define PMALLOC_SHARED_ROBUST
+#endif
+
+#define PMALLOC_SHARED_FLAGS PMALLOC_LAYOUT_FLAGS(PMALLOC_SHARED_RELATIVE, PMALLOC_SHARED_COMPACT)
+
+// Whether the heap in a segment was made by a build laid out like this one, and is mapped where it can be used
+static int pmalloc_shared_valid(pmalloc_shared_t *sh, uint32_t size)
+{
+	if(__atomic_load_n(&sh->magic, __ATOMIC_ACQUIRE) != PMALLOC_SHARED_MAGIC || sh->version != PMALLOC_SHARED_VERSION) return 0;
+	return PMALLOC_LAYOUT_VALID(sh, PMALLOC_SHARED_FLAGS, size);
+}
+
+// Take the lock, whatever state the heap is in
+static void pmalloc_shared_take(pmalloc_shared_t *sh)
+{
+	int err = pthread_mutex_lock(&sh->lock);
+#ifdef PMALLOC_SHARED_ROBUST
+	// Whoever had it died, maybe part way through a call, so the lock is usable again but the heap can't be trusted
+	if(err == EOWNERDEAD) {
+		sh->recovered++;
+		sh->suspect = 1;
+		pthread_mutex_consistent(&sh->lock);
+	}
+#else
+	(void)err;
+#endif
+}
+
+pmalloc_shared_t *pmalloc_shared_create(int fd, uint32_t size)
+{
+	// Only an empty segment is known to be zero, and has no one else using it
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size != 0) return NULL;
+	if(size < sizeof(pmalloc_shared_t) + sizeof(pmalloc_region_t) + 4 * PMALLOC_ALIGN || ftruncate(fd, size) != 0) return NULL;
+
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(ptr == MAP_FAILED) return NULL;
+
+	pmalloc_shared_t *sh = (pmalloc_shared_t*)ptr;
+	sh->version = PMALLOC_SHARED_VERSION;
+	PMALLOC_LAYOUT_SET(sh, PMALLOC_SHARED_FLAGS, size);
+	sh->root = 0;
+	sh->recovered = 0;
+	sh->suspect = 0;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef PMALLOC_SHARED_ROBUST
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+	int err = pthread_mutex_init(&sh->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if(err != 0) {
+		munmap(ptr, size);
+		return NULL;
+	}
+
+	// Marked shared, the heap won't take a grow or release function, a trace or an mmap threshold, which
+	// would all be one process's, so its mapping table stays empty and attaching has nothing to reset.
+	pmalloc_init(&sh->heap);
+	sh->heap.shared = 1;
+	pmalloc_addblock_zeroed(&sh->heap, sh + 1, size - sizeof(pmalloc_shared_t));
+
+	// Only a heap that was completely set up is ever attached to
+	__atomic_store_n(&sh->magic, PMALLOC_SHARED_MAGIC, __ATOMIC_RELEASE);
+
+	return sh;
+}
+
+pmalloc_shared_t *pmalloc_shared_attach(int fd)
+{
+	struct stat st;
+	if(fstat(fd, &st) != 0) return NULL;
+	if((uint64_t)st.st_size < sizeof(pmalloc_shared_t) || (uint64_t)st.st_size > UINT32_MAX) return NULL;
+	uint32_t size = (uint32_t)st.st_size;
+
+	// A heap of addresses has to be where it was created, so ask for that first
+	void *hint = NULL;
+	int flags = MAP_SHARED;
+#ifndef PMALLOC_RELATIVE
+	uint64_t base;
+	if(pread(fd, &base, sizeof(base), offsetof(pmalloc_shared_t, base)) != sizeof(base)) return NULL;
+	hint = (void*)(uintptr_t)base;
+	#ifdef MAP_FIXED_NOREPLACE
+		flags |= MAP_FIXED_NOREPLACE;
+	#endif
+#endif
+
+	void *ptr = mmap(hint, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if(ptr == MAP_FAILED) return NULL;
+
+	pmalloc_shared_t *sh = (pmalloc_shared_t*)ptr;
+	if(!pmalloc_shared_valid(sh, size)) {
+		munmap(ptr, size);
+		return NULL;
+	}
+
+	return sh;
+}
+
+void pmalloc_shared_detach(pmalloc_shared_t *sh)
+{
+	munmap(sh, sh->size);
+}
+
+pmalloc_t *pmalloc_shared_lock(pmalloc_shared_t *sh)
+{
+	pmalloc_shared_take(sh);
+	if(sh->suspect) {
+		pthread_mutex_unlock(&sh->lock);
+		return NULL;
+	}
+	return &sh->heap;
+}
+
+void pmalloc_shared_unlock(pmalloc_shared_t *sh)
+{
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void pmalloc_shared_recover(pmalloc_shared_t *sh)
+{
+	pmalloc_shared_take(sh);
+	sh->suspect = 0;
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void *pmalloc_shared_malloc(pmalloc_shared_t *sh, uint32_t size)
+{
+	pmalloc_t *pm = pmalloc_shared_lock(sh);
+	if(pm == NULL) return NULL;
+
+	void *ptr = pmalloc_malloc(pm, size);
+	pmalloc_shared_unlock(sh);
+	return ptr;
+}
+
+void *pmalloc_shared_calloc(pmalloc_shared_t *sh, uint32_t num, uint32_t size)
+{
+	pmalloc_t *pm = pmalloc_shared_lock(sh);
+	if(pm == NULL) return NULL;
+
+	void *ptr = pmalloc_calloc(pm, num, size);
+	pmalloc_shared_unlock(sh);
+	return ptr;
+}
+
+void *pmalloc_shared_realloc(pmalloc_shared_t *sh, void *ptr, uint32_t size)
+{
+	pmalloc_t *pm = pmalloc_shared_lock(sh);
+	if(pm == NULL) return NULL;
+
+	void *newPtr = pmalloc_realloc(pm, ptr, size);
+	pmalloc_shared_unlock(sh);
+	return newPtr;
+}
+
+void pmalloc_shared_free(pmalloc_shared_t *sh, void *ptr)
+{
+	// Match stdlib free() NULL interface
+	if(ptr == NULL) return;
+
+	// A suspect heap keeps the block rather than risk making things worse
+	pmalloc_t *pm = pmalloc_shared_lock(sh);
+	if(pm == NULL) return;
+
+	pmalloc_free(pm, ptr);
+	pmalloc_shared_unlock(sh);
+}
+
+uint32_t pmalloc_shared_freemem(pmalloc_shared_t *sh)
+{
+	pmalloc_t *pm = pmalloc_shared_lock(sh);
+	if(pm == NULL) return 0;
+
+	uint32_t freemem = pmalloc_freemem(pm);
+	pmalloc_shared_unlock(sh);
+	return freemem;
+}
+
+void pmalloc_shared_set_root(pmalloc_shared_t *sh, void *ptr)
+{
+	__atomic_store_n(&sh->root, pmalloc_shared_offset(sh, ptr), __ATOMIC_RELEASE);
+}
+
+void *pmalloc_shared_root(pmalloc_shared_t *sh)
+{
+	return pmalloc_shared_pointer(sh, __atomic_load_n(&sh->root, __ATOMIC_ACQUIRE));
+}
+
+uint32_t pmalloc_shared_offset(pmalloc_shared_t *sh, void *ptr)
+{
+	return ptr != NULL ? (uint32_t)((char*)ptr - (char*)sh) : 0;
+}
+
+void *pmalloc_shared_pointer(pmalloc_shared_t *sh, uint32_t offset)
+{
+	return offset != 0 ? (char*)sh + offset : NULL;
+}
+#endif
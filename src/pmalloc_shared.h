@@ -0,0 +1,53 @@
+#ifndef PMALLOC_SHARED
+#define PMALLOC_SHARED
+
+#include <pthread.h>
+
+#include "pmalloc.h"
+
+// Shared heap header
+#define PMALLOC_SHARED_MAGIC    0x48534D50  // "PMSH"
+#define PMALLOC_SHARED_VERSION  2
+
+#define PMALLOC_SHARED_RELATIVE 0x01        // The heap was built with PMALLOC_RELATIVE, and can be mapped anywhere
+#define PMALLOC_SHARED_COMPACT  0x02        // The heap was built with PMALLOC_COMPACT
+
+// The start of a shared memory segment holding a heap, followed by the heap's memory. Like a file heap,
+// everything a process needs to agree on to use the heap is checked when it attaches.
+typedef struct pmalloc_shared {
+    uint32_t magic;             // PMALLOC_SHARED_MAGIC, written last when the heap is created
+    uint16_t version;           // PMALLOC_SHARED_VERSION
+    uint16_t flags;             // PMALLOC_SHARED_*
+    uint16_t itemsize;          // sizeof(pmalloc_item_t)
+    uint16_t align;             // PMALLOC_ALIGN
+    uint32_t heapsize;          // sizeof(pmalloc_t)
+    uint32_t size;              // The size of the segment
+    uint32_t root;              // The offset of the caller's root block, 0 for none
+    uint32_t recovered;         // How many times the lock was taken over from a process that died holding it
+    uint32_t suspect;           // Set when that happens, as the heap may be half way through a call, until pmalloc_shared_recover
+    uint64_t base;              // Where the segment was mapped when it was created, the only place a heap without PMALLOC_RELATIVE works
+    pthread_mutex_t lock;       // Process shared, and robust where that's supported
+    pmalloc_t heap;
+} pmalloc_shared_t;
+
+pmalloc_shared_t *pmalloc_shared_create(int fd, uint32_t size);         // Size the shm_open, memfd_create or plain file fd to size bytes and lay out a new heap in it, NULL on failure
+pmalloc_shared_t *pmalloc_shared_attach(int fd);                        // Map the heap another process created in fd, NULL if it can't be used
+void pmalloc_shared_detach(pmalloc_shared_t *sh);                       // Unmap a heap from this process, leaving it to the others
+
+void *pmalloc_shared_malloc(pmalloc_shared_t *sh, uint32_t size);                   // Allocate size bytes of memory, returns NULL if out of memory
+void *pmalloc_shared_calloc(pmalloc_shared_t *sh, uint32_t num, uint32_t size);     // Allocate num blocks each of size bytes, clear the memory first
+void *pmalloc_shared_realloc(pmalloc_shared_t *sh, void *ptr, uint32_t size);       // Reallocate the existing block ptr to a new size and return the new block
+void pmalloc_shared_free(pmalloc_shared_t *sh, void *ptr);                          // Deallocate a block, from any process
+uint32_t pmalloc_shared_freemem(pmalloc_shared_t *sh);                              // Return the amount of free memory
+
+pmalloc_t *pmalloc_shared_lock(pmalloc_shared_t *sh);                   // Take the heap's lock, for a series of calls on the pmalloc_t it returns. NULL, without the lock, if the heap is suspect.
+void pmalloc_shared_unlock(pmalloc_shared_t *sh);                       // Release the lock from pmalloc_shared_lock
+void pmalloc_shared_recover(pmalloc_shared_t *sh);                      // Trust a suspect heap again, once the caller knows the dead process left it whole
+
+void pmalloc_shared_set_root(pmalloc_shared_t *sh, void *ptr);          // Remember a block as the way into the data in the heap, for other processes to find
+void *pmalloc_shared_root(pmalloc_shared_t *sh);                        // The block last passed to pmalloc_shared_set_root, or NULL
+
+uint32_t pmalloc_shared_offset(pmalloc_shared_t *sh, void *ptr);        // The offset of a pointer into the heap, 0 for NULL, the same in every process
+void *pmalloc_shared_pointer(pmalloc_shared_t *sh, uint32_t offset);    // The pointer for an offset from pmalloc_shared_offset, in this process
+
+#endif
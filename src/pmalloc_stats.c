@@ -0,0 +1,62 @@
+//
+// pmalloc_stats - Snapshots of the counters a pmalloc_t keeps when built with PMALLOC_STATS
+//
+// The counters themselves are kept by pmalloc.c as it goes, a handful of increments on each call.
+// A snapshot adds the state of the heap: its memory, its blocks and how fragmented its free memory is.
+//
+
+#include "pmalloc_stats.h"
+
+void pmalloc_stats_get(pmalloc_t *pm, pmalloc_stats_t *stats)
+{
+	pmalloc_counters_t *counters = &pm->counters;
+
+	stats->allocs = counters->allocs;
+	stats->frees = counters->frees;
+	stats->reallocs = counters->reallocs;
+	stats->failed = counters->failed;
+	stats->inplace = counters->inplace;
+	stats->expanded = counters->expanded;
+	stats->relocated = counters->relocated;
+	stats->remapped = counters->remapped;
+	stats->merges = counters->merges;
+	stats->searches = counters->searches;
+	stats->avgsearch = counters->searches == 0 ? 0.0 : (double)counters->steps / counters->searches;
+	stats->maxsearch = counters->maxsteps;
+	for(uint32_t i = 0; i < PMALLOC_FL_COUNT; i++) stats->classes[i] = counters->classes[i];
+
+	stats->totalmem = pmalloc_totalmem(pm);
+	stats->freemem = pmalloc_freemem(pm);
+	stats->usedmem = pmalloc_usedmem(pm);
+	stats->overheadmem = pmalloc_overheadmem(pm);
+	stats->totalnodes = pm->totalnodes;
+	stats->quickmem = pm->quickmem;
+	stats->largestfree = pmalloc_largestfree(pm);
+	stats->fragmentation = stats->freemem == 0 ? 0.0 : 1.0 - (double)stats->largestfree / stats->freemem;
+	stats->mapped = pm->nmapped;
+	stats->mappedmem = pmalloc_mappedmem(pm);
+}
+
+void pmalloc_stats_reset(pmalloc_t *pm)
+{
+	pm->counters = (pmalloc_counters_t){ 0 };
+}
+
+void pmalloc_stats_json(const pmalloc_stats_t *stats, FILE *out)
+{
+	fprintf(out, "{\"allocs\":%llu,\"frees\":%llu,\"reallocs\":%llu,\"failed\":%llu,",
+		(unsigned long long)stats->allocs, (unsigned long long)stats->frees, (unsigned long long)stats->reallocs, (unsigned long long)stats->failed);
+	fprintf(out, "\"realloc_inplace\":%llu,\"realloc_expanded\":%llu,\"realloc_relocated\":%llu,\"realloc_remapped\":%llu,\"merges\":%llu,",
+		(unsigned long long)stats->inplace, (unsigned long long)stats->expanded, (unsigned long long)stats->relocated, (unsigned long long)stats->remapped, (unsigned long long)stats->merges);
+	fprintf(out, "\"searches\":%llu,\"search_avg\":%.3f,\"search_max\":%llu,",
+		(unsigned long long)stats->searches, stats->avgsearch, (unsigned long long)stats->maxsearch);
+
+	fprintf(out, "\"classes\":[");
+	for(uint32_t i = 0; i < PMALLOC_FL_COUNT; i++) fprintf(out, i == 0 ? "%llu" : ",%llu", (unsigned long long)stats->classes[i]);
+	fprintf(out, "],");
+
+	fprintf(out, "\"totalmem\":%u,\"freemem\":%u,\"usedmem\":%u,\"overheadmem\":%u,\"totalnodes\":%u,\"quickmem\":%u,",
+		stats->totalmem, stats->freemem, stats->usedmem, stats->overheadmem, stats->totalnodes, stats->quickmem);
+	fprintf(out, "\"largestfree\":%u,\"fragmentation\":%.4f,\"mapped\":%u,\"mappedmem\":%llu}\n",
+		stats->largestfree, stats->fragmentation, stats->mapped, (unsigned long long)stats->mappedmem);
+}
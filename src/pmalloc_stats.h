@@ -0,0 +1,40 @@
+#ifndef PMALLOC_STATS_H
+#define PMALLOC_STATS_H
+
+#include <stdio.h>
+
+#include "pmalloc.h"
+
+// A snapshot of a pmalloc_t's counters and the state of its heap
+typedef struct pmalloc_stats {
+    uint64_t allocs;            // Successful malloc, calloc and memalign calls, and blocks from malloc_batch
+    uint64_t frees;             // Blocks freed
+    uint64_t reallocs;          // realloc calls
+    uint64_t failed;            // Allocations and reallocs that returned NULL
+    uint64_t inplace;           // reallocs that kept their block
+    uint64_t expanded;          // reallocs that grew into the free block before theirs
+    uint64_t relocated;         // reallocs that moved to a new block
+    uint64_t remapped;          // reallocs of blocks with a mapping of their own that kept it
+    uint64_t merges;            // Free blocks merged with a physical neighbour
+    uint64_t searches;          // Searches for a free block
+    double avgsearch;           // The mean number of blocks and bitmaps looked at per search
+    uint64_t maxsearch;         // The most looked at by one search
+    uint64_t classes[PMALLOC_FL_COUNT];     // Successful allocations by the power of two below the size asked for
+
+    uint32_t totalmem;          // pmalloc_totalmem
+    uint32_t freemem;           // pmalloc_freemem, including quickmem
+    uint32_t usedmem;           // pmalloc_usedmem
+    uint32_t overheadmem;       // pmalloc_overheadmem
+    uint32_t totalnodes;        // The number of blocks, allocated and free
+    uint32_t quickmem;          // Free memory waiting on the quick lists
+    uint32_t largestfree;       // pmalloc_largestfree
+    double fragmentation;       // External fragmentation: the share of free memory outside the largest free block
+    uint32_t mapped;            // The number of blocks with a mapping of their own
+    uint64_t mappedmem;         // pmalloc_mappedmem
+} pmalloc_stats_t;
+
+void pmalloc_stats_get(pmalloc_t *pm, pmalloc_stats_t *stats);         // Take a snapshot of pm's counters and heap
+void pmalloc_stats_reset(pmalloc_t *pm);                                // Zero pm's counters
+void pmalloc_stats_json(const pmalloc_stats_t *stats, FILE *out);      // Write a snapshot to out as a JSON object
+
+#endif
@@ -1,9 +1,34 @@
 #include <gtest/gtest.h>
 #include <stdlib.h>
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include <atomic>
+#include <list>
+#include <map>
+#include <thread>
+#include <vector>
 
 extern "C" {
   #include "pmalloc.h"
+  #include "pmalloc_mt.h"
+  #include "pmalloc_sharded.h"
+  #include "pmalloc_shared.h"
+  #include "pmalloc_pool.h"
+  #include "pmalloc_arena.h"
+  #include "pmalloc_provider.h"
+  #include "pmalloc_file.h"
+  #ifdef PMALLOC_TRACE
+    #include "pmalloc_trace.h"
+  #endif
+  #ifdef PMALLOC_STATS
+    #include "pmalloc_stats.h"
+  #endif
 }
+#include "pmalloc.hpp"
 
 // Instantiate, check 
 TEST(PMAllocTest, AllocSizeFree) {
@@ -55,8 +80,9 @@ TEST(PMAllocTest, FragmentationTest) {
 
   pmalloc_init(pm);
 
+  // Room for the blocks below once their sizes and headers are rounded to PMALLOC_ALIGN
   char buffer[65536];
-  pmalloc_addblock(pm, &buffer, 4096);
+  pmalloc_addblock(pm, &buffer, 4096 + 128);
 
   uint32_t len[8] = { 512, 512, 512, 512, 512, 512, 512, 320 };
   void* mem[8];
@@ -312,3 +338,1723 @@ TEST(PMAllocTest, ReallocTestEndOfMemNoFreeSpace) {
 
   EXPECT_EQ(mem[1], (void*)NULL) << "pmalloc_realloc should return NULL on not enougb space";
 }
+
+// A block with no room after it should grow down into the free block before it, and across both neighbours
+TEST(PMAllocTest, ReallocTestBackwardExpansion) {
+  for(uint32_t engine = 0; engine < 3; engine++) {
+    pmalloc_t pmblock;
+    pmalloc_t *pm = &pmblock;
+
+    pmalloc_init(pm);
+    pmalloc_set_engine(pm, (pmalloc_engine_t)engine);
+
+    static char buffer[16384];
+    pmalloc_addblock(pm, &buffer, sizeof(buffer));
+    uint32_t freemem = pmalloc_freemem(pm);
+
+    char *mem[6];
+    for(uint32_t i = 0; i<6; i++) {
+      mem[i] = (char*)pmalloc_malloc(pm, 1000);
+      ASSERT_NE(mem[i], nullptr);
+      for(uint32_t j = 0; j<1000; j++) mem[i][j] = (char)(i + j);
+    }
+
+    // Only the block before is free
+    pmalloc_free(pm, mem[0]);
+    char *grown = (char*)pmalloc_realloc(pm, mem[1], 1800);
+    EXPECT_EQ(grown, mem[0]) << "pmalloc_realloc should grow into the free block before, engine " << engine;
+    for(uint32_t j = 0; j<1000; j++) ASSERT_EQ(grown[j], (char)(1 + j)) << "The contents should move down with the block";
+    EXPECT_GE(pmalloc_sizeof(pm, grown), 1800u);
+
+    // Both neighbours are free, and needed
+    pmalloc_free(pm, mem[2]);
+    pmalloc_free(pm, mem[4]);
+    char *both = (char*)pmalloc_realloc(pm, mem[3], 2900);
+    EXPECT_TRUE(both > grown + 1800 && both <= mem[2]) << "pmalloc_realloc should grow across both neighbours, engine " << engine;
+    for(uint32_t j = 0; j<1000; j++) ASSERT_EQ(both[j], (char)(3 + j)) << "The contents should move down with the block";
+
+    #ifdef DEBUG
+      printf("ReallocTestBackwardExpansion: Engine %u after expanding:\n", engine);
+      pmalloc_dump_stats(pm);
+    #endif
+
+    #ifdef PMALLOC_STATS
+      pmalloc_stats_t stats;
+      pmalloc_stats_get(pm, &stats);
+      EXPECT_EQ(stats.expanded, 2u) << "Growing down should be counted apart from moving";
+      EXPECT_EQ(stats.relocated, 0u);
+    #endif
+
+    pmalloc_free(pm, grown);
+    pmalloc_free(pm, both);
+    pmalloc_free(pm, mem[5]);
+    EXPECT_EQ(pmalloc_freemem(pm), freemem) << "Everything should merge back together, engine " << engine;
+    EXPECT_EQ(pmalloc_largestfree(pm), freemem);
+  }
+}
+
+// Small holes should be reused by small requests without disturbing larger free blocks
+TEST(PMAllocTest, SizeClassReuseTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  void* mem[64];
+
+  // Allocate small blocks, then free every other one to leave small holes
+  for(uint32_t i = 0; i<64; i++) EXPECT_NE(mem[i] = pmalloc_malloc(pm, 64), (void*)NULL) << "pmalloc_malloc should pass";
+  for(uint32_t i = 0; i<64; i+=2) pmalloc_free(pm, mem[i]);
+
+  // A large request can't fit in the holes, so comes from the remainder
+  void *large = pmalloc_malloc(pm, 8192);
+  EXPECT_GT((char*)large, (char*)mem[63]) << "pmalloc_malloc should allocate a large block after the small holes";
+
+  // A small request should land in one of the holes
+  void *small = pmalloc_malloc(pm, 48);
+  EXPECT_LT((char*)small, (char*)mem[63]) << "pmalloc_malloc should reuse a small hole";
+
+  pmalloc_free(pm, small);
+  pmalloc_free(pm, large);
+  for(uint32_t i = 1; i<64; i+=2) pmalloc_free(pm, mem[i]);
+
+  #ifdef DEBUG
+    printf("SizeClassReuseTest: Freed:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  // Everything should have merged back into one block
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once everything is freed";
+  EXPECT_NE(pmalloc_malloc(pm, pmalloc_totalmem(pm)), (void*)NULL) << "pmalloc_malloc should allocate the whole merged block";
+}
+
+// Freeing in any order should coalesce physical neighbours, but never across addblock regions
+TEST(PMAllocTest, BoundaryTagCoalesceTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  // Two regions that happen to be adjacent in memory
+  alignas(max_align_t) char buffer[8192];
+  pmalloc_addblock(pm, &buffer[0], 4096);
+  pmalloc_addblock(pm, &buffer[4096], 4096);
+
+  void* mem[4];
+  for(uint32_t i = 0; i<4; i++) EXPECT_NE(mem[i] = pmalloc_malloc(pm, 512), (void*)NULL) << "pmalloc_malloc should pass";
+
+  // Free the middle blocks first, then their neighbours
+  pmalloc_free(pm, mem[1]);
+  pmalloc_free(pm, mem[2]);
+  pmalloc_free(pm, mem[0]);
+  pmalloc_free(pm, mem[3]);
+
+  #ifdef DEBUG
+    printf("BoundaryTagCoalesceTest: Freed:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once everything is freed";
+  EXPECT_EQ(pmalloc_overheadmem(pm), 2 * sizeof(pmalloc_item_t)) << "Each region should have merged back into a single block";
+  EXPECT_EQ(pmalloc_malloc(pm, 6144), (void*)NULL) << "pmalloc_malloc should not merge across regions";
+  EXPECT_NE(pmalloc_malloc(pm, pmalloc_totalmem(pm) / 2), (void*)NULL) << "pmalloc_malloc should allocate a whole region";
+}
+
+// The TLSF engine should run the existing workload too
+TEST(PMAllocTest, TLSFAllocFreeTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+  pmalloc_set_engine(pm, PMALLOC_ENGINE_TLSF);
+
+  char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  uint32_t len[6] = { 150, 256, 512, 100, 1024, 65536 };
+  void* mem[6];
+
+  for(uint32_t i = 0; i<6; i++) mem[i] = pmalloc_malloc(pm, len[i]);
+
+  EXPECT_EQ(mem[5], nullptr) << "pmalloc_malloc(65536) allocated when it should not have";
+  for(uint8_t i = 0; i<5; i++) {
+    EXPECT_NE(mem[i], nullptr) << "pmalloc_malloc should pass";
+    EXPECT_EQ(pmalloc_sizeof(pm, mem[i]), len[i]) << "pmalloc_sizeof incorrectly reports size for block";
+  }
+
+  for(uint32_t i = 0; i<5; i++) pmalloc_free(pm, mem[i]);
+
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once everything is freed";
+}
+
+// The TLSF engine must find a block from the bitmaps alone, without walking a bin, however fragmented the heap
+TEST(PMAllocTest, TLSFWorstCaseBoundTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+  pmalloc_set_engine(pm, PMALLOC_ENGINE_TLSF);
+
+  static char buffer[1 << 20];
+  pmalloc_addblock(pm, &buffer, sizeof(buffer));
+
+  // Fill one size class with lots of free blocks that are all slightly too small for the request below
+  const uint32_t count = 1000;
+  void* mem[count];
+  for(uint32_t i = 0; i<count; i++) EXPECT_NE(mem[i] = pmalloc_malloc(pm, 100), (void*)NULL) << "pmalloc_malloc should pass";
+  void *big = pmalloc_malloc(pm, 200);
+  void *spacer = pmalloc_malloc(pm, 100);
+  for(uint32_t i = 0; i<count; i+=2) pmalloc_free(pm, mem[i]);
+  pmalloc_free(pm, big);
+
+  // Every search must land on the head of a bin whose blocks are all big enough
+  for(uint32_t size = 1; size < 4096; size++) {
+    pmalloc_item_t *found = pmalloc_bin_find(pm, size);
+    ASSERT_NE(found, nullptr) << "pmalloc_bin_find should find a block for " << size;
+    bool head = false;
+    for(uint32_t i = 0; i<PMALLOC_BINS; i++) head = head || PMALLOC_DEREF(pm, pmalloc_item_t, pm->bins[i]) == found;
+    EXPECT_TRUE(head) << "pmalloc_bin_find should return the head of a bin for " << size;
+    EXPECT_GE(found->size, size) << "pmalloc_bin_find returned a block that is too small for " << size;
+  }
+
+  // A request that doesn't fit the blocks in its own class skips straight past them
+  void *mem108 = pmalloc_malloc(pm, 108);
+  EXPECT_EQ(mem108, big) << "pmalloc_malloc should use the first block of the next class up";
+
+  pmalloc_free(pm, mem108);
+  pmalloc_free(pm, spacer);
+  for(uint32_t i = 1; i<count; i+=2) pmalloc_free(pm, mem[i]);
+
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once everything is freed";
+}
+
+// The best fit engine should pick the smallest hole that fits, the lowest addressed one on a tie
+TEST(PMAllocTest, BestFitTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+  pmalloc_set_engine(pm, PMALLOC_ENGINE_BESTFIT);
+
+  char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  // Holes of 1024, 300, 200, 200 bytes in address order, separated by allocated blocks
+  uint32_t len[8] = { 1024, 64, 300, 64, 200, 64, 200, 64 };
+  void* mem[8];
+  for(uint32_t i = 0; i<8; i++) EXPECT_NE(mem[i] = pmalloc_malloc(pm, len[i]), (void*)NULL) << "pmalloc_malloc should pass";
+  for(uint32_t i = 0; i<8; i+=2) pmalloc_free(pm, mem[i]);
+
+  #ifdef DEBUG
+    printf("BestFitTest: Holes:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  EXPECT_EQ(pmalloc_malloc(pm, 180), mem[4]) << "pmalloc_malloc should use the lowest addressed of the smallest sufficient holes";
+  EXPECT_EQ(pmalloc_malloc(pm, 200), mem[6]) << "pmalloc_malloc should use the exactly sized hole";
+  EXPECT_EQ(pmalloc_malloc(pm, 250), mem[2]) << "pmalloc_malloc should use the 300 byte hole rather than split the 1024 byte one";
+  EXPECT_EQ(pmalloc_malloc(pm, 512), mem[0]) << "pmalloc_malloc should use the 1024 byte hole";
+
+  for(uint32_t i = 0; i<8; i++) pmalloc_free(pm, mem[i]);
+
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once everything is freed";
+  EXPECT_EQ(pmalloc_overheadmem(pm), sizeof(pmalloc_item_t)) << "Everything should have merged back into a single block";
+}
+
+// Hammer pmalloc_mt from several threads, with blocks freed by threads other than the one that allocated them
+TEST(PMAllocTest, MultiThreadStressTest) {
+  pmalloc_mt_t mtblock;
+  pmalloc_mt_t *mt = &mtblock;
+
+  pmalloc_mt_init(mt);
+
+  static char buffer[16 * 1024 * 1024];
+  pmalloc_mt_addblock(mt, &buffer, sizeof(buffer));
+
+  const uint32_t threadCount = 8;
+  const uint32_t slotCount = 1024;
+  std::atomic<void*> shared[slotCount];
+  for(uint32_t i = 0; i<slotCount; i++) shared[i] = nullptr;
+  std::atomic<uint32_t> failures(0);
+
+  auto worker = [&](uint32_t seed) {
+    for(uint32_t op = 0; op<20000; op++) {
+      seed = seed * 1103515245 + 12345;
+      uint32_t slot = (seed >> 8) % slotCount;
+      uint32_t size = (seed >> 16) % 4 == 0 ? 600 + (seed >> 4) % 2000 : 1 + (seed >> 4) % 500;
+
+      unsigned char *mem = (unsigned char*)pmalloc_mt_malloc(mt, size);
+      if(mem == NULL) { failures++; continue; }
+
+      // Tag every byte with the size, so a block handed out twice shows up as corruption
+      for(uint32_t i = 0; i<size; i++) mem[i] = (unsigned char)size;
+      ((uint32_t*)mem)[0] = size;
+
+      // Swap it into a shared slot and free whatever was there, most likely allocated by another thread
+      unsigned char *old = (unsigned char*)shared[slot].exchange(mem);
+      if(old == NULL) continue;
+      uint32_t oldSize = ((uint32_t*)old)[0];
+      for(uint32_t i = sizeof(uint32_t); i<oldSize; i++) if(old[i] != (unsigned char)oldSize) { failures++; break; }
+      pmalloc_mt_free(mt, old);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(uint32_t i = 0; i<threadCount; i++) threads.emplace_back(worker, i + 1);
+  for(auto &thread : threads) thread.join();
+
+  EXPECT_EQ(failures.load(), 0u) << "pmalloc_mt should neither run out of memory nor hand out a block twice";
+
+  for(uint32_t i = 0; i<slotCount; i++) pmalloc_mt_free(mt, shared[i].load());
+
+  pmalloc_mt_destroy(mt);
+
+  EXPECT_EQ(pmalloc_freemem(&mt->heap), pmalloc_totalmem(&mt->heap)) << "pmalloc_mt_destroy should return every cached block to the central heap";
+}
+
+// pmalloc_mt_calloc should zero its blocks, and refuse a total that doesn't fit in 32 bits
+TEST(PMAllocTest, MultiThreadCallocTest) {
+  pmalloc_mt_t mtblock;
+  pmalloc_mt_t *mt = &mtblock;
+
+  pmalloc_mt_init(mt);
+
+  static char buffer[1024 * 1024];
+  pmalloc_mt_addblock(mt, &buffer, sizeof(buffer));
+
+  char *mem = (char*)pmalloc_mt_calloc(mt, 100, 30);
+  ASSERT_NE(mem, nullptr);
+  for(uint32_t i = 0; i<3000; i++) EXPECT_EQ(mem[i], 0);
+  pmalloc_mt_free(mt, mem);
+
+  EXPECT_EQ(pmalloc_mt_calloc(mt, 0x10000, 0x10001), nullptr) << "pmalloc_mt_calloc should fail when num * size overflows";
+
+  pmalloc_mt_destroy(mt);
+}
+
+// pmalloc_sizeof should report the size asked for, for cached blocks and ones resized in place as much as any other
+TEST(PMAllocTest, MultiThreadReallocTest) {
+  pmalloc_mt_t mtblock;
+  pmalloc_mt_t *mt = &mtblock;
+
+  pmalloc_mt_init(mt);
+
+  static char buffer[1024 * 1024];
+  pmalloc_mt_addblock(mt, &buffer, sizeof(buffer));
+
+  char *mem = (char*)pmalloc_mt_malloc(mt, 100);
+  ASSERT_NE(mem, nullptr);
+  EXPECT_EQ(pmalloc_sizeof(&mt->heap, mem), 100u) << "A cached block should record the size asked for, not its class";
+  memset(mem, 'x', 100);
+
+  EXPECT_EQ(pmalloc_mt_realloc(mt, mem, 90), mem) << "A cached block big enough should stay where it is";
+  EXPECT_EQ(pmalloc_sizeof(&mt->heap, mem), 90u) << "Resizing in place should record the new size";
+
+  char *grown = (char*)pmalloc_mt_realloc(mt, mem, 300);
+  ASSERT_NE(grown, nullptr);
+  EXPECT_EQ(pmalloc_sizeof(&mt->heap, grown), 300u);
+  for(uint32_t i = 0; i<90; i++) EXPECT_EQ(grown[i], 'x');
+
+  char *shrunk = (char*)pmalloc_mt_realloc(mt, grown, 1);
+  ASSERT_NE(shrunk, nullptr);
+  EXPECT_EQ(pmalloc_sizeof(&mt->heap, shrunk), 1u) << "A block with more left over than its slack can hold should move";
+  EXPECT_EQ(shrunk[0], 'x');
+  pmalloc_mt_free(mt, shrunk);
+
+  pmalloc_mt_destroy(mt);
+}
+
+// Hammer pmalloc_sharded from several threads, freeing across shards and stealing once a shard runs out
+TEST(PMAllocTest, ShardedStressTest) {
+  static pmalloc_sharded_t sharded;
+  pmalloc_sharded_t *sh = &sharded;
+
+  pmalloc_sharded_init(sh, 4);
+
+  static char buffer[4 * 1024 * 1024];
+  pmalloc_sharded_addblock(sh, &buffer, sizeof(buffer));
+  uint32_t freemem = pmalloc_sharded_freemem(sh);
+  EXPECT_GT(freemem, sizeof(buffer) - 4096) << "Every shard should have its slice";
+
+  // More than a shard's worth from one thread means taking from the others
+  std::vector<void*> big;
+  for(void *mem; (mem = pmalloc_sharded_malloc(sh, 64 * 1024)) != NULL; ) big.push_back(mem);
+  EXPECT_GT(big.size(), 40u) << "pmalloc_sharded_malloc should steal from other shards when its own is full";
+  for(void *mem : big) pmalloc_sharded_free(sh, mem);
+  EXPECT_EQ(pmalloc_sharded_freemem(sh), freemem) << "Every block should go back to the shard it came from";
+
+  const uint32_t threadCount = 8;
+  const uint32_t slotCount = 1024;
+  std::atomic<void*> shared[slotCount];
+  for(uint32_t i = 0; i<slotCount; i++) shared[i] = nullptr;
+  std::atomic<uint32_t> failures(0);
+
+  auto worker = [&](uint32_t seed) {
+    for(uint32_t op = 0; op<20000; op++) {
+      seed = seed * 1103515245 + 12345;
+      uint32_t slot = (seed >> 8) % slotCount;
+      uint32_t size = 4 + (seed >> 4) % 1000;
+
+      unsigned char *mem = (unsigned char*)pmalloc_sharded_malloc(sh, size);
+      if(mem == NULL) { failures++; continue; }
+      if(op % 7 == 0) {
+        mem = (unsigned char*)pmalloc_sharded_realloc(sh, mem, size * 2);
+        if(mem == NULL) { failures++; continue; }
+      }
+      for(uint32_t i = 0; i<size; i++) mem[i] = (unsigned char)size;
+      ((uint32_t*)mem)[0] = size;
+
+      unsigned char *old = (unsigned char*)shared[slot].exchange(mem);
+      if(old == NULL) continue;
+      uint32_t oldSize = ((uint32_t*)old)[0];
+      for(uint32_t i = sizeof(uint32_t); i<oldSize; i++) if(old[i] != (unsigned char)oldSize) { failures++; break; }
+      pmalloc_sharded_free(sh, old);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(uint32_t i = 0; i<threadCount; i++) threads.emplace_back(worker, i + 1);
+  for(auto &thread : threads) thread.join();
+
+  EXPECT_EQ(failures.load(), 0u) << "pmalloc_sharded should neither run out of memory nor hand out a block twice";
+
+  for(uint32_t i = 0; i<slotCount; i++) pmalloc_sharded_free(sh, shared[i].load());
+  EXPECT_EQ(pmalloc_sharded_freemem(sh), freemem) << "Everything should be free again";
+
+  pmalloc_sharded_destroy(sh);
+}
+
+// pmalloc_sharded_calloc should zero its blocks, and refuse a total that doesn't fit in 32 bits
+TEST(PMAllocTest, ShardedCallocTest) {
+  static pmalloc_sharded_t sharded;
+  pmalloc_sharded_t *sh = &sharded;
+
+  pmalloc_sharded_init(sh, 2);
+
+  static char buffer[1024 * 1024];
+  pmalloc_sharded_addblock(sh, &buffer, sizeof(buffer));
+
+  char *mem = (char*)pmalloc_sharded_calloc(sh, 100, 30);
+  ASSERT_NE(mem, nullptr);
+  for(uint32_t i = 0; i<3000; i++) EXPECT_EQ(mem[i], 0);
+  pmalloc_sharded_free(sh, mem);
+
+  EXPECT_EQ(pmalloc_sharded_calloc(sh, 0x10000, 0x10001), nullptr) << "pmalloc_sharded_calloc should fail when num * size overflows";
+
+  pmalloc_sharded_destroy(sh);
+}
+
+// pmalloc_sharded_addblock should say when it has no room left to track another block's slices
+TEST(PMAllocTest, ShardedAddblockTest) {
+  static pmalloc_sharded_t sharded;
+  pmalloc_sharded_t *sh = &sharded;
+
+  pmalloc_sharded_init(sh, 2);
+
+  const uint32_t blocks = PMALLOC_SHARDED_RANGES / 2;
+  static char buffer[PMALLOC_SHARDED_RANGES / 2 + 1][4096];
+  for(uint32_t i = 0; i<blocks; i++) EXPECT_EQ(pmalloc_sharded_addblock(sh, buffer[i], 4096), 1) << "Every block should fit in the table";
+  uint32_t freemem = pmalloc_sharded_freemem(sh);
+
+  EXPECT_EQ(pmalloc_sharded_addblock(sh, buffer[blocks], 4096), 0) << "A block with no room for its slices should be refused";
+  EXPECT_EQ(pmalloc_sharded_freemem(sh), freemem) << "A refused block shouldn't be given to any shard";
+
+  pmalloc_sharded_destroy(sh);
+}
+
+// A pool hands out each of its objects once, from a single block, and takes them back
+TEST(PMAllocTest, PoolGetPutTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  uint32_t overhead = pmalloc_overheadmem(pm);
+  pmalloc_pool_t *pool = pmalloc_pool_init(pm, 64, 100);
+  ASSERT_NE(pool, nullptr) << "pmalloc_pool_init should pass";
+  EXPECT_EQ(pmalloc_overheadmem(pm), overhead + sizeof(pmalloc_item_t)) << "A pool should take a single block from its pmalloc_t";
+
+  void* obj[100];
+  for(uint32_t i = 0; i<100; i++) {
+    ASSERT_NE(obj[i] = pmalloc_pool_get(pool), nullptr) << "pmalloc_pool_get should pass";
+    EXPECT_EQ((uintptr_t)obj[i] % PMALLOC_ALIGN, 0u) << "Pool objects should be aligned like any other block";
+    if(i > 0) {
+      EXPECT_EQ((char*)obj[i] - (char*)obj[i-1], 64) << "Pool objects should have no per-object overhead";
+    }
+  }
+  EXPECT_EQ(pmalloc_pool_get(pool), nullptr) << "pmalloc_pool_get should fail once the pool is empty";
+
+  pmalloc_pool_put(pool, obj[42]);
+  EXPECT_EQ(pmalloc_pool_get(pool), obj[42]) << "pmalloc_pool_get should reuse the last object put back";
+
+  for(uint32_t i = 0; i<100; i++) pmalloc_pool_put(pool, obj[i]);
+  pmalloc_pool_destroy(pm, pool);
+
+  // Odd sizes are rounded up to keep every object aligned
+  pool = pmalloc_pool_init(pm, 20, 10);
+  ASSERT_NE(pool, nullptr);
+  void *first = pmalloc_pool_get(pool), *second = pmalloc_pool_get(pool);
+  EXPECT_EQ((uintptr_t)first % PMALLOC_ALIGN, 0u);
+  EXPECT_EQ((uintptr_t)second % PMALLOC_ALIGN, 0u);
+  pmalloc_pool_put(pool, first);
+  pmalloc_pool_put(pool, second);
+  pmalloc_pool_destroy(pm, pool);
+
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_pool_destroy should return the pool to its pmalloc_t";
+}
+
+// Threads racing to get and put pool objects must never share one
+TEST(PMAllocTest, PoolConcurrentTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  pmalloc_pool_t *pool = pmalloc_pool_init(pm, 32, 16);
+  ASSERT_NE(pool, nullptr) << "pmalloc_pool_init should pass";
+
+  std::atomic<uint32_t> failures(0);
+
+  auto worker = [&](uint32_t id) {
+    for(uint32_t op = 0; op<100000; op++) {
+      uint32_t *obj = (uint32_t*)pmalloc_pool_get(pool);
+      if(obj == NULL) continue;
+      for(uint32_t i = 0; i<8; i++) obj[i] = id;
+      for(uint32_t i = 0; i<8; i++) if(obj[i] != id) { failures++; break; }
+      pmalloc_pool_put(pool, obj);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(uint32_t i = 0; i<8; i++) threads.emplace_back(worker, i + 1);
+  for(auto &thread : threads) thread.join();
+
+  EXPECT_EQ(failures.load(), 0u) << "A pool object was handed to two threads at once";
+
+  // Every object should be back on the free stack exactly once
+  uint32_t count = 0;
+  while(pmalloc_pool_get(pool) != NULL) count++;
+  EXPECT_EQ(count, 16u) << "The pool should still hold all of its objects";
+}
+
+// Every block should be aligned for any type, and memalign should honour larger alignments without leaking the padding
+TEST(PMAllocTest, MemalignTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  char buffer[65536];
+  pmalloc_addblock(pm, &buffer[1], 65535);
+
+  uint32_t used = pmalloc_usedmem(pm);
+
+  for(uint32_t i = 1; i<64; i+=7) {
+    void *mem = pmalloc_malloc(pm, i);
+    EXPECT_EQ((uintptr_t)mem % alignof(max_align_t), 0u) << "pmalloc_malloc should return max_align_t aligned memory";
+    EXPECT_EQ(pmalloc_sizeof(pm, mem), i) << "pmalloc_sizeof should return the requested size";
+  }
+
+  void *mem[4];
+  uint32_t align[4] = { 64, 256, 4096, 32 };
+  for(uint32_t i = 0; i<4; i++) {
+    ASSERT_NE(mem[i] = pmalloc_memalign(pm, align[i], 100 + i), (void*)NULL) << "pmalloc_memalign should pass";
+    EXPECT_EQ((uintptr_t)mem[i] % align[i], 0u) << "pmalloc_memalign should return memory aligned to " << align[i];
+    EXPECT_EQ(pmalloc_sizeof(pm, mem[i]), 100 + i) << "pmalloc_sizeof should return the requested size";
+  }
+
+  EXPECT_EQ(pmalloc_aligned_alloc(pm, 48, 16), (void*)NULL) << "pmalloc_aligned_alloc should reject an alignment that isn't a power of two";
+
+  #ifdef DEBUG
+    printf("MemalignTest: Allocated:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  for(uint32_t i = 0; i<4; i++) pmalloc_free(pm, mem[i]);
+
+  // The padding in front of each aligned block went back to the free lists, and merges away again
+  EXPECT_LT(pmalloc_usedmem(pm) - used, 16u * 64) << "pmalloc_memalign should not keep the padding";
+  void *big = pmalloc_malloc(pm, 60000);
+  EXPECT_NE(big, (void*)NULL) << "The padding should have merged back with its neighbours";
+}
+
+// A small allocation should cost only its header and alignment, and pmalloc_overheadmem should count the headers
+TEST(PMAllocTest, SmallObjectOverheadTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  #ifdef PMALLOC_COMPACT
+    EXPECT_EQ(sizeof(pmalloc_item_t), 8u) << "The compact header should be 8 bytes";
+  #endif
+
+  const uint32_t count = 1000;
+  for(uint32_t i = 0; i<count; i++) ASSERT_NE(pmalloc_malloc(pm, 16), (void*)NULL) << "pmalloc_malloc should pass";
+
+  #ifdef DEBUG
+    printf("SmallObjectOverheadTest: Allocated:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  // The header of the original block isn't counted in pmalloc_totalmem, so this is just the blocks handed out
+  uint32_t footprint = pmalloc_usedmem(pm) / count;
+  uint32_t expected = (16 + sizeof(pmalloc_item_t) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+  EXPECT_EQ(footprint, expected) << "A 16 byte block should cost its header, rounded to the alignment";
+  EXPECT_EQ(pmalloc_overheadmem(pm), (count + 1) * sizeof(pmalloc_item_t)) << "pmalloc_overheadmem should count every header";
+}
+
+// pmalloc_largestfree should track the biggest hole, whatever the engine
+TEST(PMAllocTest, LargestFreeTest) {
+  for(int engine = PMALLOC_ENGINE_SEGREGATED; engine <= PMALLOC_ENGINE_BESTFIT; engine++) {
+    pmalloc_t pmblock;
+    pmalloc_t *pm = &pmblock;
+
+    pmalloc_init(pm);
+    pmalloc_set_engine(pm, (pmalloc_engine_t)engine);
+
+    char buffer[16384];
+    pmalloc_addblock(pm, &buffer, 16384);
+
+    EXPECT_EQ(pmalloc_largestfree(pm), pmalloc_freemem(pm)) << "A fresh heap should be one free block";
+
+    // Holes of 512, 2048 and 1024 bytes between allocated blocks, and the rest of the heap after them
+    void *hole[3], *mem[3];
+    uint32_t len[3] = { 512, 2048, 1024 };
+    for(uint32_t i = 0; i<3; i++) {
+      hole[i] = pmalloc_malloc(pm, len[i]);
+      mem[i] = pmalloc_malloc(pm, 64);
+    }
+    std::vector<void*> rest;
+    for(void *ptr; (ptr = pmalloc_malloc(pm, 64)) != NULL; ) rest.push_back(ptr);
+    for(uint32_t i = 0; i<3; i++) pmalloc_free(pm, hole[i]);
+
+    EXPECT_GE(pmalloc_largestfree(pm), 2048u) << "The 2048 byte hole should be the largest, engine " << engine;
+    EXPECT_LT(pmalloc_largestfree(pm), 2048u + 64) << "The 2048 byte hole should be the largest, engine " << engine;
+
+    for(uint32_t i = 0; i<3; i++) pmalloc_free(pm, mem[i]);
+    for(void *ptr : rest) pmalloc_free(pm, ptr);
+    EXPECT_EQ(pmalloc_largestfree(pm), pmalloc_freemem(pm)) << "Everything should merge back into one block";
+  }
+}
+
+#ifdef PMALLOC_TRACE
+// Every call should be recorded once, with what it was asked for and what it returned
+TEST(PMAllocTest, TraceRecordTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  FILE *out = tmpfile();
+  ASSERT_NE(out, nullptr);
+
+  static pmalloc_trace_t trace;
+  pmalloc_trace_start(pm, &trace, out);
+
+  // Enough calls to fill the ring a few times
+  const uint32_t count = PMALLOC_TRACE_RING * 3;
+  void *mem = NULL;
+  for(uint32_t i = 0; i<count; i++) {
+    mem = pmalloc_malloc(pm, 100);
+    pmalloc_free(pm, mem);
+  }
+  void *a = pmalloc_calloc(pm, 4, 8);
+  void *b = pmalloc_realloc(pm, a, 5000);
+  void *c = pmalloc_memalign(pm, 256, 10);
+  pmalloc_free(pm, b);
+  pmalloc_free(pm, c);
+  pmalloc_free(pm, NULL);
+  EXPECT_EQ(pmalloc_calloc(pm, 65536, 65537), nullptr) << "A calloc whose total overflows should fail";
+  pmalloc_handle_t *h = pmalloc_halloc(pm, 300);
+  ASSERT_NE(h, nullptr);
+  pmalloc_compact(pm, 1000);
+  pmalloc_hfree(pm, h);
+
+  pmalloc_trace_stop(pm);
+  EXPECT_EQ(trace.total, count * 2 + 9) << "Each call should be recorded once, and internal calls not at all";
+
+  // Read it back
+  rewind(out);
+  pmalloc_trace_header_t header;
+  ASSERT_EQ(fread(&header, sizeof(header), 1, out), 1u);
+  EXPECT_EQ(header.magic, (uint32_t)PMALLOC_TRACE_MAGIC);
+  EXPECT_EQ(header.version, PMALLOC_TRACE_VERSION);
+  EXPECT_EQ(header.totalmem, pmalloc_totalmem(pm));
+
+  std::vector<pmalloc_trace_record_t> records(count * 2 + 9);
+  ASSERT_EQ(fread(records.data(), sizeof(pmalloc_trace_record_t), records.size(), out), records.size()) << "Every record should have been written";
+  fclose(out);
+
+  EXPECT_EQ(records[0].op, PMALLOC_TRACE_MALLOC);
+  EXPECT_EQ(records[0].size, 100u);
+  EXPECT_EQ(records[1].op, PMALLOC_TRACE_FREE);
+  EXPECT_EQ(records[1].ptr, records[0].result) << "A free should record the block it was given";
+
+  pmalloc_trace_record_t *tail = &records[count * 2];
+  EXPECT_EQ(tail[0].op, PMALLOC_TRACE_CALLOC);
+  EXPECT_EQ(tail[0].size, 32u);
+  EXPECT_EQ(tail[0].result, (uint64_t)(uintptr_t)a);
+  EXPECT_EQ(tail[1].op, PMALLOC_TRACE_REALLOC);
+  EXPECT_EQ(tail[1].ptr, (uint64_t)(uintptr_t)a);
+  EXPECT_EQ(tail[1].result, (uint64_t)(uintptr_t)b);
+  EXPECT_EQ(tail[2].op, PMALLOC_TRACE_MEMALIGN);
+  EXPECT_EQ(1u << tail[2].alignlog2, 256u);
+  EXPECT_EQ(tail[3].op, PMALLOC_TRACE_FREE);
+  EXPECT_EQ(tail[4].op, PMALLOC_TRACE_FREE);
+  EXPECT_EQ(tail[4].ptr, (uint64_t)(uintptr_t)c);
+  EXPECT_EQ(tail[5].op, PMALLOC_TRACE_CALLOC);
+  EXPECT_EQ(tail[5].size, UINT32_MAX) << "An overflowing calloc should be recorded as UINT32_MAX, not the wrapped total";
+  EXPECT_EQ(tail[5].result, 0u);
+  EXPECT_EQ(tail[6].op, PMALLOC_TRACE_HALLOC);
+  EXPECT_EQ(tail[6].size, 300u);
+  EXPECT_EQ(tail[6].result, (uint64_t)(uintptr_t)h);
+  EXPECT_EQ(tail[7].op, PMALLOC_TRACE_COMPACT);
+  EXPECT_EQ(tail[7].size, 1000u);
+  EXPECT_EQ(tail[8].op, PMALLOC_TRACE_HFREE);
+  EXPECT_EQ(tail[8].ptr, (uint64_t)(uintptr_t)h);
+}
+#endif
+
+// calloc should clear recycled memory, and realloc should copy every byte, at any length
+TEST(PMAllocTest, CallocReallocKernelTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[1 << 20];
+  pmalloc_addblock(pm, &buffer, sizeof(buffer));
+
+  // Dirty the heap, then calloc over it
+  void *dirty = pmalloc_malloc(pm, 500000);
+  memset(dirty, 0xAA, 500000);
+  pmalloc_free(pm, dirty);
+
+  for(uint32_t len : { 1u, 7u, 63u, 64u, 100u, 511u, 4099u, 300000u }) {
+    unsigned char *mem = (unsigned char*)pmalloc_calloc(pm, 1, len);
+    ASSERT_NE(mem, nullptr) << "pmalloc_calloc should pass for " << len;
+    uint32_t nonzero = 0;
+    for(uint32_t i = 0; i<len; i++) nonzero += mem[i] != 0;
+    EXPECT_EQ(nonzero, 0u) << "pmalloc_calloc should clear all " << len << " bytes";
+
+    // Grow it past anything that can be done in place, and check every byte moved
+    for(uint32_t i = 0; i<len; i++) mem[i] = (unsigned char)(i * 7 + 1);
+    void *blocker = pmalloc_malloc(pm, 16);
+    unsigned char *moved = (unsigned char*)pmalloc_realloc(pm, mem, len + 64);
+    ASSERT_NE(moved, nullptr) << "pmalloc_realloc should pass for " << len;
+    uint32_t wrong = 0;
+    for(uint32_t i = 0; i<len; i++) wrong += moved[i] != (unsigned char)(i * 7 + 1);
+    EXPECT_EQ(wrong, 0u) << "pmalloc_realloc should copy all " << len << " bytes";
+
+    pmalloc_free(pm, moved);
+    pmalloc_free(pm, blocker);
+  }
+
+  EXPECT_EQ(pmalloc_calloc(pm, 0x10000, 0x10000), (void*)NULL) << "pmalloc_calloc should fail if num * size overflows";
+}
+
+// Memory added with pmalloc_addblock_zeroed is trusted to be zero, until it has been used
+TEST(PMAllocTest, KnownZeroTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[65536];
+  memset(buffer, 0, sizeof(buffer));
+
+  // Markers calloc would overwrite if it zeroed the blocks, where no bookkeeping lives
+  buffer[1000] = 0x55;
+  buffer[20000] = 0x55;
+  pmalloc_addblock_zeroed(pm, &buffer, sizeof(buffer));
+
+  char *mem = (char*)pmalloc_calloc(pm, 1, 4000);
+  ASSERT_NE(mem, nullptr) << "pmalloc_calloc should pass";
+  EXPECT_EQ(buffer[1000], 0x55) << "pmalloc_calloc should not zero memory known to be zero";
+  for(uint32_t i = 0; i<64; i++) EXPECT_EQ(mem[i], 0) << "pmalloc_calloc should clear the bin links at " << i;
+
+  // The rest of the region, split off the first block, is still known to be zero
+  char *rest = (char*)pmalloc_calloc(pm, 1, 50000);
+  ASSERT_NE(rest, nullptr) << "pmalloc_calloc should pass";
+  EXPECT_EQ(buffer[20000], 0x55) << "pmalloc_calloc should not zero memory known to be zero";
+
+  // Once freed the block holds user data, so it must be cleared next time
+  memset(mem, 0xAA, 4000);
+  pmalloc_free(pm, mem);
+  mem = (char*)pmalloc_calloc(pm, 1, 4000);
+  ASSERT_NE(mem, nullptr) << "pmalloc_calloc should pass";
+  uint32_t nonzero = 0;
+  for(uint32_t i = 0; i<4000; i++) nonzero += mem[i] != 0;
+  EXPECT_EQ(nonzero, 0u) << "pmalloc_calloc should clear memory that has been used";
+}
+
+// Arena allocations should be aligned and distinct, and freed together by reset, rollback and destroy
+TEST(PMAllocTest, ArenaTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  uint32_t used = pmalloc_usedmem(pm);
+
+  pmalloc_arena_t *arena = pmalloc_arena_init(pm, 1024);
+  ASSERT_NE(arena, nullptr) << "pmalloc_arena_init should pass";
+  uint32_t base = pmalloc_usedmem(pm);
+
+  // Enough to need several chunks, including one bigger than a chunk
+  std::vector<char*> mem;
+  for(uint32_t i = 0; i<100; i++) {
+    char *ptr = (char*)pmalloc_arena_alloc(arena, i % 10 == 9 ? 2000 : 1 + i);
+    ASSERT_NE(ptr, nullptr) << "pmalloc_arena_alloc should pass";
+    EXPECT_EQ((uintptr_t)ptr % alignof(max_align_t), 0u) << "pmalloc_arena_alloc should return aligned memory";
+    memset(ptr, (int)i, 1 + i);
+    mem.push_back(ptr);
+  }
+  for(uint32_t i = 0; i<100; i++) EXPECT_EQ(mem[i][i], (char)i) << "Arena allocations should not overlap";
+
+  #ifdef DEBUG
+    printf("ArenaTest: Allocated:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  pmalloc_arena_reset(arena);
+  EXPECT_EQ(pmalloc_usedmem(pm), base) << "pmalloc_arena_reset should return every chunk but the first";
+  EXPECT_EQ(pmalloc_arena_alloc(arena, 16), mem[0]) << "pmalloc_arena_reset should start again at the beginning of the first chunk";
+
+  // Nested scopes
+  pmalloc_arena_mark_t outer = pmalloc_arena_save(arena);
+  void *a = pmalloc_arena_alloc(arena, 600);
+  pmalloc_arena_mark_t inner = pmalloc_arena_save(arena);
+  for(uint32_t i = 0; i<10; i++) ASSERT_NE(pmalloc_arena_alloc(arena, 600), nullptr) << "pmalloc_arena_alloc should pass";
+  pmalloc_arena_rollback(arena, inner);
+  EXPECT_NE(pmalloc_arena_alloc(arena, 16), a) << "pmalloc_arena_rollback should keep what was allocated before the mark";
+  pmalloc_arena_rollback(arena, outer);
+  EXPECT_EQ(pmalloc_arena_alloc(arena, 600), a) << "pmalloc_arena_rollback should free everything since the mark";
+  EXPECT_EQ(pmalloc_usedmem(pm), base) << "pmalloc_arena_rollback should return the chunks started since the mark";
+
+  pmalloc_arena_destroy(arena);
+  EXPECT_EQ(pmalloc_usedmem(pm), used) << "pmalloc_arena_destroy should return everything to pm";
+}
+
+// A batch should come from one free block when there is one, and a batch free should coalesce it all again
+TEST(PMAllocTest, BatchTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  const uint32_t count = 100;
+  void *mem[count];
+  ASSERT_EQ(pmalloc_malloc_batch(pm, 40, count, mem), count) << "pmalloc_malloc_batch should allocate them all";
+
+  // Consecutive blocks, one after the other
+  uintptr_t stride = (uintptr_t)mem[1] - (uintptr_t)mem[0];
+  for(uint32_t i = 0; i<count; i++) {
+    EXPECT_EQ(pmalloc_sizeof(pm, mem[i]), 40u) << "pmalloc_sizeof should return the requested size";
+    if(i > 0) {
+      EXPECT_EQ((uintptr_t)mem[i] - (uintptr_t)mem[i - 1], stride) << "The batch should be carved from one block";
+    }
+    memset(mem[i], (int)i, 40);
+  }
+  EXPECT_EQ(pmalloc_overheadmem(pm), (count + 1) * sizeof(pmalloc_item_t)) << "Only the remainder should be left free";
+
+  #ifdef DEBUG
+    printf("BatchTest: Allocated:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  // Free every other one singly so the rest are separated by holes, then the rest in a shuffled batch
+  void *rest[count / 2];
+  for(uint32_t i = 0; i<count; i++) {
+    if(i % 2) pmalloc_free(pm, mem[i]);
+    else rest[(i / 2 * 37) % (count / 2)] = mem[i];
+  }
+  pmalloc_free_batch(pm, rest, count / 2);
+
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once everything is freed";
+  EXPECT_EQ(pmalloc_overheadmem(pm), sizeof(pmalloc_item_t)) << "pmalloc_free_batch should coalesce everything into one block";
+
+  // With no block big enough for the whole batch, it's allocated as far as it can be
+  void *big[2000];
+  uint32_t got = pmalloc_malloc_batch(pm, 1000, 2000, big);
+  EXPECT_GT(got, 0u) << "pmalloc_malloc_batch should allocate what it can";
+  EXPECT_LT(got, 2000u) << "pmalloc_malloc_batch can't allocate more than fits";
+  pmalloc_free_batch(pm, big, got);
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once everything is freed";
+}
+
+// Small frees should wait on their quick list for reuse, until consolidation or the quick memory limit merges them back
+TEST(PMAllocTest, QuickListTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+  pmalloc_set_quick(pm, 256, 0);
+
+  static char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  // A freed block is reused as it is for the next request of its size, without coalescing
+  void *mem1 = pmalloc_malloc(pm, 40);
+  void *mem2 = pmalloc_malloc(pm, 40);
+  uint32_t nodes = pmalloc_overheadmem(pm);
+  uint32_t freemem = pmalloc_freemem(pm);
+  pmalloc_free(pm, mem1);
+  EXPECT_EQ(pmalloc_overheadmem(pm), nodes) << "A block freed to its quick list shouldn't be merged";
+  EXPECT_GE(pmalloc_freemem(pm) - freemem, 40u) << "It should count as free memory";
+  void *mem3 = pmalloc_malloc(pm, 36);
+  EXPECT_EQ(mem3, mem1) << "pmalloc_malloc should reuse the block from its quick list";
+  EXPECT_EQ(pmalloc_sizeof(pm, mem3), 36u) << "pmalloc_sizeof should return the requested size";
+
+  // pmalloc_consolidate merges everything back
+  pmalloc_free(pm, mem2);
+  pmalloc_free(pm, mem3);
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm) - (nodes / sizeof(pmalloc_item_t) - 1) * sizeof(pmalloc_item_t)) << "Only the headers should still be in use";
+
+  #ifdef DEBUG
+    printf("QuickListTest: Before consolidate:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  pmalloc_consolidate(pm);
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm)) << "pmalloc_freemem should equal pmalloc_totalmem once consolidated";
+  EXPECT_EQ(pmalloc_overheadmem(pm), sizeof(pmalloc_item_t)) << "pmalloc_consolidate should coalesce everything into one block";
+
+  // Fill the heap with small blocks and free them all: a big request still succeeds, by consolidating
+  void *mem[2048];
+  uint32_t count = 0;
+  while(count < 2048 && (mem[count] = pmalloc_malloc(pm, 100)) != NULL) count++;
+  for(uint32_t i = 0; i<count; i++) pmalloc_free(pm, mem[i]);
+  EXPECT_GT(pmalloc_overheadmem(pm), sizeof(pmalloc_item_t)) << "The small blocks should be waiting on their quick list";
+  void *big = pmalloc_malloc(pm, 32768);
+  EXPECT_NE(big, nullptr) << "pmalloc_malloc should consolidate when nothing is big enough";
+  pmalloc_free(pm, big);
+  EXPECT_EQ(pmalloc_overheadmem(pm), sizeof(pmalloc_item_t)) << "Big blocks should be coalesced straight away";
+
+  // With a limit, the quick lists are consolidated once they hold more than it
+  pmalloc_set_quick(pm, 256, 1024);
+  for(uint32_t i = 0; i<20; i++) mem[i] = pmalloc_malloc(pm, 100);
+  for(uint32_t i = 0; i<20; i++) pmalloc_free(pm, mem[i]);
+  EXPECT_LE(pm->quickmem, 1024u) << "No more than the limit should be left on the quick lists";
+  pmalloc_consolidate(pm);
+  EXPECT_EQ(pmalloc_overheadmem(pm), sizeof(pmalloc_item_t)) << "pmalloc_consolidate should coalesce everything into one block";
+}
+
+#ifdef PMALLOC_STATS
+// The counters should follow every call, and the snapshot the state of the heap
+TEST(PMAllocTest, StatsTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  void *a = pmalloc_malloc(pm, 100);
+  void *b = pmalloc_calloc(pm, 4, 1000);
+  void *c = pmalloc_memalign(pm, 256, 10);
+  void *d = pmalloc_malloc(pm, 100000);
+  EXPECT_EQ(d, nullptr);
+
+  void *a2 = pmalloc_realloc(pm, a, 50);
+  EXPECT_EQ(a2, a) << "Shrinking should happen in place";
+  void *b2 = pmalloc_realloc(pm, b, 20000);
+  EXPECT_NE(b2, b) << "Growing past c should move the block";
+
+  pmalloc_stats_t stats;
+  pmalloc_stats_get(pm, &stats);
+
+  #ifdef DEBUG
+    pmalloc_stats_json(&stats, stdout);
+    pmalloc_dump_stats(pm);
+  #endif
+
+  EXPECT_EQ(stats.allocs, 3u);
+  EXPECT_EQ(stats.failed, 1u) << "The 100000 byte allocation should have failed";
+  EXPECT_EQ(stats.reallocs, 2u);
+  EXPECT_EQ(stats.inplace, 1u);
+  EXPECT_EQ(stats.relocated, 1u);
+  EXPECT_EQ(stats.classes[6], 1u) << "100 bytes is in the 64 byte class";
+  EXPECT_EQ(stats.classes[11], 1u) << "4000 bytes is in the 2048 byte class";
+  EXPECT_EQ(stats.classes[3], 1u) << "10 bytes is in the 8 byte class";
+  EXPECT_GE(stats.searches, 4u) << "Every allocation should search for a block";
+  EXPECT_GE(stats.avgsearch, 1.0);
+  EXPECT_GE(stats.maxsearch, 1u);
+  EXPECT_EQ(stats.freemem, pmalloc_freemem(pm));
+  EXPECT_EQ(stats.largestfree, pmalloc_largestfree(pm));
+  EXPECT_GT(stats.fragmentation, 0.0) << "The hole left by b should be free memory outside the largest block";
+  EXPECT_LT(stats.fragmentation, 1.0);
+
+  pmalloc_free(pm, a2);
+  pmalloc_free(pm, b2);
+  pmalloc_free(pm, c);
+  pmalloc_stats_get(pm, &stats);
+  EXPECT_EQ(stats.frees, 3u);
+  EXPECT_GT(stats.merges, 0u) << "Freeing everything should merge blocks";
+  EXPECT_EQ(stats.fragmentation, 0.0) << "Once everything is freed there's one free block";
+
+  // The JSON export should hold every field
+  FILE *out = tmpfile();
+  ASSERT_NE(out, nullptr);
+  pmalloc_stats_json(&stats, out);
+  char json[2048] = { 0 };
+  rewind(out);
+  ASSERT_GT(fread(json, 1, sizeof(json) - 1, out), 0u);
+  fclose(out);
+  EXPECT_EQ(json[0], '{');
+  EXPECT_NE(strstr(json, "\"frees\":3,"), nullptr) << json;
+  EXPECT_NE(strstr(json, "\"realloc_relocated\":1,"), nullptr) << json;
+  EXPECT_NE(strstr(json, "\"fragmentation\":0.0000,"), nullptr) << json;
+  EXPECT_NE(strstr(json, "\"mappedmem\":0}"), nullptr) << json;
+
+  pmalloc_stats_reset(pm);
+  pmalloc_stats_get(pm, &stats);
+  EXPECT_EQ(stats.allocs, 0u);
+  EXPECT_EQ(stats.searches, 0u);
+}
+#endif
+
+// Movable blocks should be slid together by pmalloc_compact, keeping their contents, unless locked
+TEST(PMAllocTest, HandleCompactTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[65536];
+  pmalloc_addblock(pm, &buffer, 65536);
+
+  // Fill the heap with movable blocks, each holding its own pattern
+  pmalloc_handle_t *handles[64];
+  uint32_t count = 0;
+  while(count < 64 && (handles[count] = pmalloc_halloc(pm, 1000)) != NULL) {
+    char *mem = (char*)pmalloc_hlock(pm, handles[count]);
+    EXPECT_EQ((uintptr_t)mem % PMALLOC_ALIGN, 0u) << "Handle memory should be aligned";
+    memset(mem, (int)count, 1000);
+    pmalloc_hunlock(pm, handles[count]);
+    count++;
+  }
+  ASSERT_GT(count, 20u);
+
+  // Free every other one, leaving holes too small for a big block
+  for(uint32_t i = 0; i<count; i += 2) {
+    pmalloc_hfree(pm, handles[i]);
+    handles[i] = NULL;
+  }
+  EXPECT_GT(pmalloc_freemem(pm), 8000u) << "There should be plenty of free memory";
+  EXPECT_EQ(pmalloc_malloc(pm, 8000), nullptr) << "But no block big enough";
+
+  // Lock the last one left, it mustn't move
+  uint32_t pin = (count - 1) % 2 ? count - 1 : count - 2;
+  void *pinned = pmalloc_hlock(pm, handles[pin]);
+
+  // A little at a time
+  uint32_t moved, passes = 0;
+  while((moved = pmalloc_compact(pm, 2000)) > 0) {
+    EXPECT_LE(moved, 2000u) << "Each pass should stay within its budget";
+    passes++;
+  }
+  EXPECT_GT(passes, 1u) << "The budget should split the work over several passes";
+
+  #ifdef DEBUG
+    printf("HandleCompactTest: Compacted:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  EXPECT_EQ(pmalloc_hlock(pm, handles[pin]), pinned) << "A locked block shouldn't move";
+  pmalloc_hunlock(pm, handles[pin]);
+  pmalloc_hunlock(pm, handles[pin]);
+
+  for(uint32_t i = 1; i<count; i += 2) {
+    char *mem = (char*)pmalloc_hlock(pm, handles[i]);
+    for(uint32_t k = 0; k<1000; k++) {
+      if(mem[k] != (char)i) {
+        ADD_FAILURE() << "Handle " << i << " lost its contents at " << k;
+        break;
+      }
+    }
+    pmalloc_hunlock(pm, handles[i]);
+  }
+
+  void *big = pmalloc_malloc(pm, 8000);
+  EXPECT_NE(big, nullptr) << "Compacting should leave a block big enough";
+  pmalloc_free(pm, big);
+
+  // pmalloc_halloc compacts by itself when it has to
+  for(uint32_t i = 1; i<count; i += 4) {
+    pmalloc_hfree(pm, handles[i]);
+    handles[i] = NULL;
+  }
+  pmalloc_handle_t *bigHandle = pmalloc_halloc(pm, 4000);
+  EXPECT_NE(bigHandle, nullptr) << "pmalloc_halloc should compact when there's no block big enough";
+  pmalloc_hfree(pm, bigHandle);
+
+  for(uint32_t i = 0; i<count; i++) pmalloc_hfree(pm, handles[i]);
+  EXPECT_EQ(pmalloc_overheadmem(pm), 2 * sizeof(pmalloc_item_t)) << "Only the handle table and the free block should be left";
+}
+
+static void release_region(void *ptr, uint32_t size, void *ctx) {
+  (void)ptr;
+  (void)size;
+  *(uint32_t*)ctx += 1;
+}
+
+// Regions should be kept track of, and free ones given back
+TEST(PMAllocTest, RegionTrimTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  alignas(4096) static char buffer[4][65536];
+  for(uint32_t i = 0; i<4; i++) pmalloc_addblock(pm, buffer[i], 65536);
+  uint32_t regionmem = pmalloc_totalmem(pm) / 4;
+
+  // A region can only be taken back once none of it is allocated
+  void *mem = pmalloc_malloc(pm, 100);
+  char *region = buffer[0];
+  for(uint32_t i = 0; i<4; i++) if(mem >= (void*)buffer[i] && mem < (void*)(buffer[i] + 65536)) region = buffer[i];
+  EXPECT_EQ(pmalloc_removeblock(pm, region), 0) << "pmalloc_removeblock shouldn't remove a region in use";
+  EXPECT_EQ(pmalloc_removeblock(pm, buffer[1] + 1), 0) << "pmalloc_removeblock should only take what pmalloc_addblock was given";
+  pmalloc_free(pm, mem);
+  EXPECT_EQ(pmalloc_removeblock(pm, region), 1) << "pmalloc_removeblock should remove a free region";
+  EXPECT_EQ(pmalloc_totalmem(pm), regionmem * 3);
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm));
+  EXPECT_EQ(pmalloc_overheadmem(pm), 3 * sizeof(pmalloc_item_t));
+  pmalloc_addblock(pm, region, 65536);
+
+  // Without anywhere to send them regions stay, but their free pages are dropped
+  mem = pmalloc_malloc(pm, 100);
+  uint32_t trimmed = pmalloc_trim(pm, 0);
+  #ifdef __unix__
+    EXPECT_GT(trimmed, 3 * 61440u) << "pmalloc_trim should drop the pages of the free blocks";
+    EXPECT_EQ(pmalloc_trim(pm, 0), 0u) << "pmalloc_trim shouldn't count pages it already dropped";
+  #endif
+  EXPECT_EQ(pmalloc_totalmem(pm), regionmem * 4) << "pmalloc_trim shouldn't remove regions without a release function";
+
+  // And the memory is still usable afterwards
+  void *big = pmalloc_malloc(pm, 60000);
+  ASSERT_NE(big, nullptr);
+  memset(big, 0x55, 60000);
+  pmalloc_free(pm, big);
+
+  // With somewhere to send them, the free regions go, as long as keep is left
+  uint32_t count = 0;
+  pmalloc_set_release(pm, release_region, &count);
+  EXPECT_EQ(pmalloc_trim(pm, pmalloc_freemem(pm)), 0u) << "pmalloc_trim shouldn't go below keep";
+  EXPECT_EQ(count, 0u);
+  EXPECT_GE(pmalloc_trim(pm, regionmem + 1), 2 * regionmem);
+  EXPECT_EQ(count, 2u) << "pmalloc_trim should release all but the free region needed to keep keep";
+  EXPECT_EQ(pmalloc_totalmem(pm), regionmem * 2);
+
+  pmalloc_trim(pm, 0);
+  EXPECT_EQ(count, 3u) << "pmalloc_trim should release every free region";
+  EXPECT_EQ(pmalloc_totalmem(pm), regionmem) << "Only the region in use should be left";
+
+  pmalloc_free(pm, mem);
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm));
+}
+
+// A heap with a provider should start empty and grow as it's used, a bigger region each time
+TEST(PMAllocTest, ProviderGrowTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+
+  static char buffer[262144];
+  pmalloc_static_t pool;
+  pmalloc_provider_static(pm, &pool, buffer, sizeof(buffer), 8192);
+  EXPECT_EQ(pmalloc_totalmem(pm), 0u) << "Nothing should be taken until it's needed";
+
+  // Small allocations grow the heap a region at a time, each twice the size of the last
+  void *mem[200];
+  for(uint32_t i = 0; i<200; i++) {
+    mem[i] = pmalloc_malloc(pm, 500);
+    ASSERT_NE(mem[i], nullptr) << "pmalloc_malloc should grow the heap";
+  }
+  uint32_t regions = 0;
+  for(pmalloc_region_t *region = PMALLOC_DEREF(pm, pmalloc_region_t, pm->regions); region != NULL; region = PMALLOC_DEREF(pm, pmalloc_region_t, region->next)) {
+    if(region->next) {
+      EXPECT_EQ(region->size, PMALLOC_DEREF(pm, pmalloc_region_t, region->next)->size * 2) << "Each region should be twice the size of the last";
+    }
+    regions++;
+  }
+  EXPECT_GT(regions, 2u);
+  EXPECT_EQ(pool.used, 8192u * ((1u << regions) - 1));
+
+  #ifdef DEBUG
+    printf("ProviderGrowTest: Grown:\n");
+    pmalloc_dump_stats(pm);
+  #endif
+
+  // A request bigger than the next region gets one of its own, just big enough
+  uint32_t used = pool.used, growsize = pm->growsize;
+  EXPECT_EQ(growsize, 8192u << regions);
+  void *big = pmalloc_malloc(pm, growsize + 1000);
+  ASSERT_NE(big, nullptr) << "A big request should get a region of its own";
+  EXPECT_LT(pool.used - used, growsize + 1000 + 256) << "Its region should be just big enough";
+  EXPECT_EQ(pm->growsize, growsize) << "A region of its own shouldn't change the growth";
+
+  // Until the pool runs out
+  EXPECT_EQ(pmalloc_malloc(pm, 200000), nullptr) << "pmalloc_malloc should fail once the provider has nothing left";
+
+  pmalloc_free(pm, big);
+  for(uint32_t i = 0; i<200; i++) pmalloc_free(pm, mem[i]);
+  EXPECT_EQ(pmalloc_freemem(pm), pmalloc_totalmem(pm));
+}
+
+#ifdef __unix__
+// The mmap provider should map a region of its own for a huge request, zeroed, and unmap it once it's free
+TEST(PMAllocTest, ProviderMmapTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+
+  pmalloc_init(pm);
+  pmalloc_set_engine(pm, PMALLOC_ENGINE_TLSF);
+  pmalloc_provider_mmap(pm, 65536);
+
+  char *small = (char*)pmalloc_malloc(pm, 1000);
+  ASSERT_NE(small, nullptr);
+  EXPECT_GE(pmalloc_totalmem(pm), 60000u);
+
+  uint32_t size = 3 * 1024 * 1024 + 100;
+  char *huge = (char*)pmalloc_calloc(pm, 1, size);
+  ASSERT_NE(huge, nullptr) << "A huge request should be mapped";
+  for(uint32_t i = 0; i<size; i += 4096) EXPECT_EQ(huge[i], 0) << "Fresh pages should be zero";
+  memset(huge, 1, size);
+
+  pmalloc_free(pm, huge);
+  pmalloc_trim(pm, 0);
+  EXPECT_LT(pmalloc_totalmem(pm), 1024u * 1024) << "pmalloc_trim should unmap the huge region";
+
+  pmalloc_free(pm, small);
+  pmalloc_trim(pm, 0);
+  EXPECT_EQ(pmalloc_totalmem(pm), 0u) << "pmalloc_trim should unmap every free region";
+}
+
+// Allocations over the mmap threshold should get a mapping of their own, resized by realloc and unmapped by free
+TEST(PMAllocTest, MmapThresholdTest) {
+  pmalloc_t pmblock;
+  pmalloc_t *pm = &pmblock;
+  static char buffer[262144];
+
+  pmalloc_init(pm);
+  pmalloc_addblock(pm, buffer, sizeof(buffer));
+  pmalloc_set_mmap_threshold(pm, 65536);
+  uint32_t total = pmalloc_totalmem(pm);
+  uint32_t free = pmalloc_freemem(pm);
+
+  // Below the threshold stays in the heap
+  char *small = (char*)pmalloc_malloc(pm, 60000);
+  ASSERT_NE(small, nullptr);
+  EXPECT_TRUE(small >= buffer && small < buffer + sizeof(buffer)) << "A block below the threshold should be in the heap";
+  pmalloc_free(pm, small);
+
+  // Even when it's too big for the heap, a block over it is mapped
+  uint32_t size = 300000;
+  char *big = (char*)pmalloc_malloc(pm, size);
+  ASSERT_NE(big, nullptr) << "A block over the threshold should be mapped";
+  EXPECT_TRUE(big < buffer || big >= buffer + sizeof(buffer)) << "A mapped block should be outside the heap";
+  EXPECT_TRUE(((pmalloc_item_t*)big - 1)->flags & PMALLOC_FLAG_MAPPED);
+  EXPECT_EQ(pmalloc_sizeof(pm, big), size) << "pmalloc_sizeof should work for a mapped block";
+  EXPECT_GE(pmalloc_mappedmem(pm), size);
+  EXPECT_EQ(pmalloc_freemem(pm), free) << "A mapped block shouldn't use the heap";
+  for(uint32_t i = 0; i<size; i++) big[i] = (char)i;
+
+  // calloc and memalign map too, already zero and aligned
+  char *zero = (char*)pmalloc_calloc(pm, 1000, 100);
+  ASSERT_NE(zero, nullptr);
+  for(uint32_t i = 0; i<100000; i += 997) EXPECT_EQ(zero[i], 0) << "A mapped calloc should be zero";
+  void *aligned = pmalloc_memalign(pm, 4096, 100000);
+  ASSERT_NE(aligned, nullptr);
+  EXPECT_EQ((uintptr_t)aligned % 4096, 0u) << "A mapped memalign should be aligned";
+  EXPECT_TRUE(((pmalloc_item_t*)aligned - 1)->flags & PMALLOC_FLAG_MAPPED);
+  pmalloc_free(pm, zero);
+  pmalloc_free(pm, aligned);
+
+  // realloc resizes the mapping, keeping the contents
+  big = (char*)pmalloc_realloc(pm, big, 1000000);
+  ASSERT_NE(big, nullptr) << "A mapped block should grow with its mapping";
+  EXPECT_EQ(pmalloc_sizeof(pm, big), 1000000u);
+  big[999999] = 1;
+  big = (char*)pmalloc_realloc(pm, big, 100000);
+  ASSERT_NE(big, nullptr);
+  EXPECT_TRUE(((pmalloc_item_t*)big - 1)->flags & PMALLOC_FLAG_MAPPED) << "A block still over the threshold should stay mapped";
+  EXPECT_LT(pmalloc_mappedmem(pm), 200000u) << "Shrinking should give back the pages";
+  bool same = true;
+  for(uint32_t i = 0; i<100000; i++) same = same && big[i] == (char)i;
+  EXPECT_TRUE(same) << "realloc should keep the contents of a mapped block";
+
+  // Until it's small enough for the heap
+  big = (char*)pmalloc_realloc(pm, big, 1000);
+  ASSERT_NE(big, nullptr);
+  EXPECT_TRUE(big >= buffer && big < buffer + sizeof(buffer)) << "A block below the threshold should move back into the heap";
+  for(uint32_t i = 0; i<1000; i++) same = same && big[i] == (char)i;
+  EXPECT_TRUE(same) << "realloc should keep the contents moving into the heap";
+  EXPECT_EQ(pmalloc_mappedmem(pm), 0u) << "Moving into the heap should unmap the block";
+
+#ifdef PMALLOC_STATS
+  EXPECT_EQ(pm->counters.remapped, 2u) << "Resizing a mapping should count as remapped";
+#endif
+#ifdef DEBUG
+  printf("MmapThresholdTest: Moved back:\n");
+  pmalloc_dump_stats(pm);
+#endif
+
+  // And straight back to the OS when it's freed
+  pmalloc_free(pm, big);
+  big = (char*)pmalloc_malloc(pm, 200000);
+  ASSERT_NE(big, nullptr);
+  EXPECT_GT(pmalloc_mappedmem(pm), 0u);
+  pmalloc_free(pm, big);
+  EXPECT_EQ(pmalloc_mappedmem(pm), 0u) << "pmalloc_free should unmap a mapped block";
+  EXPECT_EQ(pmalloc_totalmem(pm), total);
+  EXPECT_EQ(pmalloc_freemem(pm), free);
+}
+#endif
+
+#ifdef __unix__
+// A file heap should come back with its data and free space intact, and refuse files that aren't heaps
+TEST(PMAllocTest, FileHeapTest) {
+  typedef struct file_node {
+    uint32_t next;              // pmalloc_file_offset of the next node
+    uint32_t value;
+  } file_node_t;
+
+  char path[] = "/tmp/pmalloc_testXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  pmalloc_t *pm = pmalloc_open_file(path, 1024 * 1024);
+  ASSERT_NE(pm, nullptr) << "pmalloc_open_file should create a heap in an empty file";
+  EXPECT_EQ(pmalloc_file_root(pm), nullptr);
+
+  // A list linked by offsets, with holes freed between its nodes
+  uint32_t head = 0;
+  for(uint32_t i = 0; i<100; i++) {
+    file_node_t *node = (file_node_t*)pmalloc_malloc(pm, sizeof(file_node_t));
+    ASSERT_NE(node, nullptr);
+    node->next = head;
+    node->value = i;
+    head = pmalloc_file_offset(pm, node);
+    pmalloc_free(pm, pmalloc_malloc(pm, 200 + i));
+  }
+  pmalloc_file_set_root(pm, pmalloc_file_pointer(pm, head));
+  uint32_t freemem = pmalloc_freemem(pm);
+  EXPECT_EQ(pmalloc_sync(pm), 1);
+  pmalloc_close_file(pm);
+
+  pm = pmalloc_open_file(path, 0);
+  ASSERT_NE(pm, nullptr) << "pmalloc_open_file should reopen the heap";
+  EXPECT_EQ(pmalloc_freemem(pm), freemem) << "The heap should be as it was left";
+
+  uint32_t count = 0;
+  for(file_node_t *node = (file_node_t*)pmalloc_file_root(pm); node != NULL; node = (file_node_t*)pmalloc_file_pointer(pm, node->next)) {
+    EXPECT_EQ(node->value, 99 - count);
+    count++;
+  }
+  EXPECT_EQ(count, 100u) << "The list should survive reopening";
+
+  void *mem = pmalloc_malloc(pm, 10000);
+  EXPECT_NE(mem, nullptr) << "A reopened heap should still allocate";
+  pmalloc_free(pm, mem);
+  EXPECT_EQ(pmalloc_freemem(pm), freemem);
+
+  // A second mapping of the same file lands somewhere else, which only a relative heap can work with
+  pmalloc_t *other = pmalloc_open_file(path, 0);
+#ifdef PMALLOC_RELATIVE
+  ASSERT_NE(other, nullptr) << "A relative heap should open anywhere";
+  EXPECT_NE(other, pm);
+  EXPECT_EQ(((file_node_t*)pmalloc_file_root(other))->value, 99u);
+  mem = pmalloc_malloc(other, 500);
+  EXPECT_NE(mem, nullptr) << "A relative heap should allocate wherever it's mapped";
+  pmalloc_free(other, mem);
+  pmalloc_close_file(other);
+#else
+  EXPECT_EQ(other, nullptr) << "A heap of addresses should only open where it was created";
+#endif
+  pmalloc_close_file(pm);
+
+  // Anything without the header is refused
+  FILE *file = fopen(path, "r+b");
+  ASSERT_NE(file, nullptr);
+  fwrite("junk", 1, 4, file);
+  fclose(file);
+  EXPECT_EQ(pmalloc_open_file(path, 0), nullptr) << "pmalloc_open_file should refuse a file without the magic";
+
+  unlink(path);
+}
+
+// A file heap should never keep blocks mapped outside the file, nor trust the mappings another process left in it
+TEST(PMAllocTest, FileHeapMmapTest) {
+  char path[] = "/tmp/pmalloc_testXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  pmalloc_t *pm = pmalloc_open_file(path, 1024 * 1024);
+  ASSERT_NE(pm, nullptr);
+  EXPECT_EQ(pm->mmapthreshold, 0u) << "A new file heap shouldn't map blocks of its own";
+
+  // Even if the caller asks for it, the mappings don't outlive this process's hold on the file
+  pmalloc_set_mmap_threshold(pm, 65536);
+  char *big = (char*)pmalloc_malloc(pm, 200000);
+  ASSERT_NE(big, nullptr);
+  EXPECT_EQ(pm->nmapped, 1u);
+  memset(big, 1, 200000);
+  pmalloc_close_file(pm);
+
+  pm = pmalloc_open_file(path, 0);
+  ASSERT_NE(pm, nullptr) << "pmalloc_open_file should reopen the heap";
+  char *file = (char*)pm;
+  EXPECT_EQ(pm->mmapthreshold, 0u) << "Reopening should turn direct mapping off";
+  EXPECT_EQ(pm->nmapped, 0u) << "Reopening should forget the last process's mappings";
+  EXPECT_EQ(pmalloc_mappedmem(pm), 0u);
+
+  // So a big block comes from the file like any other
+  uint32_t freemem = pmalloc_freemem(pm);
+  big = (char*)pmalloc_malloc(pm, 200000);
+  ASSERT_NE(big, nullptr);
+  EXPECT_TRUE(big > file && big < file + 1024 * 1024) << "A reopened file heap should allocate inside the file";
+  big = (char*)pmalloc_realloc(pm, big, 300000);
+  ASSERT_NE(big, nullptr);
+  EXPECT_TRUE(big > file && big < file + 1024 * 1024);
+  pmalloc_free(pm, big);
+  EXPECT_EQ(pmalloc_freemem(pm), freemem);
+
+  pmalloc_close_file(pm);
+  unlink(path);
+}
+#endif
+
+#ifdef __unix__
+// Processes attached to the same shared heap should see each other's blocks, and carry on if one dies holding the lock
+TEST(PMAllocTest, SharedHeapTest) {
+  typedef struct shared_node {
+    uint32_t next;              // pmalloc_shared_offset of the next node
+    uint32_t value;
+  } shared_node_t;
+
+  char name[64];
+  snprintf(name, sizeof(name), "/pmalloc_test_%d", (int)getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  ASSERT_GE(fd, 0);
+  shm_unlink(name);
+
+  pmalloc_shared_t *sh = pmalloc_shared_create(fd, 1024 * 1024);
+  ASSERT_NE(sh, nullptr) << "pmalloc_shared_create should lay out a heap in an empty segment";
+  EXPECT_EQ(pmalloc_shared_create(fd, 1024 * 1024), nullptr) << "pmalloc_shared_create shouldn't reuse a segment";
+  uint32_t freemem = pmalloc_shared_freemem(sh);
+
+  // Function pointers and traces are private to a process, so a shared heap won't take them
+  pmalloc_t *pm = pmalloc_shared_lock(sh);
+  ASSERT_NE(pm, nullptr);
+  pmalloc_provider_mmap(pm, 65536);
+  EXPECT_EQ(pm->grow, nullptr) << "A shared heap shouldn't take a grow function";
+  EXPECT_EQ(pm->release, nullptr) << "A shared heap shouldn't take a release function";
+  pmalloc_set_mmap_threshold(pm, 4096);
+  EXPECT_EQ(pm->mmapthreshold, 0u) << "A shared heap shouldn't map blocks only one process can see";
+#ifdef PMALLOC_TRACE
+  static pmalloc_trace_t trace;
+  pmalloc_trace_start(pm, &trace, stderr);
+  EXPECT_EQ(pm->trace, nullptr) << "A shared heap shouldn't take a trace";
+  EXPECT_EQ(trace.failed, 1u);
+#endif
+  pmalloc_shared_unlock(sh);
+
+  // The head of a list every worker adds to, found through the root
+  uint32_t *head = (uint32_t*)pmalloc_shared_calloc(sh, 1, sizeof(uint32_t));
+  ASSERT_NE(head, nullptr);
+  pmalloc_shared_set_root(sh, head);
+
+  const uint32_t workers = 4;
+  for(uint32_t w = 0; w<workers; w++) {
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if(pid == 0) {
+      // Map the segment afresh, as an unrelated process would
+      pmalloc_shared_detach(sh);
+      pmalloc_shared_t *mine = pmalloc_shared_attach(fd);
+      if(mine == NULL) _exit(1);
+
+      for(uint32_t i = 0; i<100; i++) {
+        void *scratch = pmalloc_shared_malloc(mine, 50 + i);
+        shared_node_t *node = (shared_node_t*)pmalloc_shared_malloc(mine, sizeof(shared_node_t));
+        if(scratch == NULL || node == NULL) _exit(2);
+        node->value = w * 1000 + i;
+
+        if(pmalloc_shared_lock(mine) == NULL) _exit(3);
+        uint32_t *list = (uint32_t*)pmalloc_shared_root(mine);
+        node->next = *list;
+        *list = pmalloc_shared_offset(mine, node);
+        pmalloc_shared_unlock(mine);
+
+        pmalloc_shared_free(mine, scratch);
+      }
+
+      pmalloc_shared_detach(mine);
+      _exit(0);
+    }
+  }
+  for(uint32_t w = 0; w<workers; w++) {
+    int status;
+    ASSERT_GT(wait(&status), 0);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "Workers should attach and allocate";
+  }
+
+  // Every node every worker added is here, in blocks this process can free
+  uint32_t count = 0, sum = 0;
+  while(*head != 0) {
+    shared_node_t *node = (shared_node_t*)pmalloc_shared_pointer(sh, *head);
+    *head = node->next;
+    sum += node->value;
+    count++;
+    pmalloc_shared_free(sh, node);
+  }
+  EXPECT_EQ(count, workers * 100) << "The list should have every worker's nodes";
+  EXPECT_EQ(sum, 1000u * 100 * (0 + 1 + 2 + 3) + workers * 4950);
+
+#ifdef PMALLOC_RELATIVE
+  // A second mapping in the same process works too
+  pmalloc_shared_t *other = pmalloc_shared_attach(fd);
+  ASSERT_NE(other, nullptr) << "A relative heap should attach anywhere";
+  EXPECT_NE(other, sh);
+  EXPECT_EQ(pmalloc_shared_offset(other, pmalloc_shared_root(other)), pmalloc_shared_offset(sh, head));
+  pmalloc_shared_free(other, pmalloc_shared_malloc(other, 1000));
+  pmalloc_shared_detach(other);
+#else
+  EXPECT_EQ(pmalloc_shared_attach(fd), nullptr) << "A heap of addresses should only attach where it was created";
+#endif
+
+#ifdef __linux__
+  // A worker that dies holding the lock doesn't leave everyone else waiting for it
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if(pid == 0) {
+    pmalloc_shared_lock(sh);
+    _exit(0);
+  }
+  ASSERT_EQ(waitpid(pid, NULL, 0), pid);
+  EXPECT_EQ(pmalloc_shared_malloc(sh, 100), nullptr) << "A heap a process died changing shouldn't be trusted";
+  EXPECT_EQ(sh->recovered, 1u) << "The lock should be recovered from a dead process";
+  EXPECT_EQ(pmalloc_shared_lock(sh), nullptr) << "pmalloc_shared_lock should refuse a suspect heap";
+
+  // This one died between calls, so the heap is whole
+  pmalloc_shared_recover(sh);
+  void *mem = pmalloc_shared_malloc(sh, 100);
+  EXPECT_NE(mem, nullptr) << "pmalloc_shared_recover should make the heap usable again";
+  pmalloc_shared_free(sh, mem);
+#endif
+
+  pmalloc_shared_free(sh, head);
+  EXPECT_EQ(pmalloc_shared_freemem(sh), freemem) << "Everything should be back in the heap";
+
+  pmalloc_shared_detach(sh);
+  close(fd);
+}
+#endif
+
+#ifdef PMALLOC_PRELOAD_PATH
+// Programs run with libpmalloc_preload.so should work as normal, through pipes and forks, and report on exit
+TEST(PMAllocTest, PreloadTest) {
+  FILE *out = popen("LD_PRELOAD=" PMALLOC_PRELOAD_PATH " PMALLOC_PRELOAD_STATS=1 sh -c 'for i in 3 1 2; do echo line$i; done | sort | tr a-z A-Z' 2>&1", "r");
+  ASSERT_NE(out, nullptr);
+
+  std::string output;
+  char buffer[256];
+  while(fgets(buffer, sizeof(buffer), out) != NULL) output += buffer;
+  EXPECT_EQ(pclose(out), 0) << output;
+
+  EXPECT_NE(output.find("LINE1\nLINE2\nLINE3\n"), std::string::npos) << "The pipeline should run as normal: " << output;
+  EXPECT_NE(output.find("pmalloc: pid"), std::string::npos) << "PMALLOC_PRELOAD_STATS should report at exit: " << output;
+#ifdef DEBUG
+  printf("%s", output.c_str());
+#endif
+}
+#endif
+
+// Standard containers should keep their memory in the heap, and give all of it back
+TEST(PMAllocTest, AllocatorTest) {
+  static char buffer[262144];
+  pmalloc::heap heap(buffer, sizeof(buffer));
+  pmalloc_t *pm = heap;
+  uint32_t used = pmalloc_usedmem(pm);
+
+  {
+    std::vector<int, pmalloc::allocator<int>> vec(pm);
+    for(int i = 0; i<1000; i++) vec.push_back(i);
+    EXPECT_GE((char*)vec.data(), buffer) << "std::vector should allocate from the heap";
+    EXPECT_LT((char*)vec.data(), buffer + sizeof(buffer)) << "std::vector should allocate from the heap";
+
+    std::map<int, int, std::less<int>, pmalloc::allocator<std::pair<const int, int>>> map(pm);
+    for(int i = 0; i<1000; i++) map[i] = vec[i] * 2;
+    for(int i = 0; i<1000; i += 2) map.erase(i);
+    EXPECT_EQ(map.size(), 500u);
+    EXPECT_EQ(map[999], 1998);
+    EXPECT_GT(pmalloc_usedmem(pm), used);
+
+    // Over-aligned types get aligned blocks
+    struct alignas(64) line { char bytes[64]; };
+    std::vector<line, pmalloc::allocator<line>> lines(10, line(), pm);
+    EXPECT_EQ((uintptr_t)lines.data() % 64, 0u) << "pmalloc::allocator should honour alignof(T)";
+
+    // Rebound copies share the heap
+    pmalloc::allocator<char> bytes(vec.get_allocator());
+    EXPECT_TRUE(bytes == vec.get_allocator());
+    EXPECT_EQ(bytes.heap(), pm);
+
+    #ifdef DEBUG
+      printf("AllocatorTest: Containers:\n");
+      pmalloc_dump_stats(pm);
+    #endif
+  }
+  EXPECT_EQ(pmalloc_usedmem(pm), used) << "Containers should free everything they allocated";
+
+  // Running out throws, as it would for std::allocator
+  std::vector<char, pmalloc::allocator<char>> vec(pm);
+  EXPECT_THROW(vec.reserve(sizeof(buffer)), std::bad_alloc);
+
+  // A region is only in the heap while it's in scope
+  uint32_t total = pmalloc_totalmem(pm);
+  {
+    static char more[65536];
+    pmalloc::region region(pm, more, sizeof(more));
+    EXPECT_GT(pmalloc_totalmem(pm), total);
+  }
+  EXPECT_EQ(pmalloc_totalmem(pm), total) << "pmalloc::region should take its memory back";
+
+  // But not while something allocated from it is still in use
+  EXPECT_DEATH({
+    static char more[65536];
+    pmalloc::heap other;
+    pmalloc::region region(other, more, sizeof(more));
+    pmalloc_malloc(other, 100);
+  }, "") << "pmalloc::region should stop the program rather than leave the heap using memory that's gone";
+
+  // An arena scope frees what was allocated in it
+  {
+    pmalloc::arena arena(pm, 4096);
+    void *first = arena.alloc(100);
+    uint32_t base = pmalloc_usedmem(pm);
+    void *inner;
+    {
+      pmalloc::arena::scope scope(arena);
+      inner = arena.alloc(100);
+      for(uint32_t i = 0; i<100; i++) arena.alloc(100);
+      EXPECT_GT(pmalloc_usedmem(pm), base);
+    }
+    EXPECT_EQ(pmalloc_usedmem(pm), base) << "pmalloc::arena::scope should free the chunks started in it";
+    EXPECT_NE(inner, first);
+    EXPECT_EQ(arena.alloc(100), inner) << "pmalloc::arena::scope should roll back to where it started";
+  }
+  EXPECT_EQ(pmalloc_usedmem(pm), used) << "pmalloc::arena should give everything back";
+}
+
+#ifdef PMALLOC_PMR
+// The pmr containers, and the pools layered on top, should work from a heap
+TEST(PMAllocTest, MemoryResourceTest) {
+  static char buffer[262144];
+  pmalloc::heap heap(buffer, sizeof(buffer));
+  pmalloc_t *pm = heap;
+  uint32_t used = pmalloc_usedmem(pm);
+
+  pmalloc::memory_resource resource(pm);
+  pmalloc::memory_resource same(pm);
+  EXPECT_TRUE(resource.is_equal(same)) << "Resources for the same heap should compare equal";
+  EXPECT_FALSE(resource.is_equal(*std::pmr::new_delete_resource()));
+
+  {
+    std::pmr::vector<std::pmr::string> strings(&resource);
+    for(int i = 0; i<200; i++) strings.emplace_back(std::string(100, 'a' + i % 26));
+    EXPECT_EQ(strings[27][99], 'b');
+    EXPECT_EQ(strings.get_allocator().resource(), &resource);
+    EXPECT_EQ(strings[0].get_allocator().resource(), &resource) << "Elements should use the container's resource";
+
+    void *aligned = resource.allocate(100, 256);
+    EXPECT_EQ((uintptr_t)aligned % 256, 0u) << "pmalloc::memory_resource should honour the alignment";
+    resource.deallocate(aligned, 100, 256);
+  }
+  EXPECT_EQ(pmalloc_usedmem(pm), used) << "pmr containers should free everything they allocated";
+
+  {
+    std::pmr::unsynchronized_pool_resource pool(&resource);
+    std::pmr::map<int, int> map(&pool);
+    for(int i = 0; i<1000; i++) map[i] = i;
+    EXPECT_GT(pmalloc_usedmem(pm), used) << "The pool should take its memory from the heap";
+  }
+  EXPECT_EQ(pmalloc_usedmem(pm), used);
+
+  EXPECT_THROW((void)resource.allocate(sizeof(buffer)), std::bad_alloc);
+}
+#endif
+
+// The same work on containers with either allocator, see bench/pmalloc_bench_containers.cc for the timing
+template <template <class> class A>
+static uint64_t container_workload(uint32_t rounds, A<int> ints, A<std::pair<const int, int>> pairs) {
+  uint64_t sum = 0;
+
+  for(uint32_t r = 0; r<rounds; r++) {
+    std::vector<int, A<int>> vec(ints);
+    for(int i = 0; i<10000; i++) vec.push_back(i);
+    sum += vec[r % 10000];
+
+    std::map<int, int, std::less<int>, A<std::pair<const int, int>>> map(pairs);
+    for(int i = 0; i<2000; i++) map[(i * 7919) % 2000] = i;
+    for(int i = 0; i<2000; i += 3) map.erase(i);
+    sum += map.size();
+
+    std::list<int, A<int>> list(ints);
+    for(int i = 0; i<2000; i++) list.push_back(i);
+    while(list.size() > 100) {
+      sum += list.front();
+      list.pop_front();
+    }
+  }
+
+  return sum;
+}
+
+// Containers on pmalloc::allocator should do the same as on std::allocator, and give back everything
+TEST(PMAllocTest, ContainerTest) {
+  const uint32_t size = 8 * 1024 * 1024;
+  char *buffer = (char*)malloc(size);
+  ASSERT_NE(buffer, nullptr);
+  pmalloc::heap heap(buffer, size);
+  pmalloc_set_quick(heap, 256, 65536);
+  uint32_t used = pmalloc_usedmem(heap);
+
+  const uint32_t rounds = 5;
+  uint64_t stdSum = container_workload<std::allocator>(rounds, std::allocator<int>(), std::allocator<std::pair<const int, int>>());
+  uint64_t pmSum = container_workload<pmalloc::allocator>(rounds, pmalloc::allocator<int>(heap), pmalloc::allocator<std::pair<const int, int>>(heap));
+
+  EXPECT_EQ(pmSum, stdSum) << "The containers should behave the same with either allocator";
+  pmalloc_consolidate(heap);
+  EXPECT_EQ(pmalloc_usedmem(heap), used) << "The containers should free everything they allocated";
+
+  free(buffer);
+}
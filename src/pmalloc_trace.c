@@ -0,0 +1,51 @@
+//
+// pmalloc_trace - Recording of the calls made on a pmalloc_t
+//
+// When a trace is attached, every pmalloc_malloc, pmalloc_calloc, pmalloc_realloc, pmalloc_free,
+// pmalloc_memalign, pmalloc_halloc, pmalloc_hfree and pmalloc_compact call appends a fixed size record
+// to a ring buffer in the trace, which is written out in one go when it fills, so the cost on each call
+// is a few stores. The file is a
+// pmalloc_trace_header_t followed by the records, and can be replayed with pmalloc_replay.
+//
+
+#include "pmalloc_trace.h"
+
+void pmalloc_trace_start(pmalloc_t *pm, pmalloc_trace_t *trace, FILE *out)
+{
+	trace->out = out;
+	trace->count = 0;
+	trace->failed = 0;
+	trace->total = 0;
+
+	// The trace and its FILE are this process's, and a shared heap is every process's
+	if(pm->shared) {
+		trace->failed = 1;
+		return;
+	}
+
+	pmalloc_trace_header_t header;
+	header.magic = PMALLOC_TRACE_MAGIC;
+	header.version = PMALLOC_TRACE_VERSION;
+	header.recordsize = sizeof(pmalloc_trace_record_t);
+	header.engine = pm->engine;
+	header.totalmem = pm->totalmem;
+	if(fwrite(&header, sizeof(header), 1, out) != 1) trace->failed = 1;
+
+	pm->trace = trace;
+}
+
+void pmalloc_trace_stop(pmalloc_t *pm)
+{
+	if(pm->trace == NULL) return;
+
+	pmalloc_trace_flush(pm->trace);
+	fflush(pm->trace->out);
+	pm->trace = NULL;
+}
+
+void pmalloc_trace_flush(pmalloc_trace_t *trace)
+{
+	if(trace->count > 0 && !trace->failed && fwrite(trace->ring, sizeof(pmalloc_trace_record_t), trace->count, trace->out) != trace->count)
+		trace->failed = 1;
+	trace->count = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef PMALLOC_TRACE_H
+#define PMALLOC_TRACE_H
+
+#include <stdio.h>
+
+#include "pmalloc.h"
+
+// The number of records buffered before they're written out
+#ifndef PMALLOC_TRACE_RING
+#define PMALLOC_TRACE_RING 512
+#endif
+
+// Trace file header
+#define PMALLOC_TRACE_MAGIC     0x52544D50  // "PMTR"
+#define PMALLOC_TRACE_VERSION   2           // 2 added the handle and compact calls
+
+// Recorded calls
+#define PMALLOC_TRACE_MALLOC    1
+#define PMALLOC_TRACE_CALLOC    2           // size is num * size, UINT32_MAX if that overflows
+#define PMALLOC_TRACE_REALLOC   3
+#define PMALLOC_TRACE_FREE      4
+#define PMALLOC_TRACE_MEMALIGN  5           // Also pmalloc_aligned_alloc
+#define PMALLOC_TRACE_HALLOC    6           // result is the handle
+#define PMALLOC_TRACE_HFREE     7           // ptr is the handle
+#define PMALLOC_TRACE_COMPACT   8           // size is the budget
+
+typedef struct pmalloc_trace_header {
+    uint32_t magic;             // PMALLOC_TRACE_MAGIC
+    uint16_t version;           // PMALLOC_TRACE_VERSION
+    uint16_t recordsize;        // sizeof(pmalloc_trace_record_t)
+    uint32_t engine;            // The engine of the traced pmalloc_t
+    uint32_t totalmem;          // Its total memory when tracing started
+} pmalloc_trace_header_t;
+
+typedef struct pmalloc_trace_record {
+    uint64_t ptr;               // The block or handle passed in (realloc, free, hfree), 0 if none
+    uint64_t result;            // The block or handle returned (malloc, calloc, realloc, memalign, halloc), 0 if none or on failure
+    uint32_t size;              // The size requested
+    uint8_t op;                 // PMALLOC_TRACE_*
+    uint8_t alignlog2;          // log2 of the alignment requested (memalign)
+    uint16_t reserved;
+} pmalloc_trace_record_t;
+
+typedef struct pmalloc_trace {
+    FILE *out;                  // Where the records are written
+    uint32_t count;             // The number of records in ring
+    uint32_t failed;            // Set if a write has failed, later records are dropped
+    uint64_t total;             // The number of records recorded since pmalloc_trace_start
+    pmalloc_trace_record_t ring[PMALLOC_TRACE_RING];
+} pmalloc_trace_t;
+
+void pmalloc_trace_start(pmalloc_t *pm, pmalloc_trace_t *trace, FILE *out);     // Start recording every call on pm to out, through trace, unless pm is a shared heap (trace->failed is set)
+void pmalloc_trace_stop(pmalloc_t *pm);                                          // Write out any buffered records and stop recording
+void pmalloc_trace_flush(pmalloc_trace_t *trace);                                // Write out any buffered records
+
+// Internals
+static inline void pmalloc_trace_record(pmalloc_trace_t *trace, uint8_t op, void *ptr, uint32_t size, uint32_t alignment, void *result)
+{
+    pmalloc_trace_record_t *record = &trace->ring[trace->count];
+    record->ptr = (uintptr_t)ptr;
+    record->result = (uintptr_t)result;
+    record->size = size;
+    record->op = op;
+    record->alignlog2 = 0;
+    while(record->alignlog2 < 31 && (1U << record->alignlog2) < alignment) record->alignlog2++;
+    record->reserved = 0;
+    trace->total++;
+
+    if(++trace->count == PMALLOC_TRACE_RING) pmalloc_trace_flush(trace);
+}
+
+#endif
@@ -0,0 +1,244 @@
+//
+// pmalloc_replay - Replay a trace recorded with pmalloc_trace_start against a fresh pmalloc_t
+//
+// Usage: pmalloc_replay <trace> [engine] [heap MB] [interval]
+//
+//   engine     segregated, tlsf or bestfit, the engine the trace was recorded with by default
+//   heap MB    the size of the heap to replay into, the size of the traced heap by default
+//   interval   how many operations between lines of the fragmentation report, 10% of the trace by default
+//
+// Blocks are matched up by the addresses in the trace, so a realloc or free in the trace acts on the
+// block the replay got for the same allocation, and handles by theirs in the same way. Locking a handle
+// isn't traced, so compaction in the replay can move blocks that were locked when the trace was made. Reports timing, the peak memory in use and how
+// fragmented the heap was over the course of the trace.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pmalloc.h"
+#include "pmalloc_trace.h"
+
+// Traced address to replayed block, open addressing with linear probing
+typedef struct replay_map {
+	uint64_t *keys;     // 0 for an empty slot
+	void **values;
+	uint32_t capacity;  // A power of two
+	uint32_t count;
+} replay_map_t;
+
+static uint32_t replay_hash(replay_map_t *map, uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (uint32_t)key & (map->capacity - 1);
+}
+
+static void replay_map_init(replay_map_t *map, uint32_t capacity)
+{
+	map->keys = calloc(capacity, sizeof(uint64_t));
+	map->values = calloc(capacity, sizeof(void*));
+	map->capacity = capacity;
+	map->count = 0;
+	if(map->keys == NULL || map->values == NULL) {
+		fprintf(stderr, "pmalloc_replay: Out of memory\n");
+		exit(1);
+	}
+}
+
+static void replay_map_put(replay_map_t *map, uint64_t key, void *value);
+
+static void replay_map_grow(replay_map_t *map)
+{
+	replay_map_t old = *map;
+	replay_map_init(map, old.capacity * 2);
+	for(uint32_t i = 0; i < old.capacity; i++) if(old.keys[i] != 0) replay_map_put(map, old.keys[i], old.values[i]);
+	free(old.keys);
+	free(old.values);
+}
+
+static void replay_map_put(replay_map_t *map, uint64_t key, void *value)
+{
+	if((map->count + 1) * 2 > map->capacity) replay_map_grow(map);
+
+	uint32_t i = replay_hash(map, key);
+	while(map->keys[i] != 0 && map->keys[i] != key) i = (i + 1) & (map->capacity - 1);
+	if(map->keys[i] == 0) map->count++;
+	map->keys[i] = key;
+	map->values[i] = value;
+}
+
+// Remove key and return its value, or NULL if it isn't there
+static void *replay_map_take(replay_map_t *map, uint64_t key)
+{
+	uint32_t i = replay_hash(map, key);
+	while(map->keys[i] != key) {
+		if(map->keys[i] == 0) return NULL;
+		i = (i + 1) & (map->capacity - 1);
+	}
+	void *value = map->values[i];
+
+	// Shift back any entries after it that would no longer be found past the gap
+	uint32_t gap = i;
+	for(uint32_t j = (i + 1) & (map->capacity - 1); map->keys[j] != 0; j = (j + 1) & (map->capacity - 1)) {
+		uint32_t home = replay_hash(map, map->keys[j]);
+		if(((j - home) & (map->capacity - 1)) >= ((j - gap) & (map->capacity - 1))) {
+			map->keys[gap] = map->keys[j];
+			map->values[gap] = map->values[j];
+			gap = j;
+		}
+	}
+	map->keys[gap] = 0;
+	map->count--;
+
+	return value;
+}
+
+static int replay_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void replay_report(pmalloc_t *pm, uint64_t op)
+{
+	uint32_t holes = pmalloc_freemem(pm) - pmalloc_largestfree(pm);
+	uint32_t used = pmalloc_usedmem(pm);
+	printf("%12llu %12u %12u %12u %8.3f\n", (unsigned long long)op, used / 1024, pmalloc_freemem(pm) / 1024,
+		pmalloc_largestfree(pm) / 1024, used + holes == 0 ? 0.0 : (double)holes / (used + holes));
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <trace> [segregated|tlsf|bestfit] [heap MB] [interval]\n", argv[0]);
+		return 1;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if(in == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	pmalloc_trace_header_t header;
+	if(fread(&header, sizeof(header), 1, in) != 1 || header.magic != PMALLOC_TRACE_MAGIC) {
+		fprintf(stderr, "pmalloc_replay: %s is not a pmalloc trace\n", argv[1]);
+		return 1;
+	}
+	// Version 1 traces are version 2 without the handle and compact calls
+	if(header.version < 1 || header.version > PMALLOC_TRACE_VERSION || header.recordsize != sizeof(pmalloc_trace_record_t)) {
+		fprintf(stderr, "pmalloc_replay: %s is trace version %u, expected 1 to %u\n", argv[1], header.version, PMALLOC_TRACE_VERSION);
+		return 1;
+	}
+
+	// Read the whole trace up front, so reading it isn't timed
+	fseek(in, 0, SEEK_END);
+	uint64_t count = (ftell(in) - sizeof(header)) / sizeof(pmalloc_trace_record_t);
+	fseek(in, sizeof(header), SEEK_SET);
+	pmalloc_trace_record_t *records = malloc(count * sizeof(pmalloc_trace_record_t) + 1);
+	uint32_t *latency = malloc(count * sizeof(uint32_t) + 1);
+	if(records == NULL || latency == NULL || fread(records, sizeof(pmalloc_trace_record_t), count, in) != count) {
+		fprintf(stderr, "pmalloc_replay: Can't read %s\n", argv[1]);
+		return 1;
+	}
+	fclose(in);
+
+	pmalloc_engine_t engine = (pmalloc_engine_t)header.engine;
+	if(argc > 2) {
+		if(strcmp(argv[2], "segregated") == 0) engine = PMALLOC_ENGINE_SEGREGATED;
+		else if(strcmp(argv[2], "tlsf") == 0) engine = PMALLOC_ENGINE_TLSF;
+		else if(strcmp(argv[2], "bestfit") == 0) engine = PMALLOC_ENGINE_BESTFIT;
+		else {
+			fprintf(stderr, "pmalloc_replay: Unknown engine %s\n", argv[2]);
+			return 1;
+		}
+	}
+
+	uint64_t heapSize = argc > 3 ? (uint64_t)atoi(argv[3]) * 1024 * 1024 : (uint64_t)header.totalmem + 4096;
+	if(heapSize > UINT32_MAX) {
+		fprintf(stderr, "pmalloc_replay: A %llu byte heap is too big, a pmalloc_t can manage at most %u bytes\n", (unsigned long long)heapSize, UINT32_MAX);
+		return 1;
+	}
+	uint64_t interval = argc > 4 ? (uint64_t)atoll(argv[4]) : count / 10;
+	if(interval == 0) interval = 1;
+
+	char *memory = malloc(heapSize);
+	if(memory == NULL) {
+		fprintf(stderr, "pmalloc_replay: Can't allocate a %llu byte heap\n", (unsigned long long)heapSize);
+		return 1;
+	}
+
+	pmalloc_t pm;
+	pmalloc_init(&pm);
+	pmalloc_set_engine(&pm, engine);
+	pmalloc_addblock(&pm, memory, (uint32_t)heapSize);
+
+	replay_map_t map;
+	replay_map_init(&map, 1024);
+
+	uint64_t total = 0, failures = 0;
+	uint32_t peak = 0;
+
+	printf("pmalloc: Replaying %llu operations from %s\n\n", (unsigned long long)count, argv[1]);
+	printf("%12s %12s %12s %12s %8s\n", "op", "used KB", "free KB", "largest KB", "frag");
+
+	for(uint64_t i = 0; i < count; i++) {
+		pmalloc_trace_record_t *record = &records[i];
+		void *ptr = record->ptr != 0 ? replay_map_take(&map, record->ptr) : NULL;
+		void *result = NULL;
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		switch(record->op) {
+			case PMALLOC_TRACE_MALLOC: result = pmalloc_malloc(&pm, record->size); break;
+			case PMALLOC_TRACE_CALLOC: result = pmalloc_calloc(&pm, 1, record->size); break;
+			case PMALLOC_TRACE_REALLOC: result = pmalloc_realloc(&pm, ptr, record->size); break;
+			case PMALLOC_TRACE_FREE: pmalloc_free(&pm, ptr); break;
+			case PMALLOC_TRACE_MEMALIGN: result = pmalloc_memalign(&pm, 1U << record->alignlog2, record->size); break;
+			case PMALLOC_TRACE_HALLOC: result = pmalloc_halloc(&pm, record->size); break;
+			case PMALLOC_TRACE_HFREE: pmalloc_hfree(&pm, (pmalloc_handle_t*)ptr); break;
+			case PMALLOC_TRACE_COMPACT: pmalloc_compact(&pm, record->size); break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		uint64_t elapsed = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+		latency[i] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+		total += elapsed;
+
+		// Remember the block the trace will refer to by the address it got back. A failed realloc leaves the
+		// old block in place, so whichever of the trace and the replay failed, the other's block carries on.
+		if(record->result != 0 && result == NULL) failures++;
+		uint64_t key = record->result;
+		if(record->op == PMALLOC_TRACE_REALLOC && ptr != NULL) {
+			if(key == 0) key = record->ptr;
+			if(result == NULL) result = ptr;
+		}
+		if(key != 0 && result != NULL) replay_map_put(&map, key, result);
+
+		if(pmalloc_usedmem(&pm) > peak) peak = pmalloc_usedmem(&pm);
+		if((i + 1) % interval == 0) replay_report(&pm, i + 1);
+	}
+
+	if(count > 0) {
+		qsort(latency, count, sizeof(uint32_t), replay_compare);
+		printf("\n");
+		printf("Operations:      %llu\n", (unsigned long long)count);
+		printf("Failures:        %llu (allocations that succeeded in the trace but not here)\n", (unsigned long long)failures);
+		printf("Time:            %.3f ms (%.0f ops/sec)\n", total / 1e6, count / (total / 1e9));
+		printf("Latency:         p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n", latency[count / 2], latency[count * 99 / 100],
+			latency[count * 999 / 1000], latency[count - 1]);
+		printf("Peak used:       %u KB\n", peak / 1024);
+		printf("Still allocated: %u blocks, %u KB\n", map.count, pmalloc_usedmem(&pm) / 1024);
+	}
+
+	free(map.keys);
+	free(map.values);
+	free(latency);
+	free(records);
+	free(memory);
+	return 0;
+}